@@ -0,0 +1,182 @@
+/*
+ * buse-replay - replay a request trace against a block device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ * Reads a trace recorded with a backend's --trace and issues the same
+ * requests, one at a time as buse_main() served them, to DEVICE: normally
+ * the /dev/nbdX of a backend started for the comparison, so any backend and
+ * any layout or cache setting can be driven with the same workload. Writes
+ * carry pseudo-random data, since traces don't keep payloads. Requests are
+ * issued at their original times (scaled by -s), or back to back with -f.
+ * At the end the recorded and the replayed latencies are printed side by
+ * side.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/nbd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buse.h"
+#include "hist.h"
+#include "trace.h"
+
+#define MAX_LEN (32 << 20) // largest request buse-replay can issue
+
+static const char *op_names[BUSE_OPS] = { "read", "write", "flush", "trim" };
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: buse-replay [-f | -s <speed>] <trace file> <device>\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int transfer(int fd, int write, char *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = EIO; // past the end of the device
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Issue one traced request to fd. Returns 0 or -1 with errno set. */
+static int issue(int fd, bool blkdev, const struct trace_record *r, char *buf)
+{
+    switch (r->op) {
+    case BUSE_READ:
+        return transfer(fd, 0, buf, r->len, r->offset);
+    case BUSE_WRITE:
+        if (transfer(fd, 1, buf, r->len, r->offset) != 0) return -1;
+        return r->cmd_flags & (NBD_CMD_FLAG_FUA >> 16) ? fdatasync(fd) : 0;
+    case BUSE_FLUSH:
+        return fdatasync(fd);
+    case BUSE_TRIM:
+        if (blkdev) {
+            uint64_t range[2] = { r->offset, r->len };
+            return ioctl(fd, BLKDISCARD, range);
+        }
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, r->offset, r->len);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    bool fast = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fs:")) != -1) {
+        if (opt == 'f') {
+            fast = true;
+        } else if (opt == 's' && (speed = atof(optarg)) > 0) {
+            continue;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "r");
+    struct trace_header h;
+    if (in == NULL || fread(&h, sizeof(h), 1, in) != 1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 || h.record_size < sizeof(struct trace_record)) {
+        fprintf(stderr, "ERROR: %s is not a request trace.\n", argv[optind]);
+        return 1;
+    }
+
+    // O_DIRECT so the page cache doesn't absorb what the trace sent to the backend
+    int fd = open(argv[optind + 1], O_RDWR | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(argv[optind + 1], O_RDWR);
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    char *buf;
+    if (posix_memalign((void **)&buf, 4096, MAX_LEN) != 0) {
+        perror("buse-replay");
+        return 1;
+    }
+    for (size_t i = 0; i < MAX_LEN; i++) {
+        buf[i] = rand();
+    }
+
+    static struct hist traced[BUSE_OPS], replayed[BUSE_OPS];
+    uint64_t errors = 0, skipped = 0, count = 0, last_ns = 0;
+    char *rec = malloc(h.record_size);
+    uint64_t start = now_ns();
+    while (rec && fread(rec, h.record_size, 1, in) == 1) {
+        struct trace_record *r = (struct trace_record *)rec;
+        if (r->op >= BUSE_OPS || r->len > MAX_LEN) {
+            skipped++;
+            continue;
+        }
+        if (!fast) {
+            sleep_until(start + (uint64_t)(r->time_ns / speed));
+        }
+        uint64_t t = now_ns();
+        if (issue(fd, S_ISBLK(st.st_mode), r, buf) != 0) {
+            if (errors++ == 0) {
+                fprintf(stderr, "%s at offset %lu: %s\n", op_names[r->op], r->offset, strerror(errno));
+            }
+        }
+        hist_add(&replayed[r->op], (now_ns() - t) / 1000);
+        hist_add(&traced[r->op], r->latency_us);
+        last_ns = r->time_ns + r->latency_us * 1000ull;
+        count++;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%lu requests in %.2f s (traced: %.2f s), %lu errors, %lu skipped\n", count, secs, last_ns / 1e9, errors, skipped);
+    printf("%-6s %10s %12s %12s %12s %12s\n", "", "count", "traced_p50", "replay_p50", "traced_p99", "replay_p99");
+    for (int op = 0; op < BUSE_OPS; op++) {
+        if (traced[op].count == 0) continue;
+        printf("%-6s %10lu %10lu us %10lu us %10lu us %10lu us\n", op_names[op], traced[op].count,
+               hist_percentile(&traced[op], 0.5), hist_percentile(&replayed[op], 0.5),
+               hist_percentile(&traced[op], 0.99), hist_percentile(&replayed[op], 0.99));
+    }
+    return errors ? 1 : 0;
+}
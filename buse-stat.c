@@ -0,0 +1,222 @@
+/*
+ * buse-stat - show the statistics of a running backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ * Connects to the socket given to a backend's --stats, asks for "stats" and
+ * prints a table. With -i SECONDS it keeps sampling and shows rates over
+ * each interval; otherwise rates are averages since the backend started.
+ * Latency percentiles are always since start.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_LINES 64
+#define MAX_WORDS 96
+
+struct line {
+    int nwords;
+    char *word[MAX_WORDS];
+};
+
+struct sample {
+    char *text;
+    int nlines;
+    struct line line[MAX_LINES];
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: buse-stat [-i <seconds>] <stats socket>\n");
+}
+
+/* Ask the backend at path for its statistics. Returns 0 or -1 (reported). */
+static int fetch(const char *path, struct sample *s)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    // the backend answers and closes once it has seen the end of our request
+    const char req[] = "stats\n";
+    if (write(fd, req, sizeof(req) - 1) != sizeof(req) - 1 || shutdown(fd, SHUT_WR) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    size_t len = 0, cap = 65536;
+    s->text = malloc(cap);
+    ssize_t n;
+    while (s->text && (n = read(fd, s->text + len, cap - len - 1)) > 0) {
+        len += n;
+        if (len + 1 == cap) {
+            s->text = realloc(s->text, cap *= 2);
+        }
+    }
+    close(fd);
+    if (s->text == NULL) {
+        perror("buse-stat");
+        return -1;
+    }
+    s->text[len] = '\0';
+
+    s->nlines = 0;
+    char *save = NULL;
+    for (char *l = strtok_r(s->text, "\n", &save); l && s->nlines < MAX_LINES; l = strtok_r(NULL, "\n", &save)) {
+        struct line *ln = &s->line[s->nlines++];
+        char *wsave = NULL;
+        ln->nwords = 0;
+        for (char *w = strtok_r(l, " ", &wsave); w && ln->nwords < MAX_WORDS; w = strtok_r(NULL, " ", &wsave)) {
+            ln->word[ln->nwords++] = w;
+        }
+    }
+    return 0;
+}
+
+/* The value after key on a line (pairs start after the first two words), or NULL. */
+static const char *get(const struct line *ln, const char *key)
+{
+    for (int i = 2; i + 1 < ln->nwords; i += 2) {
+        if (strcmp(ln->word[i], key) == 0) return ln->word[i + 1];
+    }
+    return NULL;
+}
+
+static double num(const struct line *ln, const char *key)
+{
+    const char *v = ln ? get(ln, key) : NULL;
+    return v ? strtod(v, NULL) : 0;
+}
+
+/* The line in s that starts with the same two words as ln, or NULL. */
+static const struct line *match(const struct sample *s, const struct line *ln)
+{
+    for (int i = 0; s && i < s->nlines; i++) {
+        const struct line *o = &s->line[i];
+        if (o->nwords >= 2 && ln->nwords >= 2 && strcmp(o->word[0], ln->word[0]) == 0 && strcmp(o->word[1], ln->word[1]) == 0) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+static double uptime(const struct sample *s)
+{
+    for (int i = 0; s && i < s->nlines; i++) {
+        if (s->line[i].nwords == 2 && strcmp(s->line[i].word[0], "uptime_us") == 0) {
+            return strtod(s->line[i].word[1], NULL) / 1e6;
+        }
+    }
+    return 0;
+}
+
+/* Print cur, with rates taken against prev (or since start if NULL). */
+static void show(const struct sample *cur, const struct sample *prev)
+{
+    double secs = uptime(cur) - uptime(prev);
+    if (secs <= 0) secs = 1;
+
+    printf("%-8s %10s %10s %8s %8s %8s %8s %8s %8s\n", "request", "iops", "MB/s", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int i = 0; i < cur->nlines; i++) {
+        const struct line *ln = &cur->line[i], *old = match(prev, ln);
+        if (strcmp(ln->word[0], "op") != 0) continue;
+        printf("%-8s %10.0f %10.1f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f\n", ln->word[1],
+               (num(ln, "lat_count") - num(old, "lat_count")) / secs,
+               (num(ln, "bytes") - num(old, "bytes")) / secs / 1e6,
+               num(ln, "errors"), num(ln, "lat_mean_us"), num(ln, "lat_p50_us"),
+               num(ln, "lat_p99_us"), num(ln, "lat_p999_us"), num(ln, "lat_max_us"));
+    }
+
+    int header = 0;
+    for (int i = 0; i < cur->nlines; i++) {
+        const struct line *ln = &cur->line[i], *old = match(prev, ln);
+        if (strcmp(ln->word[0], "member") != 0) continue;
+        if (!header++) {
+            printf("\n%-3s %-20s %-10s %5s %6s %9s %8s %8s %8s %9s %8s %8s %8s\n", "dev", "path", "state", "queue", "errors",
+                   "read_iops", "rd_MB/s", "rd_p50", "rd_p99", "write_iop", "wr_MB/s", "wr_p50", "wr_p99");
+        }
+        printf("%-3s %-20s %-10s %5.0f %6.0f %9.0f %8.1f %8.0f %8.0f %9.0f %8.1f %8.0f %8.0f\n", ln->word[1],
+               get(ln, "path") ? get(ln, "path") : "-", get(ln, "state") ? get(ln, "state") : "-",
+               num(ln, "inflight"), num(ln, "errors"),
+               (num(ln, "read_count") - num(old, "read_count")) / secs,
+               (num(ln, "read_bytes") - num(old, "read_bytes")) / secs / 1e6,
+               num(ln, "read_p50_us"), num(ln, "read_p99_us"),
+               (num(ln, "write_count") - num(old, "write_count")) / secs,
+               (num(ln, "write_bytes") - num(old, "write_bytes")) / secs / 1e6,
+               num(ln, "write_p50_us"), num(ln, "write_p99_us"));
+    }
+
+    header = 0;
+    for (int i = 0; i < cur->nlines; i++) {
+        const struct line *ln = &cur->line[i];
+        if (strcmp(ln->word[0], "qos") != 0) continue;
+        // what the class moved, over all members
+        char key[64];
+        double bytes = 0;
+        snprintf(key, sizeof(key), "%s_bytes", ln->word[1]);
+        for (int j = 0; j < cur->nlines; j++) {
+            const struct line *m = &cur->line[j];
+            if (strcmp(m->word[0], "member") == 0) bytes += num(m, key) - num(match(prev, m), key);
+        }
+        if (!header++) {
+            printf("\n%-10s %8s %10s %10s %10s\n", "background", "MB/s", "limit_MB/s", "cap_MB/s", "target_us");
+        }
+        printf("%-10s %8.1f %10.1f %10.1f %10.0f\n", ln->word[1], bytes / secs / 1e6,
+               num(ln, "rate_bps") / 1e6, num(ln, "cap_bps") / 1e6, num(ln, "target_us"));
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int interval = 0, opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        if (opt != 'i' || (interval = atoi(optarg)) <= 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+        return 1;
+    }
+
+    struct sample a, b, *cur = &a, *prev = NULL;
+    if (fetch(argv[optind], cur) != 0) {
+        return 1;
+    }
+    if (interval == 0) {
+        show(cur, NULL);
+        return 0;
+    }
+    for (;;) {
+        prev = cur;
+        cur = cur == &a ? &b : &a;
+        sleep(interval);
+        if (fetch(argv[optind], cur) != 0) {
+            return 1;
+        }
+        printf("\n");
+        show(cur, prev);
+        free(prev->text);
+    }
+}
@@ -30,12 +30,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "crc32c.h"
+#include "probes.h"
+#include "trace.h"
 
 #ifndef BUSE_DEBUG
   #define BUSE_DEBUG (0)
@@ -89,6 +94,18 @@ static int write_all(int fd, char* buf, size_t count)
   return 0;
 }
 
+/* The nbd device of the running buse_main(), for buse_set_size(). */
+static int nbd_dev = -1;
+
+int buse_set_size(u_int64_t size)
+{
+  if (nbd_dev == -1) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  return ioctl(nbd_dev, NBD_SET_SIZE, size);
+}
+
 /* Signal handler to gracefully disconnect from nbd kernel driver. */
 static int nbd_dev_to_disconnect = -1;
 static void disconnect_nbd(int signal) {
@@ -113,91 +130,340 @@ static int set_sigaction(int sig, const struct sigaction * act) {
   return r;
 }
 
-/* Serve userland side of nbd socket. If everything worked ok, return 0. */
-static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata) {
+struct buse_stats buse_stats;
+
+static u_int64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/* Request trace being recorded, see buse_trace(). */
+static struct trace *trace;
+
+int buse_trace(const char *path, int hashes)
+{
+  trace = trace_open(path, hashes);
+  return trace ? 0 : -1;
+}
+
+/* Count a request that was received at start (traced at trace_start) and has
+ * just been answered; data is what was read or written, if anything. */
+static void account(enum buse_op op, const struct nbd_request *request, int error,
+                    u_int64_t start, u_int64_t trace_start, const void *data)
+{
+  u_int32_t len = op == BUSE_FLUSH ? 0 : ntohl(request->len);
+  u_int64_t us = now_us() - start, handle;
+  memcpy(&handle, request->handle, sizeof(handle));
+  PROBE4(reply, handle, op, error, us);
+  hist_add(&buse_stats.latency[op], us);
+  __atomic_fetch_add(&buse_stats.bytes[op], len, __ATOMIC_RELAXED);
+  if (error)
+    __atomic_fetch_add(&buse_stats.errors[op], 1, __ATOMIC_RELAXED);
+
+  if (trace) {
+    struct trace_record r = {
+      .time_ns = trace_start,
+      .offset = ntohll(request->from),
+      .len = len,
+      .op = op,
+      .error = error != 0,
+      .cmd_flags = ntohl(request->type) >> 16,
+      .latency_us = us,
+      .hash = data && trace_hashes(trace) ? crc32c(0, data, len) : 0,
+    };
+    trace_add(trace, &r);
+  }
+}
+
+/* A request read from the socket, with the payload of a write, that has not
+ * been answered yet. */
+struct pending {
+  struct nbd_request request;
+  u_int32_t type;               // NBD_CMD_*
+  u_int32_t flags;              // NBD_CMD_FLAG_*
   u_int64_t from;
   u_int32_t len;
-  ssize_t bytes_read;
-  struct nbd_request request;
+  void *data;
+  u_int64_t start, trace_start;
+};
+
+/* Read the next request. Returns 1, 0 once the socket is closed, or -1 on
+ * error. */
+static int receive(int sk, struct pending *p)
+{
+  ssize_t bytes_read = read(sk, &p->request, sizeof(p->request));
+  if (bytes_read <= 0)
+    return bytes_read;
+  assert(bytes_read == sizeof(p->request));
+  u_int64_t handle;
+
+  p->type = ntohl(p->request.type) & 0xffff;
+  p->flags = ntohl(p->request.type) & ~0xffff;
+  p->len = ntohl(p->request.len);
+  p->from = ntohll(p->request.from);
+  p->data = NULL;
+  p->start = now_us();
+  p->trace_start = trace ? trace_now(trace) : 0;
+  memcpy(&handle, p->request.handle, sizeof(handle));
+  PROBE4(request, handle, ntohl(p->request.type), p->from, p->len);
+  assert(p->request.magic == htonl(NBD_REQUEST_MAGIC));
+
+  if (p->type == NBD_CMD_WRITE) {
+    p->data = malloc(p->len);
+    read_all(sk, p->data, p->len);
+  }
+  return 1;
+}
+
+static void reply_to(int sk, const struct pending *p, int error, void *data, u_int32_t len)
+{
   struct nbd_reply reply;
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  reply.error = error;
+  memcpy(reply.handle, p->request.handle, sizeof(reply.handle));
+  write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+  if (len > 0)
+    write_all(sk, (char*)data, len);
+}
+
+/* Serve one request and free its payload. Returns 1 if it was a disconnect. */
+static int serve_one(int sk, const struct buse_operations * aop, void * userdata, struct pending *p)
+{
+  int error = 0;
   void *chunk;
 
-  reply.magic = htonl(NBD_REPLY_MAGIC);
-  reply.error = htonl(0);
-
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
-    assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
-
-    len = ntohl(request.len);
-    from = ntohll(request.from);
-    assert(request.magic == htonl(NBD_REQUEST_MAGIC));
-
-    switch(ntohl(request.type)) {
-      /* I may at some point need to deal with the the fact that the
-       * official nbd server has a maximum buffer size, and divides up
-       * oversized requests into multiple pieces. This applies to reads
-       * and writes.
-       */
-    case NBD_CMD_READ:
-      if (BUSE_DEBUG) fprintf(stderr, "Request for read of size %d\n", len);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read) {
-        reply.error = aop->read(chunk, len, from, userdata);
-      } else {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
-
-      free(chunk);
-      break;
-    case NBD_CMD_WRITE:
-      if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", len);
-      chunk = malloc(len);
-      read_all(sk, chunk, len);
-      if (aop->write) {
-        reply.error = aop->write(chunk, len, from, userdata);
-      } else {
-        /* If user not specified write operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      free(chunk);
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      break;
-    case NBD_CMD_DISC:
-      if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_DISC\n");
-      /* Handle a disconnect request. */
-      if (aop->disc) {
-        aop->disc(userdata);
-      }
-      return EXIT_SUCCESS;
+  switch(p->type) {
+    /* I may at some point need to deal with the the fact that the
+     * official nbd server has a maximum buffer size, and divides up
+     * oversized requests into multiple pieces. This applies to reads
+     * and writes.
+     */
+  case NBD_CMD_READ:
+    if (BUSE_DEBUG) fprintf(stderr, "Request for read of size %d\n", p->len);
+    /* Fill with zero in case actual read is not implemented */
+    chunk = malloc(p->len);
+    if (aop->read) {
+      error = aop->read(chunk, p->len, p->from, userdata);
+    } else {
+      /* If user not specified read operation, return EPERM error */
+      error = htonl(EPERM);
+    }
+    reply_to(sk, p, error, chunk, p->len);
+    account(BUSE_READ, &p->request, error, p->start, p->trace_start, chunk);
+
+    free(chunk);
+    break;
+  case NBD_CMD_WRITE:
+    if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", p->len);
+    if (aop->write) {
+      error = aop->write(p->data, p->len, p->from, userdata);
+    } else {
+      /* If user not specified write operation, return EPERM error */
+      error = htonl(EPERM);
+    }
+    reply_to(sk, p, error, NULL, 0);
+    account(BUSE_WRITE, &p->request, error, p->start, p->trace_start, p->data);
+    free(p->data);
+    break;
+  case NBD_CMD_DISC:
+    if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_DISC\n");
+    /* Handle a disconnect request. */
+    if (aop->disc) {
+      aop->disc(userdata);
+    }
+    return 1;
 #ifdef NBD_FLAG_SEND_FLUSH
-    case NBD_CMD_FLUSH:
-      if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_FLUSH\n");
-      if (aop->flush) {
-        reply.error = aop->flush(userdata);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      break;
+  case NBD_CMD_FLUSH:
+    if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_FLUSH\n");
+    if (aop->flush) {
+      error = aop->flush(userdata);
+    }
+    reply_to(sk, p, error, NULL, 0);
+    account(BUSE_FLUSH, &p->request, error, p->start, p->trace_start, NULL);
+    break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
-    case NBD_CMD_TRIM:
-      if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_TRIM\n");
-      if (aop->trim) {
-        reply.error = aop->trim(from, len, userdata);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      break;
+  case NBD_CMD_TRIM:
+    if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_TRIM\n");
+    if (aop->trim) {
+      error = aop->trim(p->from, p->len, userdata);
+    }
+    reply_to(sk, p, error, NULL, 0);
+    account(BUSE_TRIM, &p->request, error, p->start, p->trace_start, NULL);
+    break;
 #endif
-    default:
-      assert(0);
+  default:
+    assert(0);
+  }
+  return 0;
+}
+
+/*
+ * Request merging, see buse_merge(). Reads and writes are held until the
+ * window after the first of them runs out, MERGE_REQUESTS of them or
+ * MERGE_BYTES are held, or a request arrives that can't be reordered: a
+ * flush, trim, FUA write or disconnect, which is served after everything
+ * held before it. A read and a write of overlapping ranges are never held
+ * together either, so the order between the two is kept. Held writes that
+ * touch or overlap are then served as one write, in order of offset, and so
+ * are reads; each request still gets its own reply. Requests that only touch
+ * are merged up to MERGE_MAX, overlapping ones always, so that overlapping
+ * writes are applied in the order they arrived.
+ */
+#define MERGE_REQUESTS 128
+#define MERGE_BYTES (16 << 20)
+#define MERGE_MAX (4 << 20)     // largest merge of requests that only touch
+
+static u_int32_t merge_window_us;
+
+void buse_merge(u_int32_t window_us)
+{
+  merge_window_us = window_us;
+}
+
+static int mergeable(const struct pending *p)
+{
+  return (p->type == NBD_CMD_READ || p->type == NBD_CMD_WRITE) && !(p->flags & NBD_CMD_FLAG_FUA);
+}
+
+/* Whether p overlaps a held request of the other kind. */
+static int conflicts(const struct pending *held, int n, const struct pending *p)
+{
+  for (int i = 0; i < n; i++) {
+    if (held[i].type != p->type && held[i].from < p->from + p->len && p->from < held[i].from + held[i].len)
+      return 1;
+  }
+  return 0;
+}
+
+/* Wait until another request can be read, or until deadline (now_us()). */
+static int readable(int sk, u_int64_t deadline)
+{
+  u_int64_t now = now_us();
+  if (now >= deadline)
+    return 0;
+  struct timeval tv = { .tv_sec = (deadline - now) / 1000000, .tv_usec = (deadline - now) % 1000000 };
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(sk, &fds);
+  return select(sk + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/* Writes first, then by offset; held requests of the two kinds never overlap. */
+static int merge_order(const void *a, const void *b)
+{
+  const struct pending *x = *(struct pending * const *)a, *y = *(struct pending * const *)b;
+  if (x->type != y->type)
+    return x->type == NBD_CMD_WRITE ? -1 : 1;
+  if (x->from != y->from)
+    return x->from < y->from ? -1 : 1;
+  return (x > y) - (x < y);
+}
+
+/* The order the requests arrived in, which is their order in the batch. */
+static int arrival_order(const void *a, const void *b)
+{
+  const struct pending *x = *(struct pending * const *)a, *y = *(struct pending * const *)b;
+  return (x > y) - (x < y);
+}
+
+/* Serve run[0..n), all reads or all writes together covering len bytes at
+ * from, with one read or write. run is in arrival order, so where writes
+ * overlap the last one wins. Returns 0, or -1 if nothing was answered and
+ * the requests must be served one by one. */
+static int serve_merged(int sk, const struct buse_operations * aop, void * userdata,
+                        struct pending **run, int n, u_int64_t from, u_int32_t len)
+{
+  int write = run[0]->type == NBD_CMD_WRITE;
+  char *buf;
+  if ((write ? !aop->write : !aop->read) || (buf = malloc(len)) == NULL)
+    return -1;
+  int error;
+  if (write) {
+    for (int i = 0; i < n; i++)
+      memcpy(buf + (run[i]->from - from), run[i]->data, run[i]->len);
+    error = aop->write(buf, len, from, userdata);
+  } else {
+    error = aop->read(buf, len, from, userdata);
+  }
+  if (error) {
+    free(buf);
+    return -1; // find out which of them failed
+  }
+  for (int i = 0; i < n; i++) {
+    if (write) {
+      reply_to(sk, run[i], 0, NULL, 0);
+      account(BUSE_WRITE, &run[i]->request, 0, run[i]->start, run[i]->trace_start, run[i]->data);
+      free(run[i]->data);
+    } else {
+      char *data = buf + (run[i]->from - from);
+      reply_to(sk, run[i], 0, data, run[i]->len);
+      account(BUSE_READ, &run[i]->request, 0, run[i]->start, run[i]->trace_start, data);
     }
   }
-  if (bytes_read == -1) {
+  free(buf);
+  return 0;
+}
+
+static void serve_held(int sk, const struct buse_operations * aop, void * userdata, struct pending *held, int n)
+{
+  struct pending *order[MERGE_REQUESTS];
+  for (int i = 0; i < n; i++)
+    order[i] = &held[i];
+  qsort(order, n, sizeof(*order), merge_order);
+
+  for (int i = 0, j; i < n; i = j) {
+    u_int64_t from = order[i]->from, to = from + order[i]->len;
+    for (j = i + 1; j < n && order[j]->type == order[i]->type && order[j]->from <= to; j++) {
+      u_int64_t end = order[j]->from + order[j]->len;
+      if (order[j]->from == to && end - from > MERGE_MAX)
+        break; // an overlapping one must stay, or it could land before an older write
+      if (end > to)
+        to = end;
+    }
+    qsort(order + i, j - i, sizeof(*order), arrival_order);
+    if (j - i > 1 && serve_merged(sk, aop, userdata, order + i, j - i, from, to - from) == 0)
+      continue;
+    for (int k = i; k < j; k++)
+      serve_one(sk, aop, userdata, order[k]);
+  }
+}
+
+/* Serve userland side of nbd socket. If everything worked ok, return 0. */
+static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata) {
+  static struct pending held[MERGE_REQUESTS];
+  struct pending p;
+  int n = 0, r;
+  u_int64_t held_bytes = 0, deadline = 0;
+
+  while ((r = receive(sk, &p)) > 0) {
+    if (merge_window_us == 0 || !mergeable(&p)) {
+      serve_held(sk, aop, userdata, held, n); // a barrier: everything before it first
+      n = 0;
+      if (serve_one(sk, aop, userdata, &p))
+        return EXIT_SUCCESS;
+      continue;
+    }
+    if (conflicts(held, n, &p)) {
+      serve_held(sk, aop, userdata, held, n);
+      n = 0;
+    }
+    if (n == 0) {
+      deadline = p.start + merge_window_us;
+      held_bytes = 0;
+    }
+    held[n++] = p;
+    held_bytes += p.len;
+    if (n == MERGE_REQUESTS || held_bytes >= MERGE_BYTES || !readable(sk, deadline)) {
+      serve_held(sk, aop, userdata, held, n);
+      n = 0;
+    }
+  }
+  for (int i = 0; i < n; i++)
+    free(held[i].data); // the socket is gone, nobody to answer
+  if (r == -1) {
     warn("error reading userside of nbd socket");
     return EXIT_FAILURE;
   }
@@ -295,6 +561,7 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   /* Parent handles termination signals by terminating nbd device. */
   assert(nbd_dev_to_disconnect == -1);
   nbd_dev_to_disconnect = nbd;
+  nbd_dev = nbd;
   struct sigaction act;
   act.sa_handler = disconnect_nbd;
   act.sa_flags = SA_RESTART;
@@ -319,6 +586,10 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   /* serve NBD socket */
   int status;
   status = serve_nbd(sp[0], aop, userdata);
+  if (trace) {
+    trace_close(trace);
+    trace = NULL;
+  }
   if (close(sp[0]) != 0) warn("problem closing server side nbd socket");
   if (status != 0) return status;
 
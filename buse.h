@@ -1,12 +1,14 @@
 #ifndef BUSE_H_INCLUDED
 #define BUSE_H_INCLUDED
 
+#include <sys/types.h>
+
+#include "hist.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#include <sys/types.h>
-
   struct buse_operations {
     int (*read)(void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     int (*write)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
@@ -22,6 +24,34 @@ extern "C" {
 
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
 
+  /* Record every request buse_main() serves in a binary trace at path (see
+   * trace.h and buse-replay), with a CRC32C of each payload if hashes is set.
+   * Call before buse_main(). Returns -1 on error (reported). */
+  int buse_trace(const char *path, int hashes);
+
+  /* Hold reads and writes for up to window_us microseconds after the first
+   * of them arrives, and serve those that touch or overlap as one larger
+   * read or write, in order of offset. Flushes, trims and FUA writes are
+   * barriers that are never reordered. 0, the default, serves each request
+   * as it arrives. Call before buse_main(). */
+  void buse_merge(u_int32_t window_us);
+
+  enum buse_op { BUSE_READ, BUSE_WRITE, BUSE_FLUSH, BUSE_TRIM, BUSE_OPS };
+
+  /* Requests served by buse_main(), per type: latency in microseconds from
+   * receiving the request to sending the reply, bytes, and failed requests.
+   * Updated as requests complete; any thread may read them (see stats.h). */
+  struct buse_stats {
+    struct hist latency[BUSE_OPS];
+    u_int64_t bytes[BUSE_OPS];
+    u_int64_t errors[BUSE_OPS];
+  };
+  extern struct buse_stats buse_stats;
+
+  /* Change the size of the device while buse_main() is serving it, e.g. after
+   * an array grew. Returns -1 with errno set if it isn't running yet. */
+  int buse_set_size(u_int64_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,50 +17,182 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <argp.h>
 #include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "buse.h"
+#include "evlog.h"
+#include "stats.h"
 
-/* BUSE callbacks */
-static void *data;
+/* The device is stored in CHUNK_SIZE chunks, each allocated on its first
+ * write, so memory use follows the data actually written. Chunks are
+ * hugepage sized and aligned so the kernel can back them with hugepages. */
+#define CHUNK_SIZE (2 * 1024 * 1024)
+
+static char **chunks;
+static u_int64_t nchunks;
+static u_int64_t allocated;
+
+/* With --file the chunks are slices of a shared mapping of the file instead,
+ * so the data outlives the process. Writes mark DIRTY_SIZE regions in a
+ * bitmap and a flush msyncs only those. */
+#define DIRTY_SIZE (64 * 1024)
+
+static int map_fd = -1;
+static char *map;
+static uint64_t *dirty;
+
+static void mark_dirty(u_int64_t offset, u_int32_t len)
+{
+  for (u_int64_t r = offset / DIRTY_SIZE; r <= (offset + len - 1) / DIRTY_SIZE; r++)
+    dirty[r / 64] |= 1ULL << (r % 64);
+}
+
+/* The chunk holding offset, allocated if alloc is set; NULL if it was never written. */
+static char *chunk_at(u_int64_t offset, int alloc)
+{
+  if (map)
+    return map + offset / CHUNK_SIZE * CHUNK_SIZE;
+  char **c = &chunks[offset / CHUNK_SIZE];
+  if (*c == NULL && alloc) {
+    void *p;
+    if (posix_memalign(&p, CHUNK_SIZE, CHUNK_SIZE) != 0)
+      return NULL;
+    madvise(p, CHUNK_SIZE, MADV_HUGEPAGE);
+    memset(p, 0, CHUNK_SIZE);
+    *c = p;
+    allocated++;
+  }
+  return *c;
+}
 
+/* BUSE callbacks */
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
-  if (*(int *)userdata)
-    fprintf(stderr, "R - %lu, %u\n", offset, len);
-  memcpy(buf, (char *)data + offset, len);
+  (void)userdata;
+  evlog(EVLOG_READ, offset, len);
+  while (len > 0) {
+    u_int32_t in = offset % CHUNK_SIZE, n = CHUNK_SIZE - in < len ? CHUNK_SIZE - in : len;
+    char *c = chunk_at(offset, 0);
+    if (c)
+      memcpy(buf, c + in, n);
+    else
+      memset(buf, 0, n);
+    buf = (char *)buf + n;
+    offset += n;
+    len -= n;
+  }
   return 0;
 }
 
 static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
-  if (*(int *)userdata)
-    fprintf(stderr, "W - %lu, %u\n", offset, len);
-  memcpy((char *)data + offset, buf, len);
+  (void)userdata;
+  evlog(EVLOG_WRITE, offset, len);
+  if (map && len > 0)
+    mark_dirty(offset, len);
+  while (len > 0) {
+    u_int32_t in = offset % CHUNK_SIZE, n = CHUNK_SIZE - in < len ? CHUNK_SIZE - in : len;
+    char *c = chunk_at(offset, 1);
+    if (c == NULL) {
+      warn("failed to alloc a chunk at offset %lu", offset);
+      return -1;
+    }
+    memcpy(c + in, buf, n);
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
+  }
   return 0;
 }
 
-static void xmp_disc(void *userdata)
+/* msync each run of dirty regions, clearing their bits once it succeeded.
+ * Runs that fail stay dirty for the next flush to retry. */
+static int sync_dirty(void)
 {
-  if (*(int *)userdata)
-    fprintf(stderr, "Received a disconnect request.\n");
+  u_int64_t regions = (nchunks * CHUNK_SIZE + DIRTY_SIZE - 1) / DIRTY_SIZE;
+  u_int64_t r = 0;
+  int ret = 0;
+  while (r < regions) {
+    if (dirty[r / 64] == 0) {
+      r = (r / 64 + 1) * 64;
+      continue;
+    }
+    if (!(dirty[r / 64] & 1ULL << (r % 64))) {
+      r++;
+      continue;
+    }
+    u_int64_t start = r;
+    while (r < regions && dirty[r / 64] & 1ULL << (r % 64))
+      r++;
+    if (msync(map + start * DIRTY_SIZE, (r - start) * DIRTY_SIZE, MS_SYNC) != 0) {
+      warn("msync");
+      ret = -1;
+      continue;
+    }
+    for (u_int64_t k = start; k < r; k++)
+      dirty[k / 64] &= ~(1ULL << (k % 64));
+  }
+  return ret;
 }
 
 static int xmp_flush(void *userdata)
 {
+  (void)userdata;
+  evlog(EVLOG_FLUSH, 0, 0);
+  return map ? sync_dirty() : 0;
+}
+
+static void xmp_disc(void *userdata)
+{
+  evlog(EVLOG_DISC, 0, 0);
   if (*(int *)userdata)
-    fprintf(stderr, "Received a flush request.\n");
-  return 0;
+    fprintf(stderr, "%lu of %lu chunks allocated.\n", map ? nchunks : allocated, nchunks);
+  if (map)
+    sync_dirty();
 }
 
+/* Chunks trimmed as a whole are freed and read as zeros again; the trimmed
+ * part of any other chunk is zeroed. With --file, whole pages are punched
+ * out of the file instead. */
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 {
-  if (*(int *)userdata)
-    fprintf(stderr, "T - %lu, %u\n", from, len);
+  (void)userdata;
+  evlog(EVLOG_TRIM, from, len);
+  if (map) {
+    u_int64_t page = sysconf(_SC_PAGESIZE);
+    u_int64_t lo = (from + page - 1) / page * page, hi = (from + len) / page * page;
+    if (lo >= hi || fallocate(map_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, lo, hi - lo) != 0)
+      lo = hi = from + len; // can't punch (or nothing to punch): zero it all
+    memset(map + from, 0, lo - from);
+    memset(map + hi, 0, from + len - hi);
+    if (len > 0)
+      mark_dirty(from, len);
+    return 0;
+  }
+  while (len > 0) {
+    u_int32_t in = from % CHUNK_SIZE, n = CHUNK_SIZE - in < len ? CHUNK_SIZE - in : len;
+    char **c = &chunks[from / CHUNK_SIZE];
+    if (*c && n == CHUNK_SIZE) {
+      free(*c);
+      *c = NULL;
+      allocated--;
+    } else if (*c) {
+      memset(*c + in, 0, n);
+    }
+    from += n;
+    len -= n;
+  }
   return 0;
 }
 
@@ -68,12 +200,24 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 
 static struct argp_option options[] = {
   {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+  {"file", 'f', "FILE", 0, "Keep the data in FILE (on tmpfs, hugetlbfs or disk) so a restart picks it up again", 0},
+  {"stats", 'T', "SOCKET", 0, "Serve request latency histograms and counters on the Unix socket SOCKET (read them with buse-stat)", 0},
+  {"trace", 'R', "FILE", 0, "Record every request (type, offset, length, timing) in the binary trace FILE, for buse-replay", 0},
+  {"trace-hashes", 'X', 0, 0, "With --trace, also record a CRC32C of the data of every read and write", 0},
+  {"log", 'L', "FILE", 0, "Write the -v request log to the binary FILE instead of stderr, for buse-log (implies -v)", 0},
+  {"merge-window", 'G', "USEC", 0, "Hold requests for up to USEC microseconds to merge adjacent reads and writes into larger ones", 0},
   {0},
 };
 
 struct arguments {
   unsigned long long size;
   char * device;
+  char * file;
+  char * stats;
+  char * trace;
+  int trace_hashes;
+  char * log;
+  unsigned long merge_window_us;
   int verbose;
 };
 
@@ -107,6 +251,33 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       arguments->verbose = 1;
       break;
 
+    case 'f':
+      arguments->file = arg;
+      break;
+
+    case 'T':
+      arguments->stats = arg;
+      break;
+
+    case 'R':
+      arguments->trace = arg;
+      break;
+
+    case 'X':
+      arguments->trace_hashes = 1;
+      break;
+
+    case 'L':
+      arguments->log = arg;
+      arguments->verbose = 1;
+      break;
+
+    case 'G':
+      arguments->merge_window_us = strtoul(arg, &endptr, 10);
+      if (*endptr != '\0')
+        errx(EXIT_FAILURE, "USEC must be an integer");
+      break;
+
     case ARGP_KEY_ARG:
       switch (state->arg_num) {
 
@@ -165,8 +336,28 @@ int main(int argc, char *argv[]) {
     .size = arguments.size,
   };
 
-  data = malloc(aop.size);
-  if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+  nchunks = (aop.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  if (arguments.file) {
+    /* whole chunks, so the file can live on hugetlbfs */
+    struct stat st;
+    map_fd = open(arguments.file, O_RDWR | O_CREAT, 0644);
+    if (map_fd < 0 || fstat(map_fd, &st) != 0) err(EXIT_FAILURE, "%s", arguments.file);
+    if ((u_int64_t)st.st_size < nchunks * CHUNK_SIZE && ftruncate(map_fd, nchunks * CHUNK_SIZE) != 0)
+      err(EXIT_FAILURE, "failed to size %s", arguments.file);
+    map = mmap(NULL, nchunks * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+    if (map == MAP_FAILED) err(EXIT_FAILURE, "failed to map %s", arguments.file);
+    madvise(map, nchunks * CHUNK_SIZE, MADV_HUGEPAGE);
+    dirty = calloc((nchunks * CHUNK_SIZE / DIRTY_SIZE + 63) / 64, sizeof(*dirty));
+    if (dirty == NULL) err(EXIT_FAILURE, "failed to alloc the dirty bitmap");
+  } else {
+    chunks = calloc(nchunks, sizeof(*chunks));
+    if (chunks == NULL) err(EXIT_FAILURE, "failed to alloc the chunk table");
+  }
+
+  if (arguments.stats && stats_start(arguments.stats, NULL, NULL) != 0) exit(EXIT_FAILURE);
+  if (arguments.trace && buse_trace(arguments.trace, arguments.trace_hashes) != 0) exit(EXIT_FAILURE);
+  if (arguments.verbose && evlog_open(arguments.log) != 0) exit(EXIT_FAILURE);
+  buse_merge(arguments.merge_window_us);
 
   return buse_main(arguments.device, &aop, (void *)&arguments.verbose);
 }
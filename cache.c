@@ -0,0 +1,368 @@
+/*
+ * cache - sharded segmented-LRU block read cache for the backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+
+enum { SEG_FREE, SEG_PROBATION, SEG_PROTECTED };
+
+struct cache_entry {
+    uint64_t block;
+    int32_t prev, next; // list links, -1 at the ends
+    int32_t hnext;      // hash chain, -1 at the end
+    uint8_t seg;
+};
+
+struct cache_list {
+    int32_t head, tail; // most and least recently used
+    uint32_t count;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *entries;
+    char *data;         // capacity blocks, entry i at i*CACHE_BLOCK_SIZE
+    int32_t *buckets;   // hash table of entry indices, -1 if empty
+    uint32_t nbuckets;  // a power of two
+    uint32_t capacity;
+    uint32_t protected_max;
+    struct cache_list lists[3]; // indexed by SEG_*
+    uint64_t seq;       // bumped by every invalidation, so fills that raced one are dropped
+
+    uint64_t hits, misses, evictions, invalidations;
+};
+
+struct cache {
+    struct buse_operations inner;
+    void *inner_userdata;
+    uint64_t size;      // bytes of the device that are cached, whole blocks only
+    uint64_t memory;    // bytes allocated for entries, data and hash tables
+    uint64_t start_us;
+    struct cache_shard shard[CACHE_SHARDS];
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t mix(uint64_t block) {
+    return block * 0x9e3779b97f4a7c15ULL;
+}
+
+static struct cache_shard *shard_of(struct cache *c, uint64_t block) {
+    return &c->shard[mix(block) >> 60];
+}
+
+static uint32_t bucket_of(struct cache_shard *s, uint64_t block) {
+    return (mix(block) >> 20) & (s->nbuckets - 1);
+}
+
+static void list_remove(struct cache_shard *s, int32_t i) {
+    struct cache_entry *e = &s->entries[i];
+    struct cache_list *l = &s->lists[e->seg];
+    if (e->prev != -1) s->entries[e->prev].next = e->next; else l->head = e->next;
+    if (e->next != -1) s->entries[e->next].prev = e->prev; else l->tail = e->prev;
+    l->count--;
+}
+
+static void list_push(struct cache_shard *s, int32_t i, uint8_t seg) {
+    struct cache_entry *e = &s->entries[i];
+    struct cache_list *l = &s->lists[seg];
+    e->seg = seg;
+    e->prev = -1;
+    e->next = l->head;
+    if (l->head != -1) s->entries[l->head].prev = i; else l->tail = i;
+    l->head = i;
+    l->count++;
+}
+
+static int32_t lookup(struct cache_shard *s, uint64_t block) {
+    for (int32_t i = s->buckets[bucket_of(s, block)]; i != -1; i = s->entries[i].hnext) {
+        if (s->entries[i].block == block) return i;
+    }
+    return -1;
+}
+
+static void hash_remove(struct cache_shard *s, int32_t i) {
+    int32_t *p = &s->buckets[bucket_of(s, s->entries[i].block)];
+    while (*p != i) {
+        p = &s->entries[*p].hnext;
+    }
+    *p = s->entries[i].hnext;
+}
+
+static void drop(struct cache_shard *s, int32_t i) {
+    hash_remove(s, i);
+    list_remove(s, i);
+    list_push(s, i, SEG_FREE);
+}
+
+/* Copy block out of the cache if it is there, promoting it on a second hit. */
+static bool cache_get(struct cache_shard *s, uint64_t block, char *out) {
+    pthread_mutex_lock(&s->lock);
+    int32_t i = lookup(s, block);
+    if (i == -1) {
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+    s->hits++;
+    memcpy(out, s->data + (uint64_t)i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE);
+    list_remove(s, i);
+    list_push(s, i, SEG_PROTECTED);
+    if (s->lists[SEG_PROTECTED].count > s->protected_max) {
+        // the protected segment is full, its oldest block gets another chance on probation
+        int32_t old = s->lists[SEG_PROTECTED].tail;
+        list_remove(s, old);
+        list_push(s, old, SEG_PROBATION);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return true;
+}
+
+/* Whether block is cached, without touching its recency; counts a miss if not. */
+static bool cache_has(struct cache_shard *s, uint64_t block) {
+    pthread_mutex_lock(&s->lock);
+    bool found = lookup(s, block) != -1;
+    if (!found) s->misses++;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+/* Insert a block read from the backend, unless an invalidation happened in
+ * the shard since seq was sampled (the data may be stale then). */
+static void cache_put(struct cache_shard *s, uint64_t block, const char *data, uint64_t seq) {
+    pthread_mutex_lock(&s->lock);
+    if (s->seq != seq || lookup(s, block) != -1) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    int32_t i = s->lists[SEG_FREE].tail;
+    if (i == -1) {
+        i = s->lists[SEG_PROBATION].tail != -1 ? s->lists[SEG_PROBATION].tail : s->lists[SEG_PROTECTED].tail;
+        hash_remove(s, i);
+        s->evictions++;
+    }
+    list_remove(s, i);
+    struct cache_entry *e = &s->entries[i];
+    e->block = block;
+    uint32_t b = bucket_of(s, block);
+    e->hnext = s->buckets[b];
+    s->buckets[b] = i;
+    list_push(s, i, SEG_PROBATION);
+    memcpy(s->data + (uint64_t)i * CACHE_BLOCK_SIZE, data, CACHE_BLOCK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Drop every cached block in [from, to). */
+static void invalidate(struct cache *c, uint64_t from, uint64_t to) {
+    if (to - from > (uint64_t)c->shard[0].capacity * CACHE_SHARDS) {
+        // cheaper to look at everything that is cached than at every block of the range
+        for (int k=0; k < CACHE_SHARDS; k++) {
+            struct cache_shard *s = &c->shard[k];
+            pthread_mutex_lock(&s->lock);
+            s->seq++;
+            for (uint32_t i=0; i < s->capacity; i++) {
+                if (s->entries[i].seg != SEG_FREE && s->entries[i].block >= from && s->entries[i].block < to) {
+                    drop(s, i);
+                    s->invalidations++;
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        return;
+    }
+    for (uint64_t b = from; b < to; b++) {
+        struct cache_shard *s = shard_of(c, b);
+        pthread_mutex_lock(&s->lock);
+        s->seq++;
+        int32_t i = lookup(s, b);
+        if (i != -1) {
+            drop(s, i);
+            s->invalidations++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static int cache_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct cache *c = userdata;
+    if (len == 0) {
+        return 0;
+    }
+    uint64_t first = offset / CACHE_BLOCK_SIZE, last = (offset + len - 1) / CACHE_BLOCK_SIZE;
+    uint64_t size = __atomic_load_n(&c->size, __ATOMIC_RELAXED); // may grow meanwhile, see cache_resize()
+    char block[CACHE_BLOCK_SIZE];
+
+    for (uint64_t b = first; b <= last; ) {
+        uint64_t from = b * CACHE_BLOCK_SIZE > offset ? b * CACHE_BLOCK_SIZE : offset; // the part of the request in block b onwards
+        if (b * CACHE_BLOCK_SIZE >= size) {
+            // past what is cached (the device may have grown), straight to the backend
+            return c->inner.read((char *)buf + (from - offset), offset + len - from, from, c->inner_userdata);
+        }
+        if (cache_get(shard_of(c, b), b, block)) {
+            uint64_t end = (b + 1) * CACHE_BLOCK_SIZE < offset + len ? (b + 1) * CACHE_BLOCK_SIZE : offset + len;
+            memcpy((char *)buf + (from - offset), block + (from - b * CACHE_BLOCK_SIZE), end - from);
+            b++;
+            continue;
+        }
+
+        // read the run of missing blocks from the backend in one go, whole blocks only
+        uint64_t e = b + 1;
+        while (e <= last && e * CACHE_BLOCK_SIZE < size && !cache_has(shard_of(c, e), e)) {
+            e++;
+        }
+        uint64_t seq[CACHE_SHARDS];
+        for (int k=0; k < CACHE_SHARDS; k++) {
+            pthread_mutex_lock(&c->shard[k].lock);
+            seq[k] = c->shard[k].seq;
+            pthread_mutex_unlock(&c->shard[k].lock);
+        }
+        size_t run = (e - b) * CACHE_BLOCK_SIZE;
+        char *tmp = malloc(run);
+        if (tmp == NULL) {
+            perror("cache");
+            return -1;
+        }
+        if (c->inner.read(tmp, run, b * CACHE_BLOCK_SIZE, c->inner_userdata) != 0) {
+            free(tmp);
+            return -1;
+        }
+        uint64_t end = e * CACHE_BLOCK_SIZE < offset + len ? e * CACHE_BLOCK_SIZE : offset + len;
+        memcpy((char *)buf + (from - offset), tmp + (from - b * CACHE_BLOCK_SIZE), end - from);
+        for (uint64_t i = b; i < e; i++) {
+            struct cache_shard *s = shard_of(c, i);
+            cache_put(s, i, tmp + (i - b) * CACHE_BLOCK_SIZE, seq[s - c->shard]);
+        }
+        free(tmp);
+        b = e;
+    }
+    return 0;
+}
+
+static int cache_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct cache *c = userdata;
+    int r = c->inner.write(buf, len, offset, c->inner_userdata);
+    if (len > 0) {
+        invalidate(c, offset / CACHE_BLOCK_SIZE, (offset + len - 1) / CACHE_BLOCK_SIZE + 1);
+    }
+    return r;
+}
+
+static int cache_trim(u_int64_t from, u_int32_t len, void *userdata) {
+    struct cache *c = userdata;
+    int r = c->inner.trim(from, len, c->inner_userdata);
+    if (len > 0) {
+        invalidate(c, from / CACHE_BLOCK_SIZE, (from + len - 1) / CACHE_BLOCK_SIZE + 1);
+    }
+    return r;
+}
+
+static int cache_flush(void *userdata) {
+    struct cache *c = userdata;
+    return c->inner.flush(c->inner_userdata);
+}
+
+static void cache_disc(void *userdata) {
+    struct cache *c = userdata;
+    if (c->inner.disc) {
+        c->inner.disc(c->inner_userdata);
+    }
+    cache_report(c, stderr);
+}
+
+void cache_resize(struct cache *c, uint64_t size) {
+    // nothing past the old size was cached, so the new blocks start out missing
+    if (size / CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE > c->size) {
+        __atomic_store_n(&c->size, size / CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE, __ATOMIC_RELAXED);
+    }
+}
+
+void cache_report(struct cache *c, FILE *out) {
+    uint64_t hits = 0, misses = 0, evictions = 0, invalidations = 0, used = 0;
+    for (int k=0; k < CACHE_SHARDS; k++) {
+        struct cache_shard *s = &c->shard[k];
+        pthread_mutex_lock(&s->lock);
+        hits += s->hits;
+        misses += s->misses;
+        evictions += s->evictions;
+        invalidations += s->invalidations;
+        used += s->capacity - s->lists[SEG_FREE].count;
+        pthread_mutex_unlock(&s->lock);
+    }
+    double secs = (now_us() - c->start_us) / 1e6;
+    fprintf(out, "cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions (%.1f/s), %lu invalidations, "
+            "%lu of %lu blocks in use, %.1f MiB of memory\n",
+            hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0, evictions, secs > 0 ? evictions / secs : 0.0,
+            invalidations, used, (uint64_t)c->shard[0].capacity * CACHE_SHARDS, c->memory / 1048576.0);
+}
+
+static int shard_init(struct cache_shard *s, uint32_t capacity) {
+    pthread_mutex_init(&s->lock, NULL);
+    s->capacity = capacity;
+    s->protected_max = (uint64_t)capacity * CACHE_PROTECTED_PCT / 100;
+    for (s->nbuckets = 1; s->nbuckets < capacity; s->nbuckets *= 2);
+    s->entries = malloc(capacity * sizeof(*s->entries));
+    s->data = malloc((uint64_t)capacity * CACHE_BLOCK_SIZE);
+    s->buckets = malloc(s->nbuckets * sizeof(*s->buckets));
+    if (s->entries == NULL || s->data == NULL || s->buckets == NULL) {
+        return -1;
+    }
+    memset(s->buckets, 0xff, s->nbuckets * sizeof(*s->buckets)); // all -1
+    for (int l=0; l < 3; l++) {
+        s->lists[l] = (struct cache_list){ .head = -1, .tail = -1 };
+    }
+    for (uint32_t i=0; i < capacity; i++) {
+        list_push(s, i, SEG_FREE);
+    }
+    return 0;
+}
+
+struct cache *cache_wrap(struct buse_operations *bop, void **userdata, uint64_t cache_bytes) {
+    uint64_t per_shard = cache_bytes / CACHE_BLOCK_SIZE / CACHE_SHARDS;
+    if (per_shard == 0 || per_shard > INT32_MAX) {
+        fprintf(stderr, "ERROR: a cache of %lu bytes is too small or too large.\n", cache_bytes);
+        return NULL;
+    }
+    struct cache *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        perror("cache");
+        return NULL;
+    }
+    c->inner = *bop;
+    c->inner_userdata = *userdata;
+    uint64_t size = bop->size ? bop->size : bop->size_blocks * bop->blksize;
+    c->size = size / CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE;
+    c->start_us = now_us();
+    for (int k=0; k < CACHE_SHARDS; k++) {
+        if (shard_init(&c->shard[k], per_shard) != 0) {
+            perror("cache");
+            return NULL;
+        }
+        c->memory += per_shard * (sizeof(struct cache_entry) + CACHE_BLOCK_SIZE) + c->shard[k].nbuckets * sizeof(int32_t);
+    }
+
+    bop->read = cache_read;
+    bop->write = cache_write;
+    bop->disc = cache_disc;
+    if (bop->flush) bop->flush = cache_flush;
+    if (bop->trim) bop->trim = cache_trim;
+    *userdata = c;
+    return c;
+}
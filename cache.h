@@ -0,0 +1,38 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buse.h"
+
+/*
+ * In-process block read cache that sits in front of any backend.
+ *
+ * The cache holds CACHE_BLOCK_SIZE blocks of the exported device. It is
+ * split into CACHE_SHARDS shards by block number, each with its own lock,
+ * hash table and segmented LRU. New blocks enter the probationary segment,
+ * and a block hit there is promoted to the protected segment. A scan of
+ * blocks read once therefore evicts other blocks read once, and leaves the
+ * working set alone. Writes and trims go straight through and invalidate the
+ * blocks they touch.
+ */
+
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_SHARDS 16
+#define CACHE_PROTECTED_PCT 80 // share of each shard the protected segment may fill
+
+struct cache;
+
+/* Put a cache of cache_bytes in front of *bop, which serves *userdata. The
+ * callbacks in *bop are replaced by cached ones and *userdata by the cache,
+ * so hand both to buse_main(). Returns NULL on error (reported). */
+struct cache *cache_wrap(struct buse_operations *bop, void **userdata, uint64_t cache_bytes);
+
+/* Let the cache serve a backend that grew to size bytes. */
+void cache_resize(struct cache *c, uint64_t size);
+
+/* Print hit rate, eviction rate and memory use. */
+void cache_report(struct cache *c, FILE *out);
+
+#endif /* CACHE_H_INCLUDED */
@@ -0,0 +1,108 @@
+/*
+ * control - Unix socket for commands to a running array
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+
+#define CONTROL_MAX_ARGS 16
+
+struct control {
+    int sock;
+    control_fn handler;
+};
+
+/* Split line into whitespace separated words, in place. */
+static int split(char *line, char **argv) {
+    int argc = 0;
+    char *save = NULL;
+    for (char *w = strtok_r(line, " \t\r\n", &save); w != NULL && argc < CONTROL_MAX_ARGS; w = strtok_r(NULL, " \t\r\n", &save)) {
+        argv[argc++] = w;
+    }
+    return argc;
+}
+
+static void serve_client(struct control *c, int fd) {
+    FILE *f = fdopen(fd, "r+");
+    if (f == NULL) {
+        close(fd);
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) > 0) {
+        char *argv[CONTROL_MAX_ARGS];
+        int argc = split(line, argv);
+        if (argc > 0) {
+            c->handler(argc, argv, f);
+            fflush(f);
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+static void *control_thread(void *arg) {
+    struct control *c = arg;
+    for (;;) {
+        int fd = accept(c->sock, NULL, NULL);
+        if (fd < 0) {
+            perror("control: accept");
+            continue;
+        }
+        serve_client(c, fd);
+    }
+    return NULL;
+}
+
+int control_start(const char *path, control_fn handler) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: control socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct control *c = malloc(sizeof(*c));
+    if (c == NULL) {
+        perror("control");
+        return -1;
+    }
+    c->handler = handler;
+    c->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->sock < 0) {
+        perror("control: socket");
+        free(c);
+        return -1;
+    }
+    unlink(path); // left behind by an earlier run
+    if (bind(c->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(c->sock, 4) != 0) {
+        perror(path);
+        close(c->sock);
+        free(c);
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, control_thread, c) != 0) {
+        fprintf(stderr, "ERROR: can't start the control thread.\n");
+        close(c->sock);
+        free(c);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CONTROL_H_INCLUDED
+#define CONTROL_H_INCLUDED
+
+#include <stdio.h>
+
+/*
+ * Control socket for a running array.
+ *
+ * A listener thread accepts connections on a Unix socket, one at a time.
+ * Every line a client sends is split into words and handed to the backend's
+ * handler, which writes its reply to the connection; the connection stays
+ * open until the client closes it. For example:
+ *
+ *     echo "add /dev/sdx" | socat - UNIX-CONNECT:/run/raid4.ctl
+ */
+
+/* Handle one command line; argv[0] is the command. */
+typedef void (*control_fn)(int argc, char **argv, FILE *reply);
+
+/* Listen on path (replacing a stale socket) and serve commands with handler
+ * in a background thread. Returns 0, or -1 on error (reported). */
+int control_start(const char *path, control_fn handler);
+
+#endif /* CONTROL_H_INCLUDED */
@@ -0,0 +1,208 @@
+/*
+ * crc32c - CRC-32C with hardware acceleration
+ *
+ * The three-way interleaving and the zeros operators used to combine the
+ * streams follow Mark Adler's public domain crc32c.c.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define POLY 0x82f63b78 // CRC-32C polynomial, bit-reversed
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const void *buf, size_t len);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_fn crc32c_impl;
+static uint32_t crc32c_table[8][256]; // slicing-by-8 tables for the software version
+
+static uint64_t load64(const unsigned char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *next = buf;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w = load64(next) ^ crc; // little-endian
+        crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+              crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+              crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+              crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+#define LONG 8192 // stream length for large buffers
+#define SHORT 256 // stream length for what is left
+
+static uint32_t crc32c_long[4][256];  // shift a CRC over LONG zero bytes
+static uint32_t crc32c_short[4][256]; // same for SHORT
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Build the operator that appends len zero bytes (a power of two) to a CRC. */
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    odd[0] = POLY; // one zero bit
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+    // each square doubles the count, starting with one zero byte in even
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+    uint32_t op[32];
+
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint64_t crc0 = ~crc, crc1, crc2;
+
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    // three streams at once, then shift the first two over the others and combine
+    while (len >= LONG * 3) {
+        crc1 = crc2 = 0;
+        end = next + LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(next));
+            crc1 = _mm_crc32_u64(crc1, load64(next + LONG));
+            crc2 = _mm_crc32_u64(crc2, load64(next + LONG * 2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        next += LONG * 2;
+        len -= LONG * 3;
+    }
+    while (len >= SHORT * 3) {
+        crc1 = crc2 = 0;
+        end = next + SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(next));
+            crc1 = _mm_crc32_u64(crc1, load64(next + SHORT));
+            crc2 = _mm_crc32_u64(crc2, load64(next + SHORT * 2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT * 2;
+        len -= SHORT * 3;
+    }
+    end = next + (len - (len & 7));
+    while (next < end) {
+        crc0 = _mm_crc32_u64(crc0, load64(next));
+        next += 8;
+    }
+    len &= 7;
+    while (len) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    crc32c_impl = crc32c_sw;
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_zeros(crc32c_long, LONG);
+        crc32c_zeros(crc32c_short, SHORT);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, buf, len);
+}
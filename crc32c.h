@@ -0,0 +1,17 @@
+#ifndef CRC32C_H_INCLUDED
+#define CRC32C_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs. Uses the SSE4.2
+ * crc32 instruction when the CPU has it, with three independent streams over
+ * large buffers to hide the instruction latency, and a table-driven version
+ * otherwise.
+ */
+
+/* Continue the CRC crc over len bytes of buf; start with crc = 0. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H_INCLUDED */
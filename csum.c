@@ -0,0 +1,318 @@
+/*
+ * csum - per-block CRC32C tables for RAID members
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "csum.h"
+
+#define CSUM_MAGIC "BUSECRC1"
+#define CSUM_REFRESH_CHUNK (1024*1024) // csum_refresh reads this much at a time
+
+struct csum_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t clean;
+    uint64_t nblocks;
+};
+
+/* CRC as stored in the table; 0 is reserved for "unverified". */
+static uint32_t block_crc(const void *buf, uint32_t len) {
+    uint32_t crc = crc32c(0, buf, len);
+    return crc ? crc : 1;
+}
+
+static int write_header(struct csum_table *t, bool clean, bool sync) {
+    struct csum_header hdr = { .block_size = t->block_size, .clean = clean, .nblocks = t->nblocks };
+    memcpy(hdr.magic, CSUM_MAGIC, sizeof(hdr.magic));
+    if (pwrite(t->fd, &hdr, sizeof(hdr), t->header_off) != sizeof(hdr))
+        return -1;
+    if (sync && fdatasync(t->fd) != 0)
+        return -1;
+    t->clean = clean;
+    return 0;
+}
+
+/* Write the dirty cached pages back, one pwritev per run of consecutive
+ * pages. Called with the lock held. */
+static int write_back(struct csum_table *t) {
+    struct csum_page *dirty[CSUM_CACHE_PAGES];
+    int n = 0;
+
+    // slots are direct-mapped, so walking them in page order only needs a sort by index
+    for (int s = 0; s < CSUM_CACHE_PAGES; s++) {
+        if (t->cache[s].dirty)
+            dirty[n++] = &t->cache[s];
+    }
+    for (int i = 1; i < n; i++) {
+        struct csum_page *p = dirty[i];
+        int j = i;
+        for (; j > 0 && dirty[j - 1]->index > p->index; j--)
+            dirty[j] = dirty[j - 1];
+        dirty[j] = p;
+    }
+    for (int i = 0; i < n; ) {
+        struct iovec iov[CSUM_CACHE_PAGES];
+        int k = 0;
+        do {
+            iov[k].iov_base = dirty[i + k]->crc;
+            iov[k].iov_len = CSUM_PAGE_SIZE;
+            k++;
+        } while (i + k < n && dirty[i + k]->index == dirty[i]->index + k);
+        ssize_t want = (ssize_t)k * CSUM_PAGE_SIZE;
+        if (pwritev(t->fd, iov, k, t->table_off + dirty[i]->index * CSUM_PAGE_SIZE) != want)
+            return -1;
+        for (int j = 0; j < k; j++)
+            dirty[i + j]->dirty = false;
+        i += k;
+    }
+    return 0;
+}
+
+/* Return the cached table page holding block b, loading it if needed.
+ * Called with the lock held. */
+static struct csum_page *get_page(struct csum_table *t, uint64_t b) {
+    uint64_t index = b / CSUM_PER_PAGE;
+    struct csum_page *p = &t->cache[index % CSUM_CACHE_PAGES];
+
+    if (p->index == index)
+        return p;
+    if (p->dirty) {
+        if (pwrite(t->fd, p->crc, CSUM_PAGE_SIZE, t->table_off + p->index * CSUM_PAGE_SIZE) != CSUM_PAGE_SIZE)
+            return NULL;
+        p->dirty = false;
+    }
+    p->index = UINT64_MAX;
+    if (pread(t->fd, p->crc, CSUM_PAGE_SIZE, t->table_off + index * CSUM_PAGE_SIZE) != CSUM_PAGE_SIZE)
+        return NULL;
+    p->index = index;
+    return p;
+}
+
+/* Store crc for block b, clearing the clean flag first if needed. Called
+ * with the lock held. */
+static int set_crc(struct csum_table *t, uint64_t b, uint32_t crc) {
+    if (t->clean && write_header(t, false, true) != 0)
+        return -1;
+    struct csum_page *p = get_page(t, b);
+    if (p == NULL)
+        return -1;
+    if (p->crc[b % CSUM_PER_PAGE] != crc) {
+        p->crc[b % CSUM_PER_PAGE] = crc;
+        p->dirty = true;
+    }
+    return 0;
+}
+
+struct csum_table *csum_open(int fd, const char *path, uint32_t block_size, uint64_t dev_size) {
+    struct csum_header hdr;
+    struct csum_table *t = calloc(1, sizeof(*t));
+    if (t == NULL || (t->cache = malloc(CSUM_CACHE_PAGES * sizeof(struct csum_page))) == NULL) {
+        fprintf(stderr, "%s: out of memory for the checksum table\n", path);
+        free(t);
+        return NULL;
+    }
+    for (int s = 0; s < CSUM_CACHE_PAGES; s++) {
+        t->cache[s].index = UINT64_MAX;
+        t->cache[s].dirty = false;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    for (int k = 0; k < CSUM_LOCKS; k++)
+        pthread_rwlock_init(&t->range_lock[k], NULL);
+    t->fd = fd;
+    t->path = path;
+    t->block_size = block_size;
+
+    // [data | table, page aligned | header page] within the page-aligned device size
+    uint64_t avail = dev_size / CSUM_PAGE_SIZE * CSUM_PAGE_SIZE;
+    if (avail < CSUM_PAGE_SIZE + block_size + CSUM_PAGE_SIZE) {
+        fprintf(stderr, "%s: too small for a checksum table\n", path);
+        goto fail;
+    }
+    t->header_off = avail - CSUM_PAGE_SIZE;
+    t->nblocks = t->header_off / (block_size + sizeof(uint32_t));
+    while (t->nblocks * block_size + (t->nblocks + CSUM_PER_PAGE - 1) / CSUM_PER_PAGE * CSUM_PAGE_SIZE > t->header_off)
+        t->nblocks--;
+    t->data_size = t->nblocks * block_size;
+    t->table_off = t->header_off - (t->nblocks + CSUM_PER_PAGE - 1) / CSUM_PER_PAGE * CSUM_PAGE_SIZE;
+
+    if (pread(fd, &hdr, sizeof(hdr), t->header_off) != sizeof(hdr)) {
+        perror(path);
+        goto fail;
+    }
+    if (memcmp(hdr.magic, CSUM_MAGIC, sizeof(hdr.magic)) != 0) {
+        // no table yet: everything starts out unverified
+        fprintf(stderr, "%s: creating checksum table for %lu blocks of %u bytes\n", path, t->nblocks, block_size);
+        char zero[CSUM_PAGE_SIZE] = {0};
+        for (uint64_t off = t->table_off; off < t->header_off; off += CSUM_PAGE_SIZE) {
+            if (pwrite(fd, zero, CSUM_PAGE_SIZE, off) != CSUM_PAGE_SIZE) {
+                perror(path);
+                goto fail;
+            }
+        }
+        if (write_header(t, true, true) != 0) {
+            perror(path);
+            goto fail;
+        }
+        return t;
+    }
+    if (hdr.block_size != block_size || hdr.nblocks != t->nblocks) {
+        fprintf(stderr, "%s: checksum table is for %lu blocks of %u bytes, not %lu of %u\n",
+                path, hdr.nblocks, hdr.block_size, t->nblocks, block_size);
+        goto fail;
+    }
+    t->clean = hdr.clean;
+    if (!t->clean) {
+        fprintf(stderr, "%s: checksum table wasn't flushed cleanly, recomputing it...\n", path);
+        if (csum_refresh(t, 0, t->data_size) != 0 || csum_flush(t) != 0) {
+            perror(path);
+            goto fail;
+        }
+    }
+    return t;
+
+fail:
+    for (int k = 0; k < CSUM_LOCKS; k++)
+        pthread_rwlock_destroy(&t->range_lock[k]);
+    pthread_mutex_destroy(&t->lock);
+    free(t->cache);
+    free(t);
+    return NULL;
+}
+
+void csum_close(struct csum_table *t) {
+    if (t == NULL)
+        return;
+    if (csum_flush(t) != 0)
+        fprintf(stderr, "%s: can't write back the checksum table: %s\n", t->path, strerror(errno));
+    for (int k = 0; k < CSUM_LOCKS; k++)
+        pthread_rwlock_destroy(&t->range_lock[k]);
+    pthread_mutex_destroy(&t->lock);
+    free(t->cache);
+    free(t);
+}
+
+int csum_verify(struct csum_table *t, const void *buf, uint64_t off, uint64_t len) {
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    for (uint64_t b = off / t->block_size; b < (off + len) / t->block_size; b++) {
+        struct csum_page *p = get_page(t, b);
+        if (p == NULL) {
+            ret = -1;
+            break;
+        }
+        uint32_t want = p->crc[b % CSUM_PER_PAGE];
+        if (want != 0 && block_crc((const char *)buf + (b * t->block_size - off), t->block_size) != want) {
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+int csum_update(struct csum_table *t, const void *buf, uint64_t off, uint64_t len) {
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    for (uint64_t b = off / t->block_size; b < (off + len) / t->block_size && ret == 0; b++) {
+        ret = set_crc(t, b, block_crc((const char *)buf + (b * t->block_size - off), t->block_size));
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+int csum_forget(struct csum_table *t, uint64_t off, uint64_t len) {
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    for (uint64_t b = (off + t->block_size - 1) / t->block_size; b < (off + len) / t->block_size && ret == 0; b++) {
+        ret = set_crc(t, b, 0);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+int csum_refresh(struct csum_table *t, uint64_t off, uint64_t len) {
+    uint64_t lo = off / t->block_size * t->block_size;
+    uint64_t hi = (off + len + t->block_size - 1) / t->block_size * t->block_size;
+    uint64_t chunk = CSUM_REFRESH_CHUNK / t->block_size * t->block_size;
+    char *buf = malloc(chunk);
+    int ret = 0;
+
+    if (buf == NULL)
+        return -1;
+    if (hi > t->data_size)
+        hi = t->data_size;
+    for (uint64_t pos = lo; pos < hi && ret == 0; pos += chunk) {
+        uint64_t n = hi - pos < chunk ? hi - pos : chunk;
+        if (pread(t->fd, buf, n, pos) != (ssize_t)n)
+            ret = -1;
+        else
+            ret = csum_update(t, buf, pos, n);
+    }
+    free(buf);
+    return ret;
+}
+
+/* The range locks [off, off+len) maps to, one bit each. */
+static uint64_t lock_mask(struct csum_table *t, uint64_t off, uint64_t len) {
+    uint64_t first = off / t->block_size / CSUM_LOCK_BLOCKS;
+    uint64_t last = (off + (len ? len : 1) - 1) / t->block_size / CSUM_LOCK_BLOCKS;
+    uint64_t mask = 0;
+
+    if (last - first >= CSUM_LOCKS - 1)
+        return ~0ull;
+    for (uint64_t r = first; r <= last; r++)
+        mask |= 1ull << (r % CSUM_LOCKS);
+    return mask;
+}
+
+void csum_lock(struct csum_table *t, uint64_t off, uint64_t len, bool exclusive) {
+    uint64_t mask = lock_mask(t, off, len);
+
+    for (int k = 0; k < CSUM_LOCKS; k++) { // always in the same order, so two ranges can't deadlock
+        if (!(mask & (1ull << k)))
+            continue;
+        if (exclusive)
+            pthread_rwlock_wrlock(&t->range_lock[k]);
+        else
+            pthread_rwlock_rdlock(&t->range_lock[k]);
+    }
+}
+
+void csum_unlock(struct csum_table *t, uint64_t off, uint64_t len) {
+    uint64_t mask = lock_mask(t, off, len);
+
+    for (int k = 0; k < CSUM_LOCKS; k++) {
+        if (mask & (1ull << k))
+            pthread_rwlock_unlock(&t->range_lock[k]);
+    }
+}
+
+int csum_flush(struct csum_table *t) {
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    if (write_back(t) != 0 || fdatasync(t->fd) != 0)
+        ret = -1;
+    else if (!t->clean)
+        ret = write_header(t, true, false); // durable with the next sync; until then the table counts as unclean
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
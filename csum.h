@@ -0,0 +1,83 @@
+#ifndef CSUM_H_INCLUDED
+#define CSUM_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-block CRC32C table for a member device.
+ *
+ * The tail of the member is reserved for a table holding one CRC per block
+ * of data, followed by a one-page header. A stored CRC of 0 means "not
+ * verified" (never written, or trimmed). Table pages are cached in memory
+ * and written back in sorted, coalesced batches on flush; the header carries
+ * a clean flag that is cleared (durably) before the first write after a
+ * flush, so after a crash the table is recomputed from the data instead of
+ * being trusted.
+ */
+
+#define CSUM_BLOCK_SIZE 4096 // checksum granularity used by the backends
+#define CSUM_PAGE_SIZE 4096
+#define CSUM_PER_PAGE (CSUM_PAGE_SIZE / sizeof(uint32_t))
+#define CSUM_CACHE_PAGES 256 // cached table pages per member, enough for 1 GiB of 4 KiB blocks
+#define CSUM_LOCKS 64         // range locks per table (at most 64, see csum_lock())
+#define CSUM_LOCK_BLOCKS 16   // consecutive blocks covered by the same range lock
+
+struct csum_page {
+    uint64_t index; // table page held in this slot, UINT64_MAX if empty
+    bool dirty;
+    uint32_t crc[CSUM_PER_PAGE];
+};
+
+struct csum_table {
+    int fd;
+    const char *path;
+    uint32_t block_size;
+    uint64_t nblocks;
+    uint64_t data_size;   // bytes available for data at the start of the member
+    uint64_t table_off;   // start of the CRC table
+    uint64_t header_off;  // start of the header page
+
+    pthread_mutex_t lock;
+    bool clean;           // what the on-disk header says
+    struct csum_page *cache; // CSUM_CACHE_PAGES slots, direct-mapped by page index
+
+    pthread_rwlock_t range_lock[CSUM_LOCKS]; // data blocks and their CRCs, striped by block
+};
+
+/* Open the table at the tail of fd (dev_size bytes), creating it if there is
+ * none. Returns NULL on error; otherwise t->data_size is what is left for
+ * data. A table that wasn't cleanly flushed is recomputed from the data. */
+struct csum_table *csum_open(int fd, const char *path, uint32_t block_size, uint64_t dev_size);
+
+/* Write back the cached pages and free the table (does not close fd). */
+void csum_close(struct csum_table *t);
+
+/* Check len bytes of data at off (block aligned) against the table. Returns
+ * 0 if every verified block matches, 1 on a mismatch, -1 on an I/O error. */
+int csum_verify(struct csum_table *t, const void *buf, uint64_t off, uint64_t len);
+
+/* Record the CRCs of data about to be written at off (block aligned). */
+int csum_update(struct csum_table *t, const void *buf, uint64_t off, uint64_t len);
+
+/* Mark [off, off+len) unverified, e.g. after a hole was punched there. Only
+ * blocks entirely inside the range are affected. */
+int csum_forget(struct csum_table *t, uint64_t off, uint64_t len);
+
+/* Recompute the CRCs of [off, off+len) from what is on disk, after the data
+ * was changed behind the table's back (e.g. by copy_file_range). */
+int csum_refresh(struct csum_table *t, uint64_t off, uint64_t len);
+
+/* Lock the blocks of [off, off+len) against other csum_lock() callers:
+ * shared to read them and check their CRCs, exclusive to change the data and
+ * the CRCs together, so nobody sees one without the other. */
+void csum_lock(struct csum_table *t, uint64_t off, uint64_t len, bool exclusive);
+
+/* Undo csum_lock() of the same range. */
+void csum_unlock(struct csum_table *t, uint64_t off, uint64_t len);
+
+/* Write back the dirty pages, sync the member, and mark the table clean. */
+int csum_flush(struct csum_table *t);
+
+#endif /* CSUM_H_INCLUDED */
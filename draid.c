@@ -0,0 +1,1038 @@
+/*
+ * Declustered RAID example for BUSE
+ *
+ * Based on 'raid4'
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+/*
+ * Layout: every member is cut into rows of one block each. Row r lays its
+ * members out in the order of a pseudo-random permutation; the first n-1
+ * positions form stripes of `width` blocks (width-1 data blocks and a parity
+ * block), and the last position is the row's spare. Since the permutations
+ * differ from row to row, stripes and spare space are spread evenly over all
+ * the members.
+ *
+ * When a member fails, its blocks are recomputed from their stripes and
+ * written into the spare block of their row. Each row reads from and writes
+ * to different members, so the rebuild uses every surviving device in
+ * parallel, and finishes in about width/n of the time a rebuild onto one
+ * replacement device takes. Once that is done the array has full redundancy
+ * again, and the failed device can be replaced at leisure ('+' on start copies
+ * its blocks back).
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <argp.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buse.h"
+#include "cache.h"
+#include "evlog.h"
+#include "member.h"
+#include "probes.h"
+#include "qos.h"
+#include "readahead.h"
+#include "sparse.h"
+#include "state.h"
+#include "stats.h"
+#include "wbcache.h"
+#include "xor.h"
+
+#define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
+
+int dev_total = 0;
+struct member dev[16]; // the 4-16 underlying block devices that make up the RAID (dev[i].fd is -1 if missing)
+int block_size;
+uint64_t raid_device_size; // bytes used on every member
+struct cache *cache = NULL;  // read cache, if enabled by -M
+struct wbcache *wbcache = NULL;  // write-back cache device, if enabled by -B
+struct readahead *ra = NULL;  // sequential readahead, if enabled by -A
+
+int width = 0;    // blocks per stripe: width-1 data blocks and one parity block
+int row_data;     // data blocks per row
+uint64_t rows;    // rows in the array
+
+#define DRAID_BASES 32 // random permutations, each used in all dev_total rotations
+#define DRAID_PERMS (DRAID_BASES*16)
+int nperms;       // distinct row layouts, DRAID_BASES*dev_total; row r uses perm[r % nperms]
+uint8_t perm[DRAID_PERMS][16];  // member at each position of a row, the spare last
+uint8_t where[DRAID_PERMS][16]; // position of each member in a row
+
+#define DRAID_MAGIC "BUSEDRD1"
+struct draid_state {
+    uint32_t ndevs;
+    uint32_t width;
+    int32_t failed;   // member whose blocks are being (or were) rebuilt into the spare space, -1 if none
+    uint32_t pad;
+    uint64_t rebuilt; // rows [0, rebuilt) of the failed member are in their rows' spare blocks
+} state = { .failed = -1 };
+const char *state_path = NULL;
+
+pthread_mutex_t array_lock = PTHREAD_MUTEX_INITIALIZER; // keeps writes out of the rows the rebuild is computing
+pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spare_cond = PTHREAD_COND_INITIALIZER;
+bool spare_wanted = false; // a device failed and the rebuild thread should step in
+#define REBUILD_ROWS 256 // the rebuild recomputes (and locks out writes to) this many rows at a time
+
+/* A fixed seed: the layout has to come out the same on every start. */
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Every random base permutation is used in all its rotations, one per row,
+ * so over each run of dev_total rows every member takes every position (the
+ * spare included) exactly once. */
+static void make_perms(void) {
+    uint64_t seed = 0x6472616964ULL;
+    uint8_t base[16];
+    nperms = DRAID_BASES * dev_total;
+    for (int b=0; b < DRAID_BASES; b++) {
+        for (int i=0; i < dev_total; i++) {
+            base[i] = i;
+        }
+        for (int i=dev_total - 1; i > 0; i--) { // Fisher-Yates
+            int j = splitmix64(&seed) % (i + 1);
+            uint8_t t = base[i];
+            base[i] = base[j];
+            base[j] = t;
+        }
+        for (int shift=0; shift < dev_total; shift++) {
+            int r = b * dev_total + shift;
+            for (int i=0; i < dev_total; i++) {
+                perm[r][i] = (base[i] + shift) % dev_total;
+                where[r][perm[r][i]] = i;
+            }
+        }
+    }
+}
+
+static int spare_pos(void) {
+    return dev_total - 1;
+}
+
+/* Member holding position pos of row: the one the layout puts there or, once
+ * that member's blocks were rebuilt into the spare space, the row's spare. */
+static int slot_member(uint64_t row, int pos) {
+    const uint8_t *p = perm[row % nperms];
+    if (p[pos] == __atomic_load_n(&state.failed, __ATOMIC_ACQUIRE) && row < __atomic_load_n(&state.rebuilt, __ATOMIC_ACQUIRE)) {
+        return p[spare_pos()];
+    }
+    return p[pos];
+}
+
+/* Row and positions of the data and parity blocks of logical block b. */
+static void locate(uint64_t b, uint64_t *row, int *dpos, int *ppos) {
+    *row = b / row_data;
+    int j = b % row_data;
+    int first = j / (width - 1) * width;
+    *dpos = first + j % (width - 1);
+    *ppos = first + width - 1;
+}
+
+static int read_member(int d, void *out, size_t n, uint64_t off) {
+    struct member_io io = { .op = MEMBER_READ, .buf = out, .len = n, .offset = off };
+    return member_run(&dev[d], &io) < 0 ? -1 : 0;
+}
+
+/* Run io[0..n) on their members concurrently. Returns -1 if any of them failed. */
+static int run_all(struct member_io *io, int *io_dev, int n) {
+    struct member_batch batch;
+    member_batch_init(&batch);
+    for (int k=0; k<n; k++) {
+        member_submit(&dev[io_dev[k]], &io[k], &batch);
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) return -1;
+    }
+    return 0;
+}
+
+/* Recompute n bytes at off of position pos of row from the rest of its
+ * stripe, which is read concurrently. */
+static int reconstruct(uint64_t row, int pos, void *out, size_t n, uint64_t off) {
+    int first = pos / width * width;
+    char *tmp = malloc(n * (width - 1));
+    if (tmp == NULL) {
+        perror("reconstruct");
+        return -1;
+    }
+    struct member_io io[16];
+    int io_dev[16];
+    void *parts[16];
+    int k = 0;
+    for (int q = first; q < first + width; q++) {
+        if (q == pos) continue;
+        int m = slot_member(row, q);
+        if (!member_in_sync(&dev[m], off, n)) {
+            free(tmp);
+            return -1;
+        }
+        parts[k] = tmp + k*n;
+        io[k] = (struct member_io){ .op = MEMBER_READ, .buf = parts[k], .len = n, .offset = off };
+        io_dev[k++] = m;
+    }
+    int r = run_all(io, io_dev, k);
+    if (r == 0) {
+        PROBE3(reconstruct, slot_member(row, pos), off, n);
+        xor_blocks(out, parts, k, n);
+    }
+    free(tmp);
+    return r;
+}
+
+/* Serve a read of position pos of row that couldn't be read directly (tried
+ * says whether it was) from the rest of its stripe, and write the data back
+ * so the device can remap the bad sectors. */
+static int recover(uint64_t row, int pos, void *out, size_t n, uint64_t off, bool tried) {
+    int m = slot_member(row, pos);
+    if (reconstruct(row, pos, out, n, off) != 0) {
+        fprintf(stderr, "Read error on device %d (%s) at offset %lu, and it could not be reconstructed\n", m, dev[m].path, off);
+        return -1;
+    }
+    if (tried && member_ok(&dev[m])) {
+        struct member_io io = { .op = MEMBER_WRITE, .buf = out, .len = n, .offset = off };
+        member_run(&dev[m], &io);
+    }
+    return 0;
+}
+
+struct piece {
+    uint64_t row;
+    int pos;
+    char *buf;
+    size_t len;
+    uint64_t off;  // on the member
+    bool tried;    // read directly, as io[] entry number io
+    int io;
+};
+
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_READ, offset, len);
+    qos_note_foreground();
+    if (len == 0) {
+        return 0;
+    }
+
+    // every block comes straight from its member, all of them at once;
+    // whatever can't be read that way is reconstructed afterwards
+    u_int64_t block_num_from = offset / block_size;
+    u_int64_t block_num_to = (offset + len - 1) / block_size;
+    int count = block_num_to - block_num_from + 1;
+    struct piece *pieces = malloc(count * sizeof(*pieces));
+    struct member_io *io = malloc(count * sizeof(*io));
+    int *io_dev = malloc(count * sizeof(*io_dev));
+    if (pieces == NULL || io == NULL || io_dev == NULL) {
+        perror("read");
+        free(pieces); free(io); free(io_dev);
+        return -1;
+    }
+    u_int64_t bytes_read = 0;
+    int n = 0;
+    for (int i=0; i < count; i++) {
+        struct piece *p = &pieces[i];
+        int ppos;
+        u_int64_t block_offset = (offset + bytes_read) % block_size;
+        locate(block_num_from + i, &p->row, &p->pos, &ppos);
+        p->buf = (char *)buf + bytes_read;
+        p->len = block_size - block_offset < len - bytes_read ? block_size - block_offset : len - bytes_read;
+        p->off = p->row * block_size + block_offset;
+        int m = slot_member(p->row, p->pos);
+        p->tried = member_in_sync(&dev[m], p->off, p->len);
+        if (p->tried) {
+            p->io = n;
+            io[n] = (struct member_io){ .op = MEMBER_READ, .buf = p->buf, .len = p->len, .offset = p->off };
+            io_dev[n++] = m;
+        }
+        bytes_read += p->len;
+    }
+    run_all(io, io_dev, n);
+
+    int ret = 0;
+    for (int i=0; i < count && ret == 0; i++) {
+        struct piece *p = &pieces[i];
+        if (p->tried && io[p->io].result >= 0) continue;
+        ret = recover(p->row, p->pos, p->buf, p->len, p->off, p->tried);
+    }
+    free(pieces);
+    free(io);
+    free(io_dev);
+    return ret;
+}
+
+/* Write n bytes of data at off to position dpos of row and update the parity
+ * at ppos. Scratch must hold 3*n bytes. Succeeds as long as the new data can
+ * be read back, directly or through parity. */
+static int write_slot(uint64_t row, int dpos, int ppos, const void *data, size_t n, uint64_t off, char *scratch) {
+    char *old_d = scratch, *old_p = scratch + n, *new_p = scratch + 2*n;
+    int d = slot_member(row, dpos), p = slot_member(row, ppos);
+    struct member_io io[2];
+    int io_dev[2];
+
+    if (!member_ok(&dev[p])) {
+        // no parity to keep up to date
+        struct member_io w = { .op = MEMBER_WRITE, .buf = (void *)data, .len = n, .offset = off };
+        return member_ok(&dev[d]) && member_run(&dev[d], &w) >= 0 ? 0 : -1;
+    }
+
+    bool rmw = member_in_sync(&dev[d], off, n) && member_in_sync(&dev[p], off, n);
+    if (rmw) {
+        // read-modify-write: fetch old data and old parity at once
+        io[0] = (struct member_io){ .op = MEMBER_READ, .buf = old_d, .len = n, .offset = off };
+        io[1] = (struct member_io){ .op = MEMBER_READ, .buf = old_p, .len = n, .offset = off };
+        io_dev[0] = d;
+        io_dev[1] = p;
+        if (run_all(io, io_dev, 2) == 0) {
+            PROBE3(parity_start, d, off, n);
+            memcpy(new_p, data, n);
+            xor_into(new_p, old_d, n);
+            xor_into(new_p, old_p, n);
+            PROBE3(parity_done, d, off, n);
+        } else {
+            rmw = false; // one of them is unreadable here, compute the parity from the rest of the stripe instead
+        }
+    }
+    if (!rmw) {
+        // reconstruct-write: new parity is the new data XOR the stripe's other data blocks
+        PROBE3(parity_start, d, off, n);
+        memcpy(new_p, data, n);
+        for (int q = ppos - width + 1; q < ppos; q++) {
+            if (q == dpos) continue;
+            int m = slot_member(row, q);
+            if (!member_in_sync(&dev[m], off, n) || read_member(m, old_d, n, off) != 0) {
+                fprintf(stderr, "Write error on device %d at offset %lu: parity can't be computed\n", d, off);
+                return -1;
+            }
+            xor_into(new_p, old_d, n);
+        }
+        PROBE3(parity_done, d, off, n);
+    }
+
+    // write data and parity at once
+    int k = 0;
+    if (member_ok(&dev[d])) {
+        io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = (void *)data, .len = n, .offset = off };
+        io_dev[k++] = d;
+    }
+    io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = new_p, .len = n, .offset = off };
+    io_dev[k++] = p;
+    run_all(io, io_dev, k);
+    bool stored = false;
+    for (int i=0; i<k; i++) {
+        if (io[i].result >= 0) stored = true;
+    }
+    if (!stored) {
+        fprintf(stderr, "Write error on device %d at offset %lu: neither data nor parity could be stored\n", d, off);
+        return -1;
+    }
+    return 0;
+}
+
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_WRITE, offset, len);
+    qos_note_foreground();
+
+    u_int64_t block_num_from = offset / block_size;
+    u_int64_t block_num_to = (offset+len) / block_size;
+    u_int64_t block_byte_to = block_size;
+    u_int64_t bytes_written = 0;
+    int ret = 0;
+
+    char *scratch = malloc(3 * (size_t)block_size);
+    if (scratch == NULL) {
+        perror("write");
+        return -1;
+    }
+    pthread_mutex_lock(&array_lock);
+    for(u_int64_t b = block_num_from; b <= block_num_to; b++){
+        u_int64_t row;
+        int dpos, ppos;
+        locate(b, &row, &dpos, &ppos);
+        u_int64_t block_offset = (offset + bytes_written) % block_size;
+        u_int64_t dev_offset = row * block_size + block_offset;
+
+        if(b == block_num_to) {
+            block_byte_to = (offset+len) % block_size;
+        }
+
+        if (block_byte_to == block_offset) {
+            break; // request ends on a block boundary
+        }
+        size_t curr_bytes_written = block_byte_to - block_offset;
+
+        if (write_slot(row, dpos, ppos, (const char *)buf + bytes_written, curr_bytes_written, dev_offset, scratch) != 0) {
+            ret = -1;
+            break;
+        }
+        bytes_written += curr_bytes_written;
+        if (bytes_written >= len) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&array_lock);
+    free(scratch);
+    return ret;
+}
+
+/* Whether all the data is still there: at most one member is gone, not
+ * counting one whose blocks are all in the spare space. */
+static bool array_intact(void) {
+    int missing = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i])) continue;
+        if (i == __atomic_load_n(&state.failed, __ATOMIC_ACQUIRE) && __atomic_load_n(&state.rebuilt, __ATOMIC_ACQUIRE) >= rows) continue;
+        missing++;
+    }
+    return missing <= 1;
+}
+
+/* Trim len bytes at offset block by block: a block that is a hole on its
+ * member already is zeros there and in the parity, anything else is written
+ * with zeros through the parity update. */
+static int trim_blocks(u_int64_t len, u_int64_t offset, char *scratch, const char *zeros) {
+    for (u_int64_t pos = offset; pos < offset + len; ) {
+        u_int64_t b = pos / block_size, row;
+        int dpos, ppos;
+        locate(b, &row, &dpos, &ppos);
+        u_int64_t end = (b + 1) * block_size < offset + len ? (b + 1) * block_size : offset + len;
+        u_int64_t off = row * block_size + pos % block_size, data, hole;
+        int m = slot_member(row, dpos);
+        if (!member_in_sync(&dev[m], off, end - pos) || sparse_next_data(dev[m].fd, off, off + (end - pos), &data, &hole) != 1) {
+            if (write_slot(row, dpos, ppos, zeros, end - pos, off, scratch) != 0) {
+                return -1;
+            }
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+/* Whole rows are punched on every member: data, parity and spare blocks all
+ * become zeros, which keeps every stripe's parity right, and a missing
+ * member's blocks reconstruct as zeros. The rows at either end are trimmed
+ * block by block. */
+static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_TRIM, from, len);
+    qos_note_foreground();
+
+    int ret = 0;
+    char *scratch = malloc(3 * (size_t)block_size);
+    char *zeros = calloc(1, block_size);
+    if (scratch == NULL || zeros == NULL) {
+        perror("trim");
+        free(scratch);
+        free(zeros);
+        return -1;
+    }
+    pthread_mutex_lock(&array_lock);
+    uint64_t row_bytes = (uint64_t)row_data * block_size;
+    uint64_t row = (from + row_bytes - 1) / row_bytes, end_row = (from + len) / row_bytes;
+    uint64_t done = 0;
+    if (end_row > row) {
+        done = row * row_bytes - from;
+        ret = trim_blocks(done, from, scratch, zeros);
+        struct member_io io[16];
+        int io_dev[16];
+        int n = 0;
+        for (int i=0; i < dev_total && ret == 0; i++) {
+            if (!member_ok(&dev[i])) continue;
+            io[n] = (struct member_io){ .op = MEMBER_PUNCH, .len = (end_row - row) * block_size, .offset = row * block_size };
+            io_dev[n++] = i;
+        }
+        run_all(io, io_dev, n);
+        if (ret == 0 && !array_intact()) {
+            fprintf(stderr, "Trim error at row %lu: too many devices are unavailable\n", row);
+            ret = -1;
+        }
+        done += (end_row - row) * row_bytes;
+    }
+    if (ret == 0 && done < len) {
+        ret = trim_blocks(len - done, from + done, scratch, zeros);
+    }
+    pthread_mutex_unlock(&array_lock);
+    free(scratch);
+    free(zeros);
+    return ret;
+}
+
+static int xmp_flush(void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_FLUSH, 0, 0);
+
+    // we use fsync to flush OS buffers to underlying devices, all of them at once
+    struct member_io io[16];
+    int io_dev[16];
+    int n = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i])) {
+            io[n] = (struct member_io){ .op = MEMBER_FSYNC };
+            io_dev[n++] = i;
+        }
+    }
+    run_all(io, io_dev, n);
+    if (!array_intact()) {
+        fprintf(stderr, "Flush error: too many devices are unavailable\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void xmp_disc(void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_DISC, 0, 0);
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i]) && dev[i].csum) {
+            struct member_io io = { .op = MEMBER_FSYNC };
+            member_run(&dev[i], &io); // leaves the checksum table marked clean
+        }
+    }
+}
+
+/* Called by the member layer when a device fails; the rebuild thread takes it from there. */
+static void device_failed(struct member *m) {
+    UNUSED(m);
+    pthread_mutex_lock(&spare_lock);
+    spare_wanted = true;
+    pthread_cond_signal(&spare_cond);
+    pthread_mutex_unlock(&spare_lock);
+}
+
+struct rebuild_job {
+    int target;   // member holding the row's spare block
+    uint64_t row;
+    char *parts;  // width-1 blocks read from the stripe, then the recomputed one
+};
+
+/* Recompute member f's blocks of rows [from, to) into their rows' spare
+ * blocks. All the reads of the batch go out at once, then all the writes, so
+ * every surviving member is busy. */
+static int rebuild_rows(int f, uint64_t from, uint64_t to, char *buf, struct member_io *io, int *io_dev, struct rebuild_job *jobs) {
+    int njobs = 0, n = 0;
+    for (uint64_t row = from; row < to; row++) {
+        const uint8_t *p = perm[row % nperms];
+        int pos = where[row % nperms][f];
+        if (pos == spare_pos()) continue; // f only held spare space in this row
+        struct rebuild_job *j = &jobs[njobs];
+        j->target = p[spare_pos()];
+        j->row = row;
+        j->parts = buf + (uint64_t)njobs * width * block_size;
+        int k = 0;
+        for (int q = pos / width * width; q < pos / width * width + width; q++) {
+            if (q == pos) continue;
+            if (!member_in_sync(&dev[p[q]], row * block_size, block_size)) return -1;
+            io[n] = (struct member_io){ .op = MEMBER_READ, .buf = j->parts + (uint64_t)k++ * block_size, .len = block_size, .offset = row * block_size, .qos = MEMBER_QOS_REBUILD };
+            io_dev[n++] = p[q];
+        }
+        njobs++;
+    }
+    if (run_all(io, io_dev, n) != 0) {
+        return -1;
+    }
+    for (int i=0; i < njobs; i++) {
+        struct rebuild_job *j = &jobs[i];
+        void *parts[16];
+        for (int k=0; k < width - 1; k++) {
+            parts[k] = j->parts + (uint64_t)k * block_size;
+        }
+        char *out = j->parts + (uint64_t)(width - 1) * block_size;
+        xor_blocks(out, parts, width - 1, block_size);
+        io[i] = (struct member_io){ .op = MEMBER_WRITE, .buf = out, .len = block_size, .offset = j->row * block_size, .qos = MEMBER_QOS_REBUILD };
+        io_dev[i] = j->target;
+    }
+    if (run_all(io, io_dev, njobs) != 0) {
+        return -1;
+    }
+    n = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i])) {
+            io[n] = (struct member_io){ .op = MEMBER_FSYNC, .qos = MEMBER_QOS_REBUILD }; // durable before the progress is saved
+            io_dev[n++] = i;
+        }
+    }
+    return run_all(io, io_dev, n);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Rebuild member f into the distributed spare space while the array stays
+ * online, resuming at state.rebuilt. Reads use the spare blocks for every
+ * row below the mark. */
+static int rebuild_distributed(int f) {
+    size_t per_batch = (size_t)REBUILD_ROWS * width;
+    char *buf = malloc(per_batch * block_size);
+    struct member_io *io = malloc(per_batch * sizeof(*io));
+    int *io_dev = malloc(per_batch * sizeof(*io_dev));
+    struct rebuild_job *jobs = malloc(REBUILD_ROWS * sizeof(*jobs));
+    if (buf == NULL || io == NULL || io_dev == NULL || jobs == NULL) {
+        perror("rebuild");
+        free(buf); free(io); free(io_dev); free(jobs);
+        return -1;
+    }
+    uint64_t start = now_us(), first = state.rebuilt;
+    int reported = first * 10 / rows;
+    int r = 0;
+    for (uint64_t row = first; row < rows && r == 0; row += REBUILD_ROWS) {
+        uint64_t end = rows - row < REBUILD_ROWS ? rows : row + REBUILD_ROWS;
+        pthread_mutex_lock(&array_lock);
+        r = rebuild_rows(f, row, end, buf, io, io_dev, jobs);
+        if (r == 0) {
+            __atomic_store_n(&state.rebuilt, end, __ATOMIC_RELEASE);
+            PROBE3(rebuild, f, end * block_size, raid_device_size);
+            r = state_save(state_path, DRAID_MAGIC, &state, sizeof(state));
+        }
+        pthread_mutex_unlock(&array_lock);
+        if (r == 0 && (int)(end * 10 / rows) > reported) {
+            reported = end * 10 / rows;
+            fprintf(stderr, "Rebuild of device %d: %d%% done\n", f, reported * 10);
+        }
+        if (r == 0) {
+            qos_wait(MEMBER_QOS_REBUILD, (end - row) * block_size);
+        }
+    }
+    free(buf); free(io); free(io_dev); free(jobs);
+    if (r != 0) {
+        fprintf(stderr, "Rebuild of device %d stopped at row %lu: another device failed\n", f, state.rebuilt);
+        return -1;
+    }
+    double secs = (now_us() - start) / 1e6;
+    fprintf(stderr, "Rebuild of device %d into the distributed spare complete in %.1f s (%.1f MB/s of the lost device); the array is no longer degraded.\n",
+            f, secs, secs > 0 ? (rows - first) * block_size / secs / 1e6 : 0.0);
+    return 0;
+}
+
+/* Waits for devices to fail and rebuilds the first one into the spare space. */
+static void *rebuild_thread(void *arg) {
+    UNUSED(arg);
+    for (;;) {
+        pthread_mutex_lock(&spare_lock);
+        while (!spare_wanted) {
+            pthread_cond_wait(&spare_cond, &spare_lock);
+        }
+        spare_wanted = false;
+        pthread_mutex_unlock(&spare_lock);
+
+        int f = state.failed;
+        if (f == -1) {
+            for (int i=0; i<dev_total && f == -1; i++) {
+                if (!member_ok(&dev[i])) f = i;
+            }
+            if (f == -1) continue;
+            fprintf(stderr, "Rebuilding device %d into the distributed spare space of all the others...\n", f);
+            pthread_mutex_lock(&array_lock);
+            state.rebuilt = 0;
+            __atomic_store_n(&state.failed, f, __ATOMIC_RELEASE);
+            int r = state_save(state_path, DRAID_MAGIC, &state, sizeof(state));
+            pthread_mutex_unlock(&array_lock);
+            if (r != 0) {
+                fprintf(stderr, "Can't record the rebuild in '%s', running degraded.\n", state_path);
+                continue;
+            }
+        }
+        if (state.rebuilt < rows) {
+            rebuild_distributed(f);
+        } else {
+            for (int i=0; i<dev_total; i++) {
+                if (i != f && !member_ok(&dev[i])) {
+                    fprintf(stderr, "DEGRADED: device %d failed and the spare space is taken by device %d; replace that one to make room.\n", i, f);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Copy the failed member's blocks back from the spare space onto its replacement. */
+static int do_copyback(int f) {
+    char buf[block_size];
+    for (uint64_t row=0; row < rows; row++) {
+        int pos = where[row % nperms][f];
+        if (pos == spare_pos()) continue;
+        int src = perm[row % nperms][spare_pos()];
+        if (read_member(src, buf, block_size, row * block_size) != 0) {
+            fprintf(stderr, "copyback_read: device %d, offset=%zu\n", src, row * block_size);
+            return -1;
+        }
+        struct member_io wr = { .op = MEMBER_WRITE, .buf = buf, .len = block_size, .offset = row * block_size };
+        if (member_run(&dev[f], &wr) < 0) {
+            fprintf(stderr, "copyback_write: %s, offset=%zu\n", strerror(wr.error), row * block_size);
+            return -1;
+        }
+    }
+    struct member_io io = { .op = MEMBER_FSYNC };
+    if (member_run(&dev[f], &io) < 0) {
+        return -1;
+    }
+    state.failed = -1;
+    state.rebuilt = 0;
+    return state_save(state_path, DRAID_MAGIC, &state, sizeof(state));
+}
+
+/* argument parsing using argp */
+
+static struct argp_option options[] = {
+    {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"width", 'w', "K", 0, "Stripe width: K-1 data blocks plus parity (at least 3, and DEVICE count - 1 must be a multiple of it). By default the widest that still leaves two stripes per row", 0},
+    {"state", 's', "FILE", 0, "Keep the geometry and rebuild progress in FILE (required)", 0},
+    {"retries", 'r', "COUNT", 0, "Retry I/Os that fail with a transient error COUNT times (default 3)", 0},
+    {"max-errors", 'e', "COUNT", 0, "Fail a device after COUNT read errors that retrying didn't fix (default 10); write errors fail it right away", 0},
+    {"readahead", 'A', "KB", 0, "Detect sequential readers and read up to KB kilobytes ahead of each (0 disables, the default)", 0},
+    {"cache", 'M', "MB", 0, "Keep a read cache of MB megabytes in memory in front of the array (0 disables, the default)", 0},
+    {"wb-cache", 'B', "FILE", 0, "Use the fast device or file FILE as a write-back cache: writes are acknowledged once logged there and destaged to the array in the background", 0},
+    {"stats", 'T', "SOCKET", 0, "Serve latency histograms and counters for requests and for each device on the Unix socket SOCKET (read them with buse-stat)", 0},
+    {"trace", 'R', "FILE", 0, "Record every request (type, offset, length, timing) in the binary trace FILE, for buse-replay", 0},
+    {"trace-hashes", 'X', 0, 0, "With --trace, also record a CRC32C of the data of every read and write", 0},
+    {"log", 'L', "FILE", 0, "Write the -v request log to the binary FILE instead of stderr, for buse-log (implies -v)", 0},
+    {"merge-window", 'G', "USEC", 0, "Hold requests for up to USEC microseconds to merge adjacent reads and writes into larger ones (raid4: into full-stripe writes)", 0},
+    {"latency-target", 'Q', "USEC", 0, "Slow the background rebuild and scrub down while the p99 latency of client reads on any device is above USEC microseconds (0, the default: whenever clients are busy)", 0},
+    {"rebuild-rate", 'U', "MBPS", 0, "Rebuild a replaced device online at up to MBPS MB/s, less while clients need the devices (0, the default: unlimited)", 0},
+    {0},
+};
+
+struct arguments {
+    uint32_t block_size;
+    char* device[16];
+    char* raid_device;
+    int verbose;
+    int width;
+    char* state;
+    int retries;
+    int max_errors;
+    uint32_t readahead_kb;
+    uint32_t cache_mb;
+    char *wb_cache;
+    char *stats;
+    char *trace;
+    int trace_hashes;
+    char *log;
+    uint32_t merge_window_us;
+    uint32_t latency_target_us;
+    uint32_t rebuild_mbps;
+};
+
+/* Parse a single option. */
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+    char * endptr;
+
+    switch (key) {
+
+        case 'v':
+            arguments->verbose = 1;
+            break;
+
+        case 'w':
+            arguments->width = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->width < 3) {
+                errx(EXIT_FAILURE, "width K must be an integer of at least 3");
+            }
+            break;
+
+        case 's':
+            arguments->state = arg;
+            break;
+
+        case 'r':
+            arguments->retries = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "retries COUNT must be an integer");
+            }
+            break;
+
+        case 'e':
+            arguments->max_errors = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->max_errors == 0) {
+                errx(EXIT_FAILURE, "max-errors COUNT must be a positive integer");
+            }
+            break;
+
+        case 'B':
+            arguments->wb_cache = arg;
+            break;
+
+        case 'T':
+            arguments->stats = arg;
+            break;
+
+        case 'R':
+            arguments->trace = arg;
+            break;
+
+        case 'X':
+            arguments->trace_hashes = 1;
+            break;
+
+        case 'L':
+            arguments->log = arg;
+            break;
+
+        case 'G':
+            arguments->merge_window_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "merge window must be an integer");
+            }
+            break;
+
+        case 'Q':
+            arguments->latency_target_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "latency target must be an integer");
+            }
+            break;
+
+        case 'U':
+            arguments->rebuild_mbps = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "rebuild MBPS must be an integer");
+            }
+            break;
+
+        case 'A':
+            arguments->readahead_kb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "readahead KB must be an integer");
+            }
+            break;
+
+        case 'M':
+            arguments->cache_mb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "cache MB must be an integer");
+            }
+            break;
+
+        case ARGP_KEY_ARG: // parsing arguments after options
+            if (state->arg_num == 0){
+                arguments->block_size = strtoul(arg, &endptr, 10);
+                if (*endptr != '\0') {
+                    /* failed to parse integer */
+                    errx(EXIT_FAILURE, "SIZE must be an integer");
+                }
+            } else if (state->arg_num == 1){
+                arguments->raid_device = arg;
+            } else if (state->arg_num < 18){
+                arguments->device[dev_total++] = arg;
+            } else {
+                warnx("too many arguments (valid number of drives are 4 to 16)");
+                /* Too many arguments. */
+                return ARGP_ERR_UNKNOWN;
+            }
+            break;
+
+        case ARGP_KEY_END:
+            if (state->arg_num < 6) {
+                warnx("not enough arguments");
+                argp_usage(state);
+            }
+            if (arguments->state == NULL) {
+                warnx("--state is required");
+                argp_usage(state);
+            }
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {
+    .options = options,
+    .parser = parse_opt,
+    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2 DEVICE3 DEVICE4 ... (up to 16 DEVICEs)",
+    .doc = "BUSE implementation of declustered single-parity RAID with one device's worth of distributed spare space.\n"
+           "`BLOCKSIZE` is an integer number of bytes. "
+           "\n\n"
+           "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
+           "\n\n"
+           "`DEVICE*` is a path to underlying block devices. Normal files can be used too. A `DEVICE` may be specified as \"MISSING\"; "
+           "a missing or failed device is rebuilt into the spare space of all the others in the background. "
+           "\n\n"
+           "Once that is done, prepend '+' to the replacement of that device to copy its blocks back onto it before the RAID is started. "
+};
+
+int main(int argc, char *argv[]) {
+    struct arguments arguments = {
+        .verbose = 0,
+        .retries = 3,
+        .max_errors = 10,
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    struct buse_operations bop = {
+        .read = xmp_read,
+        .write = xmp_write,
+        .disc = xmp_disc,
+        .flush = xmp_flush,
+        .trim = xmp_trim,
+    };
+
+    block_size = arguments.block_size;
+    member_retries = arguments.retries;
+    member_max_errors = arguments.max_errors;
+    qos_members(dev, &dev_total);
+    qos_target_us = arguments.latency_target_us;
+    qos_set_cap(MEMBER_QOS_REBUILD, arguments.rebuild_mbps);
+    state_path = arguments.state;
+
+    // the geometry of an existing array comes from its state file
+    int r = state_load(state_path, DRAID_MAGIC, &state, sizeof(state));
+    if (r < 0) {
+        exit(1);
+    }
+    if (r == 1) {
+        width = arguments.width;
+        for (int k = (dev_total - 1) / 2; width == 0 && k >= 3; k--) {
+            if ((dev_total - 1) % k == 0) width = k;
+        }
+        if (width == 0) width = dev_total - 1;
+        state = (struct draid_state){ .ndevs = dev_total, .width = width, .failed = -1 };
+    } else {
+        if (state.ndevs != (uint32_t)dev_total) {
+            fprintf(stderr, "ERROR: '%s' describes an array of %u devices, but %d were given.\n", state_path, state.ndevs, dev_total);
+            exit(1);
+        }
+        if (arguments.width && arguments.width != (int)state.width) {
+            fprintf(stderr, "ERROR: the array was created with --width %u.\n", state.width);
+            exit(1);
+        }
+        width = state.width;
+    }
+    if (width < 3 || (dev_total - 1) % width != 0) {
+        fprintf(stderr, "ERROR: %d devices can't be split into stripes of %d plus a spare.\n", dev_total, width);
+        exit(1);
+    }
+    row_data = (dev_total - 1) / width * (width - 1);
+    make_perms();
+
+    raid_device_size=0; // will be detected from the drives available
+    int missing = -1, copyback = -1;
+    for (int i=0; i < dev_total; i++) {
+        char* dev_path = arguments.device[i];
+        dev[i].on_fail = device_failed;
+        if (strcmp(dev_path,"MISSING")==0) {
+            if (missing != -1) {
+                fprintf(stderr, "ERROR: Multiple 'MISSING' drives specified. Can only handle one at a time.\n");
+                exit(1);
+            }
+            missing = i;
+            fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
+            dev[i].index = i;
+            if (member_start(&dev[i], -1, dev_path) != 0) {
+                exit(1);
+            }
+            continue;
+        }
+        if (dev_path[0] == '+') {
+            dev_path++; // shave off the '+' for the subsequent logic
+            copyback = i;
+        }
+        int fd = open(dev_path,O_RDWR);
+        if (fd < 0) {
+            perror(dev_path);
+            exit(1);
+        }
+        uint64_t size = lseek(fd,0,SEEK_END); // used to find device size by seeking to end
+        fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
+        if (raid_device_size==0 || size<raid_device_size) {
+            raid_device_size = size; // raid_device_size is minimum size of available devices
+        }
+        dev[i].index = i;
+        if (member_start(&dev[i], fd, dev_path) != 0) {
+            exit(1);
+        }
+    }
+    raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
+    rows = raid_device_size / block_size;
+
+    if (copyback != -1) {
+        if (copyback != state.failed || state.rebuilt < rows) {
+            fprintf(stderr, "ERROR: Only device %d, once rebuilt into the spare space, can be replaced with '+'.\n", state.failed);
+            exit(1);
+        }
+        fprintf(stderr, "Copying device %d back from the spare space...\n", copyback);
+        if (do_copyback(copyback) != 0) {
+            fprintf(stderr, "Copyback failed, aborting.\n");
+            exit(1);
+        }
+    } else if (r == 1 && state_save(state_path, DRAID_MAGIC, &state, sizeof(state)) != 0) {
+        exit(1);
+    }
+    if (state.failed != -1 && state.failed != missing && missing != -1) {
+        fprintf(stderr, "ERROR: Device %d is still in the spare space, so device %d can't be MISSING too.\n", state.failed, missing);
+        exit(1);
+    }
+    if (state.failed != -1 && state.failed != missing) {
+        fprintf(stderr, "Device %d was failed earlier, not using it.\n", state.failed);
+        member_fail(&dev[state.failed]);
+    }
+
+    pthread_t rebuilder;
+    spare_wanted = missing != -1 || (state.failed != -1 && state.rebuilt < rows);
+    if (pthread_create(&rebuilder, NULL, rebuild_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: can't start the rebuild thread.\n");
+        exit(1);
+    }
+
+    bop.size = rows * row_data * block_size; // tell BUSE how big our block device is
+    bop.blksize = arguments.block_size;
+    fprintf(stderr, "%d devices, stripes of %d+1, %d stripes and one spare block per row.\n", dev_total, width - 1, (dev_total - 1) / width);
+    fprintf(stderr, "RAID device resulting size: %ld.\nRAID device: %s\n", bop.size, arguments.raid_device);
+
+    if (arguments.stats && stats_start(arguments.stats, dev, &dev_total) != 0) {
+        exit(1);
+    }
+    if (arguments.trace && buse_trace(arguments.trace, arguments.trace_hashes) != 0) {
+        exit(1);
+    }
+    if ((arguments.verbose || arguments.log) && evlog_open(arguments.log) != 0) {
+        exit(1);
+    }
+    buse_merge(arguments.merge_window_us);
+    void *userdata = NULL;
+    if (arguments.readahead_kb > 0 && (ra = readahead_wrap(&bop, &userdata, (uint64_t)arguments.readahead_kb << 10)) == NULL) {
+        exit(1);
+    }
+    if (arguments.wb_cache && (wbcache = wbcache_wrap(&bop, &userdata, arguments.wb_cache, 0)) == NULL) {
+        exit(1);
+    }
+    if (arguments.cache_mb > 0 && (cache = cache_wrap(&bop, &userdata, (uint64_t)arguments.cache_mb << 20)) == NULL) {
+        exit(1);
+    }
+    return buse_main(arguments.raid_device, &bop, userdata);
+}
@@ -0,0 +1,231 @@
+/*
+ * evlog - per-thread ring buffers for the -v event log
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evlog.h"
+
+/* A single-producer single-consumer ring: the owning thread fills slots and
+ * moves head, the drain thread empties them and moves tail. Each index is
+ * only written by one side, so publishing it with a release store is all
+ * the synchronization there is. */
+struct ring {
+    struct evlog_record rec[EVLOG_RING];
+    uint64_t head __attribute__((aligned(64)));  // owner: next slot to fill
+    uint64_t lost;                               // owner: records dropped on a full ring
+    uint64_t tail __attribute__((aligned(64)));  // drain: next slot to empty
+    uint16_t thread;
+    struct ring *next;           // never changes once the ring is on the list
+};
+
+static __thread struct ring *own;
+static struct ring *rings;       // every thread's ring, newest first
+static uint16_t nthreads;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool logging;
+static pid_t owner;              // buse_main()'s child exits through our atexit() too
+static uint64_t start_ns;
+static int fd = -1;              // binary log, or -1 for text on stderr
+static char out[EVLOG_RING * sizeof(struct evlog_record)];
+static size_t out_len;
+static bool failed;
+
+static pthread_t drainer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping;
+
+static const char *names[EVLOG_EVENTS] = { "R", "W", "flush", "disconnect", "T", "lost" };
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void evlog_print(FILE *o, const struct evlog_record *r) {
+    switch (r->event) {
+    case EVLOG_READ:
+    case EVLOG_WRITE:
+    case EVLOG_TRIM:
+        fprintf(o, "%s - %lu, %u\n", names[r->event], r->offset, r->len);
+        break;
+    case EVLOG_FLUSH:
+    case EVLOG_DISC:
+        fprintf(o, "Received a %s request.\n", names[r->event]);
+        break;
+    case EVLOG_LOST:
+        fprintf(o, "Lost %lu events: thread %u logged faster than they were written out.\n", r->offset, r->thread);
+        break;
+    default:
+        fprintf(o, "Unknown event %u - %lu, %u\n", r->event, r->offset, r->len);
+    }
+}
+
+static struct ring *ring_new(void) {
+    struct ring *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    r->thread = nthreads++;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+void evlog(enum evlog_event event, uint64_t offset, uint32_t len) {
+    if (!__atomic_load_n(&logging, __ATOMIC_RELAXED)) {
+        return;
+    }
+    struct ring *r = own;
+    if (r == NULL && (r = own = ring_new()) == NULL) {
+        return;
+    }
+    uint64_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == EVLOG_RING) {
+        __atomic_fetch_add(&r->lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->rec[head % EVLOG_RING] = (struct evlog_record){ .time_ns = mono_ns() - start_ns, .offset = offset, .len = len,
+                                                       .event = event, .thread = r->thread };
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_out(void) {
+    const char *p = out;
+    while (out_len > 0 && !failed) {
+        ssize_t n = write(fd, p, out_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("evlog");
+            failed = true;
+            break;
+        }
+        p += n;
+        out_len -= n;
+    }
+    out_len = 0;
+}
+
+static void emit(const struct evlog_record *r) {
+    if (fd < 0) {
+        evlog_print(stderr, r);
+        return;
+    }
+    if (out_len + sizeof(*r) > sizeof(out)) {
+        write_out();
+    }
+    memcpy(out + out_len, r, sizeof(*r));
+    out_len += sizeof(*r);
+}
+
+/* Move everything logged so far out of the rings, thread by thread. */
+static void drain(void) {
+    pthread_mutex_lock(&rings_lock);
+    struct ring *list = rings;
+    pthread_mutex_unlock(&rings_lock);
+    for (struct ring *r = list; r != NULL; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = r->tail; i != head; i++) {
+            emit(&r->rec[i % EVLOG_RING]);
+        }
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+        uint64_t lost = __atomic_exchange_n(&r->lost, 0, __ATOMIC_RELAXED);
+        if (lost > 0) {
+            struct evlog_record e = { .time_ns = mono_ns() - start_ns, .offset = lost, .event = EVLOG_LOST, .thread = r->thread };
+            emit(&e);
+        }
+    }
+    if (fd >= 0) {
+        write_out();
+    }
+}
+
+static void *drain_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&drain_lock);
+    while (!stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += EVLOG_DRAIN_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&drain_cond, &drain_lock, &ts);
+        pthread_mutex_unlock(&drain_lock);
+        drain();
+        pthread_mutex_lock(&drain_lock);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    drain(); // whatever came in last
+    return NULL;
+}
+
+static void evlog_close(void) {
+    if (getpid() != owner) {
+        return;
+    }
+    pthread_mutex_lock(&drain_lock);
+    stopping = true;
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(drainer, NULL);
+    __atomic_store_n(&logging, false, __ATOMIC_RELAXED);
+    if (fd >= 0 && close(fd) != 0) {
+        perror("evlog");
+    }
+}
+
+int evlog_open(const char *path) {
+    if (path != NULL) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_ns = mono_ns();
+    if (fd >= 0) {
+        struct evlog_header h = { .record_size = sizeof(struct evlog_record),
+                                  .start_unix_ns = now.tv_sec * 1000000000ull + now.tv_nsec };
+        memcpy(h.magic, EVLOG_MAGIC, sizeof(h.magic));
+        memcpy(out, &h, sizeof(h));
+        out_len = sizeof(h);
+        write_out();
+        if (failed) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (pthread_create(&drainer, NULL, drain_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: can't start the event log thread.\n");
+        return -1;
+    }
+    owner = getpid();
+    atexit(evlog_close);
+    __atomic_store_n(&logging, true, __ATOMIC_RELAXED);
+    return 0;
+}
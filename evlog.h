@@ -0,0 +1,59 @@
+#ifndef EVLOG_H_INCLUDED
+#define EVLOG_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Event log for -v.
+ *
+ * evlog() is cheap enough for every request: it stores a fixed-size record
+ * in a ring owned by the calling thread, so there is no lock and no shared
+ * cache line on the way. A background thread drains the rings every
+ * EVLOG_DRAIN_MS, either as text to stderr or, with a log file, as an
+ * evlog_header followed by evlog_records in host byte order, which buse-log
+ * turns back into text. A thread that outruns the drain loses records
+ * rather than waiting; the loss shows up as an EVLOG_LOST record.
+ */
+
+#define EVLOG_MAGIC "BUSELOG1"
+#define EVLOG_RING 8192          // records per thread, a power of two
+#define EVLOG_DRAIN_MS 10
+
+enum evlog_event {
+    EVLOG_READ,
+    EVLOG_WRITE,
+    EVLOG_FLUSH,
+    EVLOG_DISC,
+    EVLOG_TRIM,
+    EVLOG_LOST,                  // offset records were dropped by this thread
+    EVLOG_EVENTS
+};
+
+struct evlog_header {
+    char magic[8];
+    uint32_t record_size;        // sizeof(struct evlog_record), for later extensions
+    uint32_t reserved;
+    uint64_t start_unix_ns;      // wall clock time of time_ns 0
+};
+
+struct evlog_record {
+    uint64_t time_ns;            // since the log was opened
+    uint64_t offset;
+    uint32_t len;
+    uint16_t event;              // enum evlog_event
+    uint16_t thread;             // in the order threads first logged
+};
+
+/* Start logging, to the file at path (created or truncated), or as text to
+ * stderr if path is NULL. The log is drained one last time at exit.
+ * Returns 0, or -1 on error (reported). */
+int evlog_open(const char *path);
+
+/* Log an event. Does nothing unless the log is open. */
+void evlog(enum evlog_event event, uint64_t offset, uint32_t len);
+
+/* Print r as the text -v has always printed, without a timestamp. */
+void evlog_print(FILE *out, const struct evlog_record *r);
+
+#endif /* EVLOG_H_INCLUDED */
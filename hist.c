@@ -0,0 +1,73 @@
+/*
+ * hist - log-linear latency histograms
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#include <stdbool.h>
+
+#include "hist.h"
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < HIST_SUB) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v); // at least HIST_SUB_BITS
+    if (e > HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value that falls into bucket b. */
+static uint64_t bucket_top(unsigned b) {
+    if (b < 2 * HIST_SUB) {
+        return b;
+    }
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+    return low + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_add(struct hist *h, uint64_t v) {
+    __atomic_fetch_add(&h->bucket[bucket_of(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p) {
+    // count the buckets rather than trusting h->count, which may be a value ahead
+    uint64_t total = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+        total += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * total + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            return bucket_top(b) < max ? bucket_top(b) : max;
+        }
+    }
+    return max;
+}
+
+void hist_print(const struct hist *h, const char *name, FILE *out) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    fprintf(out, " %s_count %lu %s_mean_us %lu %s_p50_us %lu %s_p90_us %lu %s_p99_us %lu %s_p999_us %lu %s_max_us %lu",
+            name, count, name, count ? sum / count : 0,
+            name, hist_percentile(h, 0.50), name, hist_percentile(h, 0.90),
+            name, hist_percentile(h, 0.99), name, hist_percentile(h, 0.999),
+            name, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,42 @@
+#ifndef HIST_H_INCLUDED
+#define HIST_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear latency histograms, HDR style.
+ *
+ * Values below HIST_SUB get a bucket each; above that every power of two is
+ * split into HIST_SUB buckets, so a bucket is never wider than 1/HIST_SUB of
+ * the values in it (about 6% with 16). Values up to 2^HIST_MAX_EXP are kept
+ * apart, anything larger lands in the last bucket. Adding a value is a few
+ * relaxed atomic adds, so any thread can record into a histogram while
+ * another reads it, without a lock. Each histogram here has one main writer
+ * (the request loop, or a member's I/O thread), so the adds are uncontended.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40   // in microseconds, about 12 days
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct hist {
+    uint64_t bucket[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/* Record one value. */
+void hist_add(struct hist *h, uint64_t v);
+
+/* The value at or below which a fraction p (0 to 1) of the recorded values
+ * lie, to the bucket's precision; 0 if the histogram is empty. */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/* Print "NAME_count ... NAME_p99_us ... NAME_max_us ..." pairs on one line,
+ * without the newline, for the stats report. */
+void hist_print(const struct hist *h, const char *name, FILE *out);
+
+#endif /* HIST_H_INCLUDED */
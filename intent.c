@@ -0,0 +1,200 @@
+/*
+ * intent - write-intent bitmap for the RAID backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "intent.h"
+
+#define INTENT_MAGIC "BUSEWIB1"
+
+struct intent_header {
+    char magic[8];
+    uint64_t region_size;
+    uint64_t device_size;
+};
+
+/* Write bitmap bytes [lo, hi] and make them durable. */
+static int intent_persist(struct intent_log *log, uint64_t lo, uint64_t hi) {
+    size_t len = hi - lo + 1;
+    if (pwrite(log->fd, log->bits + lo, len, sizeof(struct intent_header) + lo) != (ssize_t)len)
+        return -1;
+    return fdatasync(log->fd);
+}
+
+int intent_open(struct intent_log *log, const char *path, uint64_t region_size, uint64_t device_size) {
+    struct intent_header hdr;
+    struct stat st;
+
+    memset(log, 0, sizeof(*log));
+    log->region_size = region_size;
+    log->device_size = device_size;
+    log->nregions = (device_size + region_size - 1) / region_size;
+    uint64_t nbytes = (log->nregions + 7) / 8;
+
+    log->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (log->fd < 0 || fstat(log->fd, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    log->bits = calloc(nbytes, 1);
+    log->pending = calloc(log->nregions, sizeof(uint32_t));
+    log->done_seq = calloc(log->nregions, sizeof(uint64_t));
+    if (log->bits == NULL || log->pending == NULL || log->done_seq == NULL) {
+        fprintf(stderr, "%s: out of memory for the intent bitmap\n", path);
+        return -1;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+
+    if (st.st_size == 0) {
+        // new bitmap, everything clean
+        memcpy(hdr.magic, INTENT_MAGIC, sizeof(hdr.magic));
+        hdr.region_size = region_size;
+        hdr.device_size = device_size;
+        if (pwrite(log->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || intent_persist(log, 0, nbytes - 1) != 0) {
+            perror(path);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (pread(log->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, INTENT_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s: not a write-intent bitmap\n", path);
+        return -1;
+    }
+    if (hdr.region_size != region_size || hdr.device_size != device_size) {
+        fprintf(stderr, "%s: bitmap is for a %lu byte array with %lu byte regions, not %lu/%lu\n",
+                path, hdr.device_size, hdr.region_size, device_size, region_size);
+        return -1;
+    }
+    if (pread(log->fd, log->bits, nbytes, sizeof(hdr)) != (ssize_t)nbytes) {
+        fprintf(stderr, "%s: truncated bitmap\n", path);
+        return -1;
+    }
+    for (uint64_t r = 0; r < log->nregions; r++) {
+        if (log->bits[r / 8] & (1 << (r % 8))) {
+            log->dirty++;
+            log->done_seq[r] = UINT64_MAX; // left by an earlier run: stays dirty until resynced
+        }
+    }
+    return 0;
+}
+
+void intent_close(struct intent_log *log) {
+    if (log->fd < 0)
+        return;
+    close(log->fd);
+    free(log->bits);
+    free(log->pending);
+    free(log->done_seq);
+    pthread_mutex_destroy(&log->lock);
+    log->fd = -1;
+}
+
+int intent_mark(struct intent_log *log, uint64_t offset, uint64_t len) {
+    uint64_t first = offset / log->region_size;
+    uint64_t last = (offset + len - 1) / log->region_size;
+    uint64_t lo = UINT64_MAX, hi = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&log->lock);
+    for (uint64_t r = first; r <= last; r++) {
+        log->pending[r]++;
+        if (!(log->bits[r / 8] & (1 << (r % 8)))) {
+            log->bits[r / 8] |= 1 << (r % 8);
+            log->dirty++;
+            if (r / 8 < lo) lo = r / 8;
+            hi = r / 8;
+        }
+    }
+    // persisting under the lock keeps anyone from relying on a bit that isn't on disk yet
+    if (lo != UINT64_MAX)
+        ret = intent_persist(log, lo, hi);
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+void intent_complete(struct intent_log *log, uint64_t offset, uint64_t len, bool ok) {
+    uint64_t first = offset / log->region_size;
+    uint64_t last = (offset + len - 1) / log->region_size;
+
+    pthread_mutex_lock(&log->lock);
+    uint64_t seq = ++log->seq;
+    for (uint64_t r = first; r <= last; r++) {
+        log->pending[r]--;
+        if (!ok)
+            log->done_seq[r] = UINT64_MAX; // stays dirty until resynced
+        else if (log->done_seq[r] != UINT64_MAX)
+            log->done_seq[r] = seq;
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+uint64_t intent_seq(struct intent_log *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t seq = log->seq;
+    pthread_mutex_unlock(&log->lock);
+    return seq;
+}
+
+int intent_clean(struct intent_log *log, uint64_t seq) {
+    bool changed = false;
+    int ret = 0;
+
+    pthread_mutex_lock(&log->lock);
+    for (uint64_t r = 0; r < log->nregions && log->dirty > 0; r++) {
+        if (log->bits[r / 8] == 0) {
+            r |= 7; // skip the whole clean byte
+            continue;
+        }
+        if ((log->bits[r / 8] & (1 << (r % 8))) && log->pending[r] == 0 && log->done_seq[r] <= seq) {
+            log->bits[r / 8] &= ~(1 << (r % 8));
+            log->dirty--;
+            changed = true;
+        }
+    }
+    if (changed)
+        ret = intent_persist(log, 0, (log->nregions + 7) / 8 - 1);
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+int intent_next_dirty(struct intent_log *log, uint64_t pos, uint64_t *offset, uint64_t *len) {
+    int ret = 1;
+
+    pthread_mutex_lock(&log->lock);
+    for (uint64_t r = pos / log->region_size; r < log->nregions; r++) {
+        if (log->bits[r / 8] & (1 << (r % 8))) {
+            *offset = r * log->region_size;
+            *len = log->device_size - *offset < log->region_size ? log->device_size - *offset : log->region_size;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+int intent_clear_all(struct intent_log *log) {
+    pthread_mutex_lock(&log->lock);
+    memset(log->bits, 0, (log->nregions + 7) / 8);
+    memset(log->done_seq, 0, log->nregions * sizeof(uint64_t));
+    log->dirty = 0;
+    int ret = intent_persist(log, 0, (log->nregions + 7) / 8 - 1);
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef INTENT_H_INCLUDED
+#define INTENT_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Write-intent bitmap.
+ *
+ * The array is divided into fixed-size regions, and a region's bit is set on
+ * disk before a write that may not reach every member is issued. Bits are
+ * cleared lazily, once the region has no such writes outstanding and the
+ * lagging members have been synced. After a crash only the regions with
+ * their bit set need to be resynchronized.
+ */
+
+struct intent_log {
+    int fd;
+    uint64_t region_size;
+    uint64_t device_size;
+    uint64_t nregions;
+
+    pthread_mutex_t lock;
+    uint8_t *bits;       // in-memory copy of the on-disk bitmap
+    uint32_t *pending;   // writes outstanding per region
+    uint64_t *done_seq;  // completion sequence number of the last write per region
+    uint64_t seq;        // completions so far
+    uint64_t dirty;      // regions with their bit set
+};
+
+/* Open or create the bitmap file at path. An existing file must have been
+ * created with the same region and device size. Bits it has set are only
+ * cleared by intent_clear_all, never by intent_clean. */
+int intent_open(struct intent_log *log, const char *path, uint64_t region_size, uint64_t device_size);
+void intent_close(struct intent_log *log);
+
+/* Record a write to [offset, offset+len); the bit is durable on return. */
+int intent_mark(struct intent_log *log, uint64_t offset, uint64_t len);
+
+/* The write recorded with intent_mark finished. A failed write keeps its
+ * regions dirty until the next resync. */
+void intent_complete(struct intent_log *log, uint64_t offset, uint64_t len, bool ok);
+
+/* Completion sequence number to pass to intent_clean once every lagging
+ * member has been synced. */
+uint64_t intent_seq(struct intent_log *log);
+
+/* Clear the bits of idle regions whose writes all completed at or before seq. */
+int intent_clean(struct intent_log *log, uint64_t seq);
+
+/* Find the first dirty region at or after pos. Returns 1 if there is none. */
+int intent_next_dirty(struct intent_log *log, uint64_t pos, uint64_t *offset, uint64_t *len);
+
+/* Clear every bit, after a full resync. */
+int intent_clear_all(struct intent_log *log);
+
+#endif /* INTENT_H_INCLUDED */
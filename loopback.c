@@ -21,20 +21,280 @@
 #define _LARGEFILE64_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "stats.h"
 
 static int fd;
 
+/*
+ * Overlay mode (-o DELTA): the device is opened read-only as a base image and
+ * every write goes to a copy-on-write delta file instead. The delta holds a
+ * header, a table with one entry per COW_CLUSTER of the device, and the
+ * clusters that were written, appended in the order they were first written.
+ * An entry is COW_BASE while the cluster is still the base's, COW_ZERO once
+ * it was trimmed, or else the cluster's offset in the delta. The table is
+ * kept in memory, so finding a cluster costs no I/O. Changed table pages are
+ * written back on flush, after the data they point at is synced.
+ */
+#define COW_MAGIC "BUSECOW1"
+#define COW_CLUSTER (64 * 1024)
+#define COW_BASE 0
+#define COW_ZERO 1
+#define COW_TABLE_PAGE 4096
+
+struct cow_header {
+    char magic[8];
+    u_int32_t cluster_size;
+    u_int32_t reserved;
+    u_int64_t size;
+    u_int64_t table_offset;
+    u_int64_t data_offset;
+};
+
+static int delta = -1;
+static u_int64_t *table;
+static u_int64_t nclusters;
+static u_int64_t table_offset, next_free;
+static bool *table_dirty;  // per COW_TABLE_PAGE of the table
+static char *cluster_buf;
+
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loopback <phyical device> <virtual device>\n");
+    fprintf(stderr, "Usage: loopback [-o <delta file>] [-m <merge window usec>] [-s <stats socket>] [-t <trace file> [-x]] <phyical device> <virtual device>\n");
+}
+
+static int pread_full(int f, void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(f, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            memset(buf, 0, len); // past the end of a regular file
+            return 0;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int f, const void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(f, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Read [in, in+len) of cluster c, wherever it currently lives. */
+static int cow_read_cluster(u_int64_t c, void *buf, u_int32_t in, u_int32_t len)
+{
+    if (table[c] == COW_ZERO) {
+        memset(buf, 0, len);
+        return 0;
+    }
+    if (table[c] == COW_BASE) {
+        return pread_full(fd, buf, len, c * COW_CLUSTER + in);
+    }
+    return pread_full(delta, buf, len, table[c] + in);
+}
+
+static void cow_set(u_int64_t c, u_int64_t entry)
+{
+    table[c] = entry;
+    table_dirty[c * sizeof(*table) / COW_TABLE_PAGE] = true;
+}
+
+static int cow_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)(userdata);
+
+    while (len > 0) {
+        u_int32_t in = offset % COW_CLUSTER, n = COW_CLUSTER - in < len ? COW_CLUSTER - in : len;
+        if (cow_read_cluster(offset / COW_CLUSTER, buf, in, n) != 0) {
+            perror("read");
+            return -1;
+        }
+        buf = (char *)buf + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int cow_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    (void)(userdata);
+
+    while (len > 0) {
+        u_int64_t c = offset / COW_CLUSTER;
+        u_int32_t in = offset % COW_CLUSTER, n = COW_CLUSTER - in < len ? COW_CLUSTER - in : len;
+        if (table[c] == COW_BASE || table[c] == COW_ZERO) {
+            // first write to the cluster: copy it up, with the new data merged in
+            if (n < COW_CLUSTER && cow_read_cluster(c, cluster_buf, 0, COW_CLUSTER) != 0) {
+                perror("read");
+                return -1;
+            }
+            memcpy(cluster_buf + in, buf, n);
+            if (pwrite_full(delta, cluster_buf, COW_CLUSTER, next_free) != 0) {
+                perror("write");
+                return -1;
+            }
+            cow_set(c, next_free);
+            next_free += COW_CLUSTER;
+        } else if (pwrite_full(delta, buf, n, table[c] + in) != 0) {
+            perror("write");
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Whole clusters are marked COW_ZERO, which reads as zeros without touching
+ * the base, and their copy in the delta is punched (or just left behind where
+ * the delta can't punch holes). The rest is written as zeros. */
+static int cow_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    static char zeros[COW_CLUSTER];
+
+    while (len > 0) {
+        u_int64_t c = from / COW_CLUSTER;
+        u_int32_t in = from % COW_CLUSTER, n = COW_CLUSTER - in < len ? COW_CLUSTER - in : len;
+        if (n == COW_CLUSTER) {
+            if (table[c] != COW_BASE && table[c] != COW_ZERO &&
+                fallocate(delta, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, table[c], COW_CLUSTER) != 0 && errno != EOPNOTSUPP) {
+                perror("trim");
+                return -1;
+            }
+            cow_set(c, COW_ZERO);
+        } else if (table[c] != COW_ZERO && cow_write(zeros, n, from, userdata) != 0) {
+            return -1;
+        }
+        from += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sync the clusters first, then the table pages that point at them. */
+static int cow_flush(void *userdata)
+{
+    (void)(userdata);
+
+    if (fdatasync(delta) != 0) {
+        perror("flush");
+        return -1;
+    }
+    u_int64_t pages = (nclusters * sizeof(*table) + COW_TABLE_PAGE - 1) / COW_TABLE_PAGE;
+    bool wrote = false;
+    for (u_int64_t p = 0; p < pages; p++) {
+        if (!table_dirty[p]) continue;
+        u_int64_t at = p * COW_TABLE_PAGE;
+        u_int64_t bytes = nclusters * sizeof(*table) - at < COW_TABLE_PAGE ? nclusters * sizeof(*table) - at : COW_TABLE_PAGE;
+        if (pwrite_full(delta, (char *)table + at, bytes, table_offset + at) != 0) {
+            perror("flush");
+            return -1;
+        }
+        table_dirty[p] = false;
+        wrote = true;
+    }
+    if (wrote && fdatasync(delta) != 0) {
+        perror("flush");
+        return -1;
+    }
+    return 0;
+}
+
+static void cow_disc(void *userdata)
+{
+    cow_flush(userdata);
+}
+
+/* Open (or create) the delta file for a base of size bytes and load its table. */
+static int cow_open(const char *path, u_int64_t size)
+{
+    struct cow_header h;
+    struct stat st;
+
+    delta = open(path, O_RDWR|O_CREAT|O_LARGEFILE, 0644);
+    if (delta < 0 || fstat(delta, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    nclusters = (size + COW_CLUSTER - 1) / COW_CLUSTER;
+    table = calloc(nclusters, sizeof(*table));
+    table_dirty = calloc((nclusters * sizeof(*table) + COW_TABLE_PAGE - 1) / COW_TABLE_PAGE, sizeof(*table_dirty));
+    cluster_buf = malloc(COW_CLUSTER);
+    if (table == NULL || table_dirty == NULL || cluster_buf == NULL) {
+        perror("cow");
+        return -1;
+    }
+    table_offset = sizeof(h) < COW_TABLE_PAGE ? COW_TABLE_PAGE : sizeof(h);
+
+    if (st.st_size == 0) {
+        // new delta: every cluster is still the base's
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, COW_MAGIC, sizeof(h.magic));
+        h.cluster_size = COW_CLUSTER;
+        h.size = size;
+        h.table_offset = table_offset;
+        h.data_offset = (table_offset + nclusters * sizeof(*table) + COW_CLUSTER - 1) / COW_CLUSTER * COW_CLUSTER;
+        if (pwrite_full(delta, &h, sizeof(h), 0) != 0 || ftruncate(delta, h.data_offset) != 0 || fdatasync(delta) != 0) {
+            perror(path);
+            return -1;
+        }
+        next_free = h.data_offset;
+        return 0;
+    }
+
+    if (pread_full(delta, &h, sizeof(h), 0) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (memcmp(h.magic, COW_MAGIC, sizeof(h.magic)) != 0 || h.cluster_size != COW_CLUSTER) {
+        fprintf(stderr, "ERROR: %s is not an overlay delta.\n", path);
+        return -1;
+    }
+    if (h.size != size) {
+        fprintf(stderr, "ERROR: %s is an overlay for a %lu byte base, not %lu bytes.\n", path, h.size, size);
+        return -1;
+    }
+    table_offset = h.table_offset;
+    if (pread_full(delta, table, nclusters * sizeof(*table), table_offset) != 0) {
+        perror(path);
+        return -1;
+    }
+    // clusters written after the last flush but never entered in the table are skipped
+    next_free = ((u_int64_t)st.st_size + COW_CLUSTER - 1) / COW_CLUSTER * COW_CLUSTER;
+    if (next_free < h.data_offset) next_free = h.data_offset;
+    u_int64_t used = 0;
+    for (u_int64_t c = 0; c < nclusters; c++) {
+        if (table[c] != COW_BASE) used++;
+    }
+    fprintf(stderr, "Overlay %s: %lu of %lu clusters differ from the base.\n", path, used, nclusters);
+    return 0;
 }
 
 static int loopback_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
@@ -69,9 +329,24 @@ static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void
     return 0;
 }
 
+/* Punch the range out of the device, which deallocates it on a thin or
+ * sparse device and reads back as zeros. Devices that can't do that just
+ * keep the data. */
+static int loopback_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    (void)(userdata);
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, len) != 0 && errno != EOPNOTSUPP) {
+        perror("trim");
+        return -1;
+    }
+    return 0;
+}
+
 static struct buse_operations bop = {
     .read = loopback_read,
-    .write = loopback_write
+    .write = loopback_write,
+    .trim = loopback_trim
 };
 
 int main(int argc, char *argv[])
@@ -79,28 +354,70 @@ int main(int argc, char *argv[])
     struct stat buf;
     int err;
     int64_t size;
+    const char *overlay = NULL, *stats = NULL, *trace = NULL;
+    int opt, trace_hashes = 0;
 
-    if (argc != 3) {
+    while ((opt = getopt(argc, argv, "m:o:s:t:x")) != -1) {
+        if (opt == 'o') {
+            overlay = optarg;
+        } else if (opt == 'm') {
+            buse_merge(atoi(optarg));
+        } else if (opt == 's') {
+            stats = optarg;
+        } else if (opt == 't') {
+            trace = optarg;
+        } else if (opt == 'x') {
+            trace_hashes = 1;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
         usage();
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR|O_LARGEFILE);
+    /* The base of an overlay is never written, so it can be shared by any
+     * number of overlays. */
+    fd = open(argv[optind], (overlay ? O_RDONLY : O_RDWR)|O_LARGEFILE);
     assert(fd != -1);
 
-    /* Let's verify that this file is actually a block device. We could support
-     * regular files, too, but we don't need to right now. */
+    /* Let's verify that this file is actually a block device. An overlay's
+     * base may also be a regular file (a golden image). */
     fstat(fd, &buf);
-    assert(S_ISBLK(buf.st_mode));
+    assert(S_ISBLK(buf.st_mode) || (overlay && S_ISREG(buf.st_mode)));
 
     /* Figure out the size of the underlying block device. */
-    err = ioctl(fd, BLKGETSIZE64, &size);
-    assert(err != -1);
-    (void)err;
+    if (S_ISREG(buf.st_mode)) {
+        size = buf.st_size;
+    } else {
+        err = ioctl(fd, BLKGETSIZE64, &size);
+        assert(err != -1);
+        (void)err;
+    }
     fprintf(stderr, "The size of this device is %ld bytes.\n", size);
     bop.size = size;
 
-    buse_main(argv[2], &bop, NULL);
+    if (overlay) {
+        if (cow_open(overlay, size) != 0) {
+            return -1;
+        }
+        bop.read = cow_read;
+        bop.write = cow_write;
+        bop.trim = cow_trim;
+        bop.flush = cow_flush;
+        bop.disc = cow_disc;
+    }
+
+    if (stats && stats_start(stats, NULL, NULL) != 0) {
+        return -1;
+    }
+    if (trace && buse_trace(trace, trace_hashes) != 0) {
+        return -1;
+    }
+
+    buse_main(argv[optind + 1], &bop, NULL);
 
     return 0;
 }
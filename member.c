@@ -0,0 +1,625 @@
+/*
+ * member - per-member I/O queues for the RAID backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "member.h"
+#include "probes.h"
+#include "sparse.h"
+
+#define LAT_RECOMPUTE 32 // recompute the p99 every this many reads
+#define RETRY_BACKOFF_US 1000 // first retry delay, doubled for each further retry
+#define COPY_CHUNK (1024*1024) // member_copy moves this much at a time through memory
+
+int member_retries = 3;
+int member_max_errors = 10;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Add a read latency sample. Samples may race between the worker and
+ * member_run callers; the p99 is a hint, so that is fine. */
+static void member_record_latency(struct member *m, uint32_t us) {
+    unsigned n = __atomic_fetch_add(&m->lat_count, 1, __ATOMIC_RELAXED) + 1;
+    m->lat[n % MEMBER_LAT_SAMPLES] = us;
+    if (n % LAT_RECOMPUTE == 0) {
+        uint32_t sorted[MEMBER_LAT_SAMPLES];
+        unsigned k = n < MEMBER_LAT_SAMPLES ? n : MEMBER_LAT_SAMPLES;
+        memcpy(sorted, m->lat, k * sizeof(uint32_t));
+        qsort(sorted, k, sizeof(uint32_t), cmp_u32);
+        __atomic_store_n(&m->lat_p99, sorted[k * 99 / 100], __ATOMIC_RELAXED);
+    }
+}
+
+/* Errors that may go away if the I/O is simply tried again. */
+static bool transient(int e) {
+    return e == EIO || e == EAGAIN || e == EBUSY || e == ETIMEDOUT || e == ENOMEM;
+}
+
+/* Errors that mean the device itself is gone. */
+static bool permanent(int e) {
+    return e == ENODEV || e == ENXIO || e == EBADF;
+}
+
+void member_fail(struct member *m) {
+    if (__atomic_exchange_n(&m->failed, true, __ATOMIC_ACQ_REL))
+        return; // someone else got here first
+    fprintf(stderr, "DEGRADED: Device %s failed (%d errors), no longer using it.\n", m->path, m->errors);
+    if (m->on_fail)
+        m->on_fail(m);
+}
+
+/* An I/O failed for good: count it, and fail the member if it can no longer
+ * be trusted. */
+static void member_error(struct member *m, struct member_io *io) {
+    int errors = __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    if (io->error == EBADMSG)
+        fprintf(stderr, "Checksum mismatch on device %s at offset %lu\n", m->path, io->offset);
+    else
+        fprintf(stderr, "I/O error on device %s at offset %lu: %s\n", m->path, io->offset, strerror(io->error));
+    if (io->op != MEMBER_READ || permanent(io->error) || errors >= member_max_errors)
+        member_fail(m);
+}
+
+/* Move len bytes between buf and fd, retrying short reads/writes, EINTR and
+ * transient errors. Returns 0 or an errno value. */
+static int member_transfer(int fd, enum member_op op, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    int attempt = 0;
+
+    while (done < len) {
+        ssize_t r;
+        if (op == MEMBER_READ)
+            r = pread(fd, (char *)buf + done, len - done, offset + done);
+        else
+            r = pwrite(fd, (char *)buf + done, len - done, offset + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && transient(errno) && attempt < member_retries) {
+            usleep(RETRY_BACKOFF_US << attempt);
+            attempt++;
+            continue;
+        }
+        if (r <= 0)
+            return r < 0 ? errno : EIO; // EOF in the middle of a member counts as an I/O error
+        done += r;
+    }
+    return 0;
+}
+
+/* Transfer io on a member with a checksum table: reads are verified, writes
+ * record the new CRCs once the data is written. The table works on whole
+ * blocks, so an unaligned I/O is widened to block boundaries through a bounce
+ * buffer. The blocks are locked meanwhile, so a reader never sees data and
+ * CRCs that don't go together, and two partial writes to one block don't
+ * undo each other. Returns 0 or an errno value, EBADMSG for a checksum
+ * mismatch. */
+static int member_transfer_csum(struct member *m, int fd, struct member_io *io) {
+    struct csum_table *t = m->csum;
+    uint64_t lo = io->offset / t->block_size * t->block_size;
+    uint64_t hi = (io->offset + io->len + t->block_size - 1) / t->block_size * t->block_size;
+    bool aligned = lo == io->offset && hi == io->offset + io->len;
+    char *bounce = aligned ? io->buf : malloc(hi - lo);
+    bool corrupt = false; // a partially written block already failed its checksum
+    int err = 0;
+
+    if (bounce == NULL)
+        return ENOMEM;
+    csum_lock(t, lo, hi - lo, io->op == MEMBER_WRITE);
+    if (io->op == MEMBER_READ || !aligned) {
+        err = member_transfer(fd, MEMBER_READ, bounce, hi - lo, lo);
+        int v = err ? 0 : csum_verify(t, bounce, lo, hi - lo);
+        if (v < 0)
+            err = EIO;
+        else if (v > 0 && io->op == MEMBER_READ)
+            err = EBADMSG;
+        else if (v > 0)
+            corrupt = true;
+        if (!err && io->op == MEMBER_READ && !aligned)
+            memcpy(io->buf, bounce + (io->offset - lo), io->len);
+    }
+    if (!err && io->op == MEMBER_WRITE) {
+        if (!aligned)
+            memcpy(bounce + (io->offset - lo), io->buf, io->len);
+        if (corrupt) {
+            // don't vouch for the bytes around the write that we know are bad
+            fprintf(stderr, "Checksum mismatch on device %s next to a partial write at offset %lu, leaving the block unverified\n", m->path, io->offset);
+            err = csum_forget(t, lo, hi - lo) != 0 ? EIO : member_transfer(fd, MEMBER_WRITE, bounce, hi - lo, lo);
+        } else {
+            err = member_transfer(fd, MEMBER_WRITE, bounce, hi - lo, lo);
+            if (!err && csum_update(t, bounce, lo, hi - lo) != 0)
+                err = EIO;
+        }
+    }
+    csum_unlock(t, lo, hi - lo);
+    if (!aligned)
+        free(bounce);
+    return err;
+}
+
+/* Punch io's range out of fd. With a checksum table, blocks that are only
+ * partly in the range are written with zeros instead, so their CRCs still
+ * match. Returns 0 or an errno value. */
+static int member_punch_io(struct member *m, int fd, struct member_io *io) {
+    uint64_t lo = io->offset, hi = io->offset + io->len;
+    uint64_t a = lo, b = hi; // the part that is punched
+    int err = 0;
+
+    if (m->csum) {
+        uint64_t bs = m->csum->block_size;
+        a = (lo + bs - 1) / bs * bs;
+        b = hi / bs * bs;
+        if (a >= b)
+            a = b = hi;
+        size_t edge = a - lo > hi - b ? a - lo : hi - b;
+        char *zeros = edge > 0 ? calloc(1, edge) : NULL;
+        if (edge > 0 && zeros == NULL)
+            return ENOMEM;
+        struct member_io head = { .op = MEMBER_WRITE, .buf = zeros, .len = a - lo, .offset = lo };
+        struct member_io tail = { .op = MEMBER_WRITE, .buf = zeros, .len = hi - b, .offset = b };
+        if (head.len > 0)
+            err = member_transfer_csum(m, fd, &head);
+        if (!err && tail.len > 0 && b > a)
+            err = member_transfer_csum(m, fd, &tail);
+        free(zeros);
+        if (err)
+            return err;
+    }
+    if (b > a && m->csum)
+        csum_lock(m->csum, a, b - a, true);
+    errno = 0;
+    if (b > a && (sparse_punch(fd, a, b - a) != 0 || (m->csum && csum_forget(m->csum, a, b - a) != 0)))
+        err = errno ? errno : EIO;
+    if (b > a && m->csum)
+        csum_unlock(m->csum, a, b - a);
+    return err;
+}
+
+/* Perform the whole transfer, retrying short reads/writes, EINTR and
+ * transient errors. */
+static void member_execute_io(struct member *m, struct member_io *io);
+
+/* Run io on m, for the worker or a synchronous caller. */
+static void member_execute(struct member *m, struct member_io *io) {
+    member_execute_io(m, io);
+    PROBE6(member_done, m->index, io, io->op, io->offset, io->len, io->result);
+}
+
+/* Whether io is a read that can be copied straight from m's mapping. */
+static bool member_mapped(struct member *m, struct member_io *io) {
+    return io->op == MEMBER_READ && m->map != NULL && io->offset + io->len <= m->map_len;
+}
+
+static void member_execute_io(struct member *m, struct member_io *io) {
+    int fd = m->fd; // stays the same even if the member is replaced meanwhile
+
+    io->error = 0;
+    if (io->op == MEMBER_FSYNC) {
+        if (m->csum) {
+            io->result = csum_flush(m->csum); // writes back the table and syncs the data with it
+        } else {
+            while ((io->result = fsync(fd)) < 0 && errno == EINTR)
+                ;
+        }
+        if (io->result < 0) {
+            io->error = errno;
+            member_error(m, io);
+        }
+        return;
+    }
+
+    if (io->op == MEMBER_PUNCH) {
+        int err = member_punch_io(m, fd, io);
+        if (err) {
+            io->error = err;
+            io->result = -1;
+            member_error(m, io);
+            return;
+        }
+        io->result = io->len;
+        return;
+    }
+
+    uint64_t start = now_us();
+    if (member_mapped(m, io)) {
+        memcpy(io->buf, m->map + io->offset, io->len);
+    } else {
+        int err = m->csum ? member_transfer_csum(m, fd, io) : member_transfer(fd, io->op, io->buf, io->len, io->offset);
+        if (err) {
+            io->error = err;
+            io->result = -1;
+            member_error(m, io);
+            return;
+        }
+    }
+    io->result = io->len;
+    __atomic_store_n(&m->head_pos, io->offset + io->len, __ATOMIC_RELAXED);
+    uint64_t us = now_us() - start;
+    __atomic_fetch_add(&m->qos_bytes[io->qos], io->len, __ATOMIC_RELAXED);
+    if (io->op == MEMBER_READ) {
+        if (io->qos == MEMBER_QOS_CLIENT)
+            member_record_latency(m, us);
+        hist_add(&m->read_hist, us);
+        __atomic_fetch_add(&m->read_bytes, io->len, __ATOMIC_RELAXED);
+    } else {
+        hist_add(&m->write_hist, us);
+        __atomic_fetch_add(&m->write_bytes, io->len, __ATOMIC_RELAXED);
+    }
+}
+
+static void member_complete(struct member_io *io) {
+    struct member_batch *batch = io->batch;
+    member_done_fn done = io->done; // the waiter may reuse io as soon as the batch completes
+
+    if (batch) {
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0)
+            pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    if (done)
+        done(io);
+}
+
+/* The next I/O to run, by class (see member.h), or -1 if none is queued.
+ * Called with m->lock held. */
+static int member_pick(struct member *m) {
+    int background = -1;
+    for (int c = MEMBER_QOS_CLASSES - 1; c > MEMBER_QOS_CLIENT; c--) {
+        if (m->head[c] != NULL)
+            background = c;
+    }
+    if (m->head[MEMBER_QOS_CLIENT] == NULL || background == -1) {
+        m->client_run = 0;
+        return m->head[MEMBER_QOS_CLIENT] ? MEMBER_QOS_CLIENT : background;
+    }
+    if (++m->client_run > MEMBER_QOS_BURST) {
+        m->client_run = 0;
+        return background;
+    }
+    return MEMBER_QOS_CLIENT;
+}
+
+static void *member_worker(void *arg) {
+    struct member *m = arg;
+
+    pthread_mutex_lock(&m->lock);
+    for (;;) {
+        int c;
+        while ((c = member_pick(m)) == -1 && m->running)
+            pthread_cond_wait(&m->cond, &m->lock);
+        if (c == -1)
+            break; // stopped and drained
+
+        struct member_io *io = m->head[c];
+        m->head[c] = io->next;
+        if (m->head[c] == NULL)
+            m->tail[c] = NULL;
+        pthread_mutex_unlock(&m->lock);
+
+        member_execute(m, io);
+        __atomic_fetch_sub(&m->inflight, 1, __ATOMIC_RELAXED);
+        member_complete(io);
+
+        pthread_mutex_lock(&m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+/* Reset per-device state and start the worker for fd. */
+static int member_attach(struct member *m, int fd, const char *path, uint64_t rebuilt) {
+    pthread_mutex_lock(&m->lock);
+    m->fd = fd;
+    m->path = path;
+    m->map = NULL; // a replaced device's mapping stays, other threads may still be copying from it
+    m->errors = 0;
+    m->inflight = 0;
+    m->head_pos = 0;
+    m->lat_count = 0;
+    m->lat_p99 = 0;
+    member_set_rebuilt(m, rebuilt);
+    __atomic_store_n(&m->failed, fd < 0, __ATOMIC_RELEASE);
+    if (fd < 0) {
+        pthread_mutex_unlock(&m->lock);
+        return 0; // missing member, nothing to run
+    }
+
+    m->running = true;
+    int r = pthread_create(&m->thread, NULL, member_worker, m);
+    if (r != 0) {
+        m->running = false;
+        fprintf(stderr, "%s: can't start I/O thread: %s\n", path, strerror(r));
+    }
+    pthread_mutex_unlock(&m->lock);
+    return r == 0 ? 0 : -1;
+}
+
+int member_start(struct member *m, int fd, const char *path) {
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    memset(m->head, 0, sizeof(m->head));
+    memset(m->tail, 0, sizeof(m->tail));
+    m->client_run = 0;
+    m->running = false;
+    return member_attach(m, fd, path, UINT64_MAX);
+}
+
+void member_stop(struct member *m) {
+    pthread_mutex_lock(&m->lock);
+    if (!m->running) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+    m->running = false;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+}
+
+int member_replace(struct member *m, int fd, const char *path, struct csum_table *csum) {
+    member_stop(m); // drains whatever was still queued to the old device, against its own table
+    m->csum = csum;
+    return member_attach(m, fd, path, 0);
+}
+
+int member_map(struct member *m, bool populate) {
+    if (m->csum != NULL)
+        return 0;
+    off_t size = lseek(m->fd, 0, SEEK_END);
+    if (size <= 0)
+        return -1;
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), m->fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    m->map_len = size;
+    m->map = p;
+    return 0;
+}
+
+int member_punch(struct member *m, uint64_t offset, uint64_t len) {
+    int ret;
+
+    if (m->csum == NULL)
+        return sparse_punch(m->fd, offset, len);
+    csum_lock(m->csum, offset, len, true);
+    ret = sparse_punch(m->fd, offset, len) != 0 ? -1 : csum_forget(m->csum, offset, len);
+    csum_unlock(m->csum, offset, len);
+    return ret;
+}
+
+int member_copy(struct member *src, struct member *dst, uint64_t offset, uint64_t len) {
+    if (src->csum == NULL && dst->csum == NULL)
+        return sparse_copy(src->fd, dst->fd, offset, len);
+
+    char *buf = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+    if (buf == NULL)
+        return -1;
+    for (uint64_t pos = offset; pos < offset + len; pos += COPY_CHUNK) {
+        uint64_t n = offset + len - pos < COPY_CHUNK ? offset + len - pos : COPY_CHUNK;
+        struct member_io rd = { .op = MEMBER_READ, .buf = buf, .len = n, .offset = pos };
+        struct member_io wr = { .op = MEMBER_WRITE, .buf = buf, .len = n, .offset = pos };
+        if (member_run(src, &rd) < 0 || member_run(dst, &wr) < 0) {
+            errno = rd.result < 0 ? rd.error : wr.error;
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+void member_submit(struct member *m, struct member_io *io, struct member_batch *batch) {
+    io->batch = batch;
+    io->next = NULL;
+    PROBE5(member_submit, m->index, io, io->op, io->offset, io->len);
+
+    if (batch) {
+        pthread_mutex_lock(&batch->lock);
+        batch->pending++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (!m->running) {
+        // missing or being replaced
+        pthread_mutex_unlock(&m->lock);
+        io->result = -1;
+        io->error = ENODEV;
+        member_complete(io);
+        return;
+    }
+    if (member_inflight(m) == 0 && member_mapped(m, io)) {
+        // nothing queued ahead of it to wait for: copy it here
+        pthread_mutex_unlock(&m->lock);
+        member_execute(m, io);
+        member_complete(io);
+        return;
+    }
+    __atomic_fetch_add(&m->inflight, 1, __ATOMIC_RELAXED);
+    if (m->tail[io->qos])
+        m->tail[io->qos]->next = io;
+    else
+        m->head[io->qos] = io;
+    m->tail[io->qos] = io;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+ssize_t member_run(struct member *m, struct member_io *io) {
+    PROBE5(member_submit, m->index, io, io->op, io->offset, io->len);
+    __atomic_fetch_add(&m->inflight, 1, __ATOMIC_RELAXED);
+    member_execute(m, io);
+    __atomic_fetch_sub(&m->inflight, 1, __ATOMIC_RELAXED);
+    return io->result;
+}
+
+void member_batch_init(struct member_batch *batch) {
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    batch->pending = 0;
+}
+
+void member_batch_wait(struct member_batch *batch) {
+    pthread_mutex_lock(&batch->lock);
+    while (batch->pending > 0)
+        pthread_cond_wait(&batch->cond, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void member_batch_destroy(struct member_batch *batch) {
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->cond);
+}
+
+struct hedge_io {
+    struct member_io io;
+    struct member_hedge *hedge;
+    int leg;
+    struct hedge_io *next; // all I/Os of the hedge, freed together
+};
+
+struct member_hedge {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs; // the caller plus every I/O still queued
+    int submitted[2];
+    int pending[2];
+    bool failed[2];
+    struct hedge_io *ios;
+};
+
+static void hedge_free(struct member_hedge *h) {
+    while (h->ios) {
+        struct hedge_io *hio = h->ios;
+        h->ios = hio->next;
+        free(hio);
+    }
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->cond);
+    free(h);
+}
+
+static void hedge_done(struct member_io *io) {
+    struct hedge_io *hio = io->priv;
+    struct member_hedge *h = hio->hedge;
+
+    pthread_mutex_lock(&h->lock);
+    h->pending[hio->leg]--;
+    if (io->result < 0)
+        h->failed[hio->leg] = true;
+    pthread_cond_broadcast(&h->cond);
+    bool last = --h->refs == 0;
+    pthread_mutex_unlock(&h->lock);
+    if (last)
+        hedge_free(h);
+}
+
+struct member_hedge *member_hedge_new(void) {
+    struct member_hedge *h = calloc(1, sizeof(*h));
+    pthread_condattr_t attr;
+
+    if (h == NULL)
+        return NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&h->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    h->refs = 1;
+    return h;
+}
+
+void *member_hedge_submit(struct member_hedge *h, int leg, struct member *m, enum member_op op, size_t len, uint64_t offset) {
+    struct hedge_io *hio = malloc(sizeof(*hio) + len);
+    if (hio == NULL) {
+        // the leg is missing a part, so it must never win
+        pthread_mutex_lock(&h->lock);
+        h->submitted[leg]++;
+        h->failed[leg] = true;
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+    hio->io = (struct member_io){ .op = op, .buf = hio + 1, .len = len, .offset = offset, .done = hedge_done, .priv = hio };
+    hio->hedge = h;
+    hio->leg = leg;
+
+    pthread_mutex_lock(&h->lock);
+    h->refs++;
+    h->submitted[leg]++;
+    h->pending[leg]++;
+    hio->next = h->ios;
+    h->ios = hio;
+    pthread_mutex_unlock(&h->lock);
+
+    member_submit(m, &hio->io, NULL);
+    return hio->io.buf;
+}
+
+int member_hedge_wait(struct member_hedge *h, int64_t timeout_us) {
+    struct timespec deadline;
+    int ret = MEMBER_HEDGE_TIMEOUT;
+
+    if (timeout_us >= 0) {
+        uint64_t t = now_us() + timeout_us;
+        deadline.tv_sec = t / 1000000;
+        deadline.tv_nsec = (t % 1000000) * 1000;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    for (;;) {
+        bool all_failed = true;
+        for (int leg = 0; leg < 2; leg++) {
+            if (!h->submitted[leg])
+                continue;
+            if (h->pending[leg] == 0 && !h->failed[leg]) {
+                ret = leg;
+                goto out;
+            }
+            if (h->pending[leg] > 0 || !h->failed[leg])
+                all_failed = false;
+        }
+        if (all_failed) {
+            ret = MEMBER_HEDGE_FAILED;
+            break;
+        }
+        if (timeout_us < 0)
+            pthread_cond_wait(&h->cond, &h->lock);
+        else if (pthread_cond_timedwait(&h->cond, &h->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+out:
+    pthread_mutex_unlock(&h->lock);
+    return ret;
+}
+
+void member_hedge_put(struct member_hedge *h) {
+    pthread_mutex_lock(&h->lock);
+    bool last = --h->refs == 0;
+    pthread_mutex_unlock(&h->lock);
+    if (last)
+        hedge_free(h);
+}
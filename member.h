@@ -0,0 +1,215 @@
+#ifndef MEMBER_H_INCLUDED
+#define MEMBER_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "csum.h"
+#include "hist.h"
+
+/*
+ * Per-member I/O queues for the RAID backends.
+ *
+ * Every member device gets a worker thread that executes the I/Os queued to
+ * it in FIFO order, so a request that touches several members can have all
+ * of its member I/Os in flight at once. Callers group the I/Os of one request
+ * in a member_batch and wait for the whole batch to complete.
+ *
+ * Each I/O has a QoS class. There is one FIFO per class, and the worker
+ * takes client I/O first, then rebuild, then scrub. After MEMBER_QOS_BURST
+ * client I/Os in a row, one waiting background I/O goes next, so it can't
+ * starve (the background threads hold array locks that client writes wait
+ * on). How much background work gets queued is paced by qos_wait().
+ */
+
+enum member_op {
+    MEMBER_READ,
+    MEMBER_WRITE,
+    MEMBER_FSYNC,
+    MEMBER_PUNCH, // deallocate the range (see member_punch), in order with the writes around it
+};
+
+enum member_qos {
+    MEMBER_QOS_CLIENT,  // serving a request; the default
+    MEMBER_QOS_REBUILD,
+    MEMBER_QOS_SCRUB,
+    MEMBER_QOS_CLASSES
+};
+
+#define MEMBER_QOS_BURST 8
+
+struct member_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending; // I/Os submitted but not yet completed
+};
+
+struct member_io;
+typedef void (*member_done_fn)(struct member_io *io);
+
+struct member_io {
+    enum member_op op;
+    void *buf;
+    size_t len;
+    uint64_t offset;
+    enum member_qos qos;
+
+    ssize_t result; // bytes transferred (always len on success), or -1
+    int error;      // errno when result is -1
+
+    struct member_batch *batch; // completion group, or NULL
+    member_done_fn done;        // called from the worker thread after batch accounting, may be NULL
+    void *priv;                 // for the done callback
+    struct member_io *next;
+};
+
+#define MEMBER_LAT_SAMPLES 256 // recent read latencies kept per member
+
+struct member;
+typedef void (*member_fail_fn)(struct member *m);
+
+/* Error handling knobs shared by all members: transient errors (EIO, EAGAIN,
+ * ...) are retried member_retries times with exponential backoff, and a
+ * member whose reads failed member_max_errors times is marked failed. A
+ * failed write or flush fails the member right away, since it no longer
+ * holds what the array thinks it does. */
+extern int member_retries;
+extern int member_max_errors;
+
+struct member {
+    int fd;            // -1 if the member is missing
+    const char *path;
+    int index;         // position on the command line, set by the backend; for probes
+    bool write_mostly; // never chosen for reads while another member can serve them
+    struct csum_table *csum; // per-block checksums verified on every read, NULL if disabled
+    const char *map;   // read-only shared mapping of the device (see member_map), or NULL
+    uint64_t map_len;
+
+    bool failed;       // set once by member_fail(), read with member_ok()
+    int errors;        // I/Os that failed even after retrying
+    uint64_t rebuilt;  // bytes [0, rebuilt) hold valid data; UINT64_MAX unless a rebuild is in progress
+    member_fail_fn on_fail; // called once when the member fails, from whichever thread noticed
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct member_io *head[MEMBER_QOS_CLASSES], *tail[MEMBER_QOS_CLASSES]; // pending I/Os, per class
+    int client_run;    // client I/Os taken in a row while background I/O waited
+    bool running;
+
+    int inflight;      // I/Os queued or executing, read with member_inflight()
+    uint64_t head_pos; // end offset of the last completed I/O, read with member_head()
+
+    uint32_t lat[MEMBER_LAT_SAMPLES]; // ring of recent client read latencies in microseconds
+    unsigned lat_count;
+    uint32_t lat_p99;  // p99 of the ring, read with member_p99()
+
+    // for the stats report: completed reads and writes since start, whatever the device
+    struct hist read_hist, write_hist; // latencies in microseconds
+    uint64_t read_bytes, write_bytes;
+    uint64_t qos_bytes[MEMBER_QOS_CLASSES]; // bytes read and written, per class
+};
+
+/*
+ * Hedged I/O: up to two "legs" (sets of member I/Os) race each other, and the
+ * caller takes whichever leg completes first. The I/Os and their buffers are
+ * owned by the hedge, so the losing leg can keep running after the caller has
+ * moved on; everything is freed once the caller and every I/O are done.
+ */
+struct member_hedge;
+#define MEMBER_HEDGE_TIMEOUT (-1) // member_hedge_wait: no leg completed in time
+#define MEMBER_HEDGE_FAILED  (-2) // member_hedge_wait: every submitted leg failed
+
+/* Attach fd to m and start its worker thread. A member with fd -1 is
+ * missing: it counts as failed and is left idle. */
+int member_start(struct member *m, int fd, const char *path);
+
+/* Drain the queue and stop the worker thread. I/Os submitted to a stopped
+ * member fail with ENODEV. */
+void member_stop(struct member *m);
+
+/* Swap a (failed) member for a new device, e.g. a hot spare, with checksum
+ * table csum (NULL without --integrity). The new device starts out with
+ * rebuilt = 0 and the caller is expected to rebuild it. The old fd is left
+ * open since other threads may still be using it. */
+int member_replace(struct member *m, int fd, const char *path, struct csum_table *csum);
+
+/* Map m read-only and serve its reads by copying from the mapping; with
+ * populate the whole device is faulted in now. Reads that find the queue
+ * empty are then done in the submitting thread, without a system call.
+ * Writes still go through write(), which the page cache keeps coherent with
+ * the mapping. Not used with checksums, which are verified by the read path.
+ * An I/O error on a mapped device is a SIGBUS rather than a read error, so
+ * this is for files on storage that is already trusted. */
+int member_map(struct member *m, bool populate);
+
+/* Punch a hole in (or zero) [offset, offset+len) of m, keeping its checksums in step. */
+int member_punch(struct member *m, uint64_t offset, uint64_t len);
+
+/* Copy [offset, offset+len) from src to the same offset in dst, in-kernel
+ * where possible. With checksums the data goes through memory instead, so it
+ * is verified on the way out and checksummed on the way in. */
+int member_copy(struct member *src, struct member *dst, uint64_t offset, uint64_t len);
+
+/* Mark m failed and call its on_fail hook, if it wasn't failed already. */
+void member_fail(struct member *m);
+
+static inline bool member_ok(struct member *m) {
+    return m->fd != -1 && !__atomic_load_n(&m->failed, __ATOMIC_ACQUIRE);
+}
+
+/* Whether m holds valid data for [offset, offset+len): not failed, and not
+ * still to be reached by a rebuild. */
+static inline bool member_in_sync(struct member *m, uint64_t offset, uint64_t len) {
+    return member_ok(m) && offset + len <= __atomic_load_n(&m->rebuilt, __ATOMIC_ACQUIRE);
+}
+
+static inline void member_set_rebuilt(struct member *m, uint64_t rebuilt) {
+    __atomic_store_n(&m->rebuilt, rebuilt, __ATOMIC_RELEASE);
+}
+
+/* Queue io to m; completion is reported through batch (if not NULL) and
+ * then io->done (if set). An io with a done callback may be freed by it. */
+void member_submit(struct member *m, struct member_io *io, struct member_batch *batch);
+
+/* Execute io synchronously in the calling thread. Returns io->result. */
+ssize_t member_run(struct member *m, struct member_io *io);
+
+/* Queue depth and last head position, for load-aware scheduling. Both are
+ * updated by the worker thread, so the values are only hints. */
+static inline int member_inflight(struct member *m) {
+    return __atomic_load_n(&m->inflight, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t member_head(struct member *m) {
+    return __atomic_load_n(&m->head_pos, __ATOMIC_RELAXED);
+}
+
+/* Recent p99 latency of client reads in microseconds, 0 until enough reads
+ * were seen. Background reads are left out, so this is what clients see. */
+static inline uint32_t member_p99(struct member *m) {
+    return __atomic_load_n(&m->lat_p99, __ATOMIC_RELAXED);
+}
+
+struct member_hedge *member_hedge_new(void);
+
+/* Queue an I/O of len bytes at offset to m as part of leg (0 or 1). Returns
+ * the hedge-owned buffer, which the caller fills before a write or reads
+ * after member_hedge_wait reported this leg, or NULL if it can't be
+ * allocated; the leg then counts as failed. */
+void *member_hedge_submit(struct member_hedge *h, int leg, struct member *m, enum member_op op, size_t len, uint64_t offset);
+
+/* Wait up to timeout_us (forever if negative) for a leg whose I/Os all
+ * succeeded. Returns the leg, MEMBER_HEDGE_TIMEOUT or MEMBER_HEDGE_FAILED. */
+int member_hedge_wait(struct member_hedge *h, int64_t timeout_us);
+
+/* Drop the caller's reference; buffers must not be used afterwards. */
+void member_hedge_put(struct member_hedge *h);
+
+void member_batch_init(struct member_batch *batch);
+void member_batch_wait(struct member_batch *batch);
+void member_batch_destroy(struct member_batch *batch);
+
+#endif /* MEMBER_H_INCLUDED */
@@ -0,0 +1,46 @@
+#ifndef PROBES_H_INCLUDED
+#define PROBES_H_INCLUDED
+
+/*
+ * USDT (user-level statically defined tracing) probes, provider "buse", for
+ * bpftrace, perf and systemtap on unmodified binaries:
+ *
+ *     bpftrace -e 'usdt:./raid4:buse:member_submit { @t[arg1] = nsecs; }
+ *                  usdt:./raid4:buse:member_done /@t[arg1]/ { @us[arg0] = hist((nsecs - @t[arg1]) / 1000); delete(@t[arg1]); }'
+ *
+ * A probe site is a single nop until a tracer attaches to it, so the probes
+ * are compiled in whenever <sys/sdt.h> (systemtap-sdt-dev) is available.
+ * Without the header, or with -DBUSE_NO_PROBES, they compile to nothing.
+ *
+ *   request(handle, type, offset, len)             serve_nbd received a request (type: NBD_CMD_* and flags)
+ *   reply(handle, op, error, latency_us)           ...and sent its reply (op: enum buse_op)
+ *   member_submit(member, io, op, offset, len)     an I/O was queued to a member (op: enum member_op)
+ *   member_done(member, io, op, offset, len, result)  ...and completed; io pairs the two
+ *   parity_start(member, offset, len)              parity for data on member is being computed
+ *   parity_done(member, offset, len)
+ *   reconstruct(member, offset, len)               a read of failed member is served from parity
+ *   rebuild(member, pos, total)                    a rebuild of member got to pos bytes of total
+ *
+ * member is the device's index on the command line, -1 where not known.
+ */
+
+#if !defined(BUSE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BUSE_PROBES 1
+#endif
+#endif
+
+#ifdef BUSE_PROBES
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(buse, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(buse, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(buse, name, a, b, c, d, e)
+#define PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(buse, name, a, b, c, d, e, f)
+#else
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define PROBE5(name, a, b, c, d, e) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#define PROBE6(name, a, b, c, d, e, f) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); (void)(f); } while (0)
+#endif
+
+#endif /* PROBES_H_INCLUDED */
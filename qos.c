@@ -0,0 +1,116 @@
+/*
+ * qos - adaptive pacing of background I/O
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <unistd.h>
+
+#include "qos.h"
+
+struct bucket {
+    uint64_t cap;          // bytes per second at most, 0 = unlimited
+    uint64_t rate;         // current rate, 0 = unlimited; read by qos_report()
+    int64_t tokens;        // bytes that may go now; negative while in debt
+    uint64_t refilled_us;
+    uint64_t adjusted_us;  // last rate adjustment, 0 before the first window
+    uint64_t done;         // bytes since then
+    uint64_t fg_seen;      // qos_foreground then
+};
+
+static const char *class_names[MEMBER_QOS_CLASSES] = { "client", "rebuild", "scrub" };
+
+uint32_t qos_target_us = 0;
+uint64_t qos_foreground = 0;
+
+static struct bucket buckets[MEMBER_QOS_CLASSES];
+static struct member *members;
+static const int *nmembers;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void qos_members(struct member *devs, const int *ndevs) {
+    members = devs;
+    nmembers = ndevs;
+}
+
+void qos_set_cap(enum member_qos c, uint32_t rate_mbps) {
+    buckets[c].cap = (uint64_t)rate_mbps * 1000000;
+    __atomic_store_n(&buckets[c].rate, buckets[c].cap, __ATOMIC_RELAXED);
+}
+
+/* The worst recent client read p99 of the members still in use. */
+static uint32_t worst_p99(void) {
+    uint32_t worst = 0;
+    int n = members ? *nmembers : 0;
+    for (int i = 0; i < n; i++) {
+        if (member_ok(&members[i]) && member_p99(&members[i]) > worst)
+            worst = member_p99(&members[i]);
+    }
+    return worst;
+}
+
+static void adjust(struct bucket *b, uint64_t now) {
+    uint64_t fg = __atomic_load_n(&qos_foreground, __ATOMIC_RELAXED);
+    uint64_t rate = b->rate;
+    if (fg == b->fg_seen) {
+        rate = b->cap; // idle
+    } else if (qos_target_us == 0 || worst_p99() > qos_target_us) {
+        // clients suffer: back off, starting from what we actually did if unlimited
+        uint64_t measured = b->done * 1000000 / (now - b->adjusted_us);
+        rate = (rate == 0 ? measured : rate) / 2;
+        if (rate < QOS_MIN_RATE)
+            rate = QOS_MIN_RATE;
+    } else if (rate != 0) {
+        rate += QOS_STEP;
+        if (b->cap != 0 && rate > b->cap)
+            rate = b->cap;
+    }
+    __atomic_store_n(&b->rate, rate, __ATOMIC_RELAXED);
+    b->fg_seen = fg;
+    b->done = 0;
+    b->adjusted_us = now;
+}
+
+void qos_wait(enum member_qos c, uint64_t bytes) {
+    struct bucket *b = &buckets[c];
+    uint64_t now = now_us();
+    if (b->adjusted_us == 0) {
+        b->adjusted_us = b->refilled_us = now;
+        b->fg_seen = __atomic_load_n(&qos_foreground, __ATOMIC_RELAXED);
+    }
+    b->done += bytes;
+    if (now - b->adjusted_us >= QOS_ADJUST_US)
+        adjust(b, now);
+
+    if (b->rate == 0) {
+        b->tokens = 0;
+        b->refilled_us = now;
+        return;
+    }
+    int64_t burst = b->rate * QOS_BURST_US / 1000000;
+    b->tokens += (now - b->refilled_us) * b->rate / 1000000;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    b->refilled_us = now;
+    b->tokens -= bytes;
+    if (b->tokens < 0)
+        usleep(-b->tokens * 1000000 / b->rate); // the next call refills what the sleep paid for
+}
+
+void qos_report(FILE *out) {
+    for (int c = MEMBER_QOS_CLIENT + 1; c < MEMBER_QOS_CLASSES; c++) {
+        fprintf(out, "qos %s rate_bps %lu cap_bps %lu target_us %u\n", class_names[c],
+                __atomic_load_n(&buckets[c].rate, __ATOMIC_RELAXED), buckets[c].cap, qos_target_us);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef QOS_H_INCLUDED
+#define QOS_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "member.h"
+
+/*
+ * Pacing for background work (rebuild, scrub) against client I/O.
+ *
+ * Background loops call qos_wait() after each window, outside the locks
+ * client requests take. It charges the window to a token bucket for the
+ * class and sleeps until the bucket has paid for it. The bucket's rate
+ * adapts every QOS_ADJUST_US:
+ *
+ *   - while no client request arrived, it runs at the class's cap
+ *     (unlimited without one);
+ *   - while the worst client read p99 of the members (member_p99()) is
+ *     above the latency target, the rate is halved, down to QOS_MIN_RATE;
+ *   - otherwise it grows by QOS_STEP, up to the cap.
+ *
+ * With a target of 0, any client activity counts as congestion, so
+ * background work backs off to QOS_MIN_RATE whenever clients are busy.
+ * Inside a member's queue, client I/O runs first anyway (see member.h).
+ *
+ * Each background class is paced by a single thread, so the buckets need no
+ * lock.
+ */
+
+#define QOS_ADJUST_US 100000     // how often a class's rate may change
+#define QOS_BURST_US 100000      // tokens a bucket saves up, in time at its rate
+#define QOS_MIN_RATE (1 << 20)   // bytes/s background work keeps up under any load
+#define QOS_STEP (4 << 20)       // bytes/s added per adjustment while under target
+
+extern uint32_t qos_target_us;   // client read p99 target, 0 = yield to any client I/O
+extern uint64_t qos_foreground;  // client requests seen, bumped by qos_note_foreground()
+
+static inline void qos_note_foreground(void) {
+    __atomic_add_fetch(&qos_foreground, 1, __ATOMIC_RELAXED);
+}
+
+/* The members whose latency the background classes answer to; *ndevs is
+ * read on every adjustment, so the array may grow. */
+void qos_members(struct member *devs, const int *ndevs);
+
+/* Limit class c to rate_mbps MB/s, 0 = unlimited. */
+void qos_set_cap(enum member_qos c, uint32_t rate_mbps);
+
+/* Charge bytes of background I/O of class c just done, and sleep as its
+ * bucket requires. */
+void qos_wait(enum member_qos c, uint64_t bytes);
+
+/* Print a "qos CLASS" line per background class for the stats report. */
+void qos_report(FILE *out);
+
+#endif /* QOS_H_INCLUDED */
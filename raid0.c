@@ -15,6 +15,7 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,126 +25,384 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "cache.h"
+#include "evlog.h"
+#include "control.h"
+#include "member.h"
+#include "readahead.h"
+#include "reshape.h"
+#include "stats.h"
+#include "wbcache.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[2]; // file descriptors for two underlying block devices that make up the RAID
+int dev_total = 0;
+struct member dev[16]; // the 2-16 underlying block devices that make up the RAID
 int block_size;  //NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
 uint64_t raid_device_size; // size of raid device in bytes
-bool verbose = false;  // set to true by -v option for debug output
+uint64_t member_size; // bytes striped over on every device
+struct cache *cache = NULL;  // read cache, if enabled by -M
+struct wbcache *wbcache = NULL;  // write-back cache device, if enabled by -B
+struct readahead *ra = NULL;  // sequential readahead, if enabled by -A
+bool integrity = false; // set by -I, devices added later get a checksum table too
+
+struct reshape geo; // striping of the array, and how far a reshape onto an added device has come
+pthread_rwlock_t layout_lock = PTHREAD_RWLOCK_INITIALIZER; // taken for writing while a reshape window moves blocks
+
+/* Run io[0..n) on their members concurrently. Returns -1 if any of them failed. */
+static int run_all(struct member_io *io, int *io_dev, int n) {
+    struct member_batch batch;
+    member_batch_init(&batch);
+    for (int k=0; k<n; k++) {
+        member_submit(&dev[io_dev[k]], &io[k], &batch);
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) return -1;
+    }
+    return 0;
+}
+
+/* Read or write [offset, offset+len) of the array: one I/O per block it
+ * touches, all submitted at once so every member works on its part in
+ * parallel. */
+static int stripe_io(enum member_op op, void *buf, u_int32_t len, u_int64_t offset) {
+    if (len == 0) {
+        return 0;
+    }
+    int n = (offset % block_size + len + block_size - 1) / block_size;
+    struct member_io *io = calloc(n, sizeof(*io));
+    int *io_dev = malloc(n * sizeof(*io_dev));
+    if (io == NULL || io_dev == NULL) {
+        free(io);
+        free(io_dev);
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&layout_lock);
+    u_int32_t done = 0;
+    for (int k = 0; k < n; k++) {
+        u_int64_t dev_block_index;
+        io_dev[k] = reshape_locate(&geo, (offset + done) / block_size, &dev_block_index); // old or new layout, depending on reshape progress
+        u_int64_t block_offset = (offset + done) % block_size;
+        u_int32_t piece = block_size - block_offset < len - done ? block_size - block_offset : len - done;
+
+        // the member layer retries, verifies checksums and reports errors
+        io[k] = (struct member_io){ .op = op, .buf = (char *)buf + done, .len = piece, .offset = dev_block_index * block_size + block_offset };
+        done += piece;
+    }
+    int ret = run_all(io, io_dev, n);
+    pthread_rwlock_unlock(&layout_lock);
+    free(io);
+    free(io_dev);
+    return ret;
+}
 
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "R - %lu, %u\n", offset, len);
-    
-    int block_num_from = offset / block_size;
-    int block_num_to = (offset+len) / block_size;
-    int block_byte_to = (offset+len) % block_size;
-    int bytes_read = 0;
-
-    for(int b = block_num_from; b <= block_num_to; b++){
-        int dev_num = b % 2;
-        int dev_block_index = b / 2;
-        off_t dev_offset = (offset + bytes_read) % block_size;
-        ssize_t curr_bytes_read = -1;
-
-        if (b == block_num_to){
-            curr_bytes_read = pread(dev_fd[dev_num], buf + bytes_read, block_byte_to - dev_offset, dev_block_index * block_size + dev_offset);
-        }else{
-            curr_bytes_read = pread(dev_fd[dev_num], buf + bytes_read, block_size - dev_offset, dev_block_index * block_size + dev_offset);
-        }        
-        if (curr_bytes_read < 0){
-            perror("Read error");
-            return -1;
-        }
-        bytes_read += curr_bytes_read;
-        if (bytes_read >= len) {
-            break; 
-        }
-    }
-    return 0;
+    evlog(EVLOG_READ, offset, len);
+    return stripe_io(MEMBER_READ, buf, len, offset);
 }
 
 static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
-    
-    int block_num_from = offset / block_size;
-    int block_num_to = (offset+len) / block_size;
-    int block_byte_to = (offset+len) % block_size;
-    int bytes_written = 0;
-
-    // printf("buf: %p\n", buf);  
-    // printf("len: %u\n", len);  
-    // printf("offset: %llu\n", offset); 
-
-    for(int b = block_num_from; b <= block_num_to; b++){
-        int dev_num = b % 2;
-        int dev_block_index = b / 2;
-        off_t dev_offset = (offset + bytes_written) % block_size;
-        ssize_t curr_bytes_written = -1;
-        if (b == block_num_to){
-            curr_bytes_written = pwrite(dev_fd[dev_num], buf + bytes_written, block_byte_to - dev_offset, dev_block_index * block_size + dev_offset);
-        }else{
-            curr_bytes_written = pwrite(dev_fd[dev_num], buf + bytes_written, block_size - dev_offset, dev_block_index * block_size + dev_offset);
-        }
-        if (curr_bytes_written < 0){
-            perror("Read error");
-            return -1;
-        }
-        bytes_written += curr_bytes_written;
-        if (bytes_written >= len) {
-            break; 
-        }
-    }
-    return 0;
+    evlog(EVLOG_WRITE, offset, len);
+    return stripe_io(MEMBER_WRITE, (void *)buf, len, offset);
 }
 
 static int xmp_flush(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a flush request.\n");
-    for (int i=0; i<2; i++) {
-        fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
+    evlog(EVLOG_FLUSH, 0, 0);
+    struct member_io io[16];
+    int io_dev[16];
+    pthread_rwlock_rdlock(&layout_lock);
+    for (int i=0; i<dev_total; i++) {
+        io[i] = (struct member_io){ .op = MEMBER_FSYNC }; // we use fsync to flush OS buffers to underlying devices (and write back checksums)
+        io_dev[i] = i;
     }
-    return 0;
+    int ret = run_all(io, io_dev, dev_total);
+    pthread_rwlock_unlock(&layout_lock);
+    return ret;
 }
 
 static void xmp_disc(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    evlog(EVLOG_DISC, 0, 0);
+    pthread_rwlock_rdlock(&layout_lock);
+    for (int i=0; i<dev_total; i++) {
+        if (dev[i].csum) {
+            struct member_io io = { .op = MEMBER_FSYNC };
+            member_run(&dev[i], &io); // leaves the checksum table marked clean
+        }
+    }
+    pthread_rwlock_unlock(&layout_lock);
 }
 
-/*
-// we'll disable trim support, you can add it back if you want it
+/* Punch the trimmed range out of the members. Consecutive blocks on the same
+ * member are merged, so trimming whole stripes costs one punch per member,
+ * and the punches run on all members at once. */
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "T - %lu, %u\n", from, len);
-    // trim is a no-op for us
+    evlog(EVLOG_TRIM, from, len);
+
+    struct member_io io[16];
+    int io_dev[16];
+    int n = 0, ret = 0;
+    pthread_rwlock_rdlock(&layout_lock);
+    for (u_int64_t pos = from; pos < from + len; ) {
+        u_int64_t b = pos / block_size, dev_block_index;
+        int d = reshape_locate(&geo, b, &dev_block_index);
+        u_int64_t end = (b + 1) * block_size < from + len ? (b + 1) * block_size : from + len;
+        u_int64_t dev_offset = dev_block_index * block_size + pos % block_size;
+        int k = 0;
+        while (k < n && io_dev[k] != d) k++;
+        if (k < n && io[k].offset + io[k].len == dev_offset) {
+            io[k].len += end - pos;
+        } else {
+            if (k < n) {
+                // d jumps (across the reshape front): send what we have and start over
+                ret |= run_all(io, io_dev, n);
+                n = 0;
+            }
+            io[n] = (struct member_io){ .op = MEMBER_PUNCH, .len = end - pos, .offset = dev_offset };
+            io_dev[n++] = d;
+        }
+        pos = end;
+    }
+    if (n > 0) {
+        ret |= run_all(io, io_dev, n);
+    }
+    pthread_rwlock_unlock(&layout_lock);
+    return ret;
+}
+
+/* Move the n blocks at geo.pos from the old layout to the new one and make
+ * them durable. All the reads go out at once, then all the writes. */
+static int reshape_move(uint64_t n, char *buf) {
+    struct member_io io[RESHAPE_MAX_WINDOW];
+    int io_dev[RESHAPE_MAX_WINDOW];
+    uint64_t row;
+
+    for (uint64_t k=0; k<n; k++) {
+        io_dev[k] = reshape_place(&geo, geo.pos + k, geo.old_ndata, &row);
+        io[k] = (struct member_io){ .op = MEMBER_READ, .buf = buf + k*block_size, .len = block_size, .offset = row * block_size };
+    }
+    if (run_all(io, io_dev, n) != 0) {
+        return -1;
+    }
+    for (uint64_t k=0; k<n; k++) {
+        io_dev[k] = reshape_place(&geo, geo.pos + k, geo.new_ndata, &row);
+        io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = buf + k*block_size, .len = block_size, .offset = row * block_size };
+    }
+    if (run_all(io, io_dev, n) != 0) {
+        return -1;
+    }
+    for (int i=0; i<dev_total; i++) {
+        io[i] = (struct member_io){ .op = MEMBER_FSYNC }; // durable before the checkpoint moves past them
+        io_dev[i] = i;
+    }
+    return run_all(io, io_dev, dev_total);
+}
+
+/* Restripes the array onto the added device one window at a time, then grows
+ * the exported size. Only this thread changes geo while it runs. */
+static void *reshape_thread(void *arg) {
+    UNUSED(arg);
+    char *buf = malloc((size_t)RESHAPE_MAX_WINDOW * block_size);
+    if (buf == NULL) {
+        perror("reshape");
+        return NULL;
+    }
+    fprintf(stderr, "Reshape: restriping from %u to %u devices, %lu of %lu blocks to go...\n",
+            geo.old_ndata, geo.new_ndata, geo.total - geo.pos, geo.total);
+    int reported = geo.pos * 10 / geo.total;
+    while (reshape_running(&geo)) {
+        uint64_t n = reshape_window(&geo);
+        pthread_rwlock_wrlock(&layout_lock);
+        int r = reshape_move(n, buf);
+        if (r == 0) {
+            geo.pos += n;
+            r = reshape_save(&geo);
+        }
+        pthread_rwlock_unlock(&layout_lock);
+        if (r != 0) {
+            fprintf(stderr, "Reshape stopped at block %lu; restart the array to resume it.\n", geo.pos);
+            free(buf);
+            return NULL;
+        }
+        if ((int)(geo.pos * 10 / geo.total) > reported) {
+            reported = geo.pos * 10 / geo.total;
+            fprintf(stderr, "Reshape: %d%% done\n", reported * 10);
+        }
+    }
+    free(buf);
+
+    // everything is in the new layout now, which also covers the rest of the added device
+    pthread_rwlock_wrlock(&layout_lock);
+    geo.old_ndata = geo.new_ndata;
+    geo.pos = geo.total = 0;
+    raid_device_size = member_size * geo.new_ndata;
+    reshape_save(&geo); // if this fails, the next start sees pos == total and finishes the same way
+    pthread_rwlock_unlock(&layout_lock);
+    // the wrappers took the size when they were set up
+    if (ra) readahead_resize(ra, raid_device_size);
+    if (wbcache) wbcache_resize(wbcache, raid_device_size, 0);
+    if (cache) cache_resize(cache, raid_device_size);
+    if (buse_set_size(raid_device_size) != 0) {
+        perror("Reshape: can't grow the nbd device (it will have the new size after a restart)");
+    }
+    fprintf(stderr, "Reshape complete, RAID device resulting size: %lu.\n", raid_device_size);
+    return NULL;
+}
+
+static int start_reshape(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reshape_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
     return 0;
 }
-*/
+
+/* Add the device at path to the array and start restriping onto it. */
+static void add_device(const char *path, FILE *reply) {
+    if (geo.path == NULL) {
+        fprintf(reply, "ERROR adding a device needs a --state file\n");
+        return;
+    }
+    if (reshape_running(&geo)) {
+        fprintf(reply, "ERROR a reshape is already running\n");
+        return;
+    }
+    if (dev_total == 16) {
+        fprintf(reply, "ERROR the array already has 16 devices\n");
+        return;
+    }
+    char *dev_path = strdup(path); // the member keeps it
+    int fd = dev_path ? open(dev_path, O_RDWR) : -1;
+    if (fd < 0) {
+        fprintf(reply, "ERROR %s: %s\n", path, strerror(errno));
+        free(dev_path);
+        return;
+    }
+    struct member *m = &dev[dev_total];
+    m->index = dev_total;
+    uint64_t size = lseek(fd, 0, SEEK_END);
+    m->csum = NULL;
+    if (integrity) {
+        if ((m->csum = csum_open(fd, dev_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+            fprintf(reply, "ERROR can't set up the checksum table of %s\n", path);
+            close(fd);
+            free(dev_path);
+            return;
+        }
+        size = m->csum->data_size;
+    }
+    if (size < member_size || member_start(m, fd, dev_path) != 0) {
+        fprintf(reply, "ERROR %s is smaller than the other devices, or unusable\n", path);
+        if (m->csum) csum_close(m->csum);
+        close(fd);
+        free(dev_path);
+        return;
+    }
+
+    struct reshape next = geo;
+    next.ndevs = dev_total + 1;
+    next.new_ndata = geo.old_ndata + 1;
+    next.pos = 0;
+    next.total = member_size / block_size * geo.old_ndata;
+    pthread_rwlock_wrlock(&layout_lock);
+    int r = reshape_save(&next); // the new geometry is on disk before any block moves
+    if (r == 0) {
+        geo = next;
+        dev_total++;
+    }
+    pthread_rwlock_unlock(&layout_lock);
+    if (r != 0) {
+        fprintf(reply, "ERROR can't write the state file %s\n", geo.path);
+        member_stop(m);
+        if (m->csum) csum_close(m->csum);
+        close(fd);
+        free(dev_path);
+        return;
+    }
+    fprintf(stderr, "Added device '%s' as device %d.\n", dev_path, dev_total - 1);
+    if (start_reshape() != 0) {
+        fprintf(reply, "ERROR can't start the reshape thread, restart the array to resume it\n");
+        return;
+    }
+    fprintf(reply, "OK restriping onto %d devices\n", dev_total);
+}
+
+/* Commands on the control socket. */
+static void control(int argc, char **argv, FILE *reply) {
+    if (strcmp(argv[0], "add") == 0 && argc == 2) {
+        add_device(argv[1], reply);
+    } else if (strcmp(argv[0], "status") == 0 && argc == 1) {
+        pthread_rwlock_rdlock(&layout_lock);
+        fprintf(reply, "devices %d size %lu", dev_total, raid_device_size);
+        if (reshape_running(&geo)) {
+            fprintf(reply, " reshape %lu/%lu", geo.pos, geo.total);
+        }
+        fprintf(reply, "\n");
+        pthread_rwlock_unlock(&layout_lock);
+        if (ra != NULL) {
+            readahead_report(ra, reply);
+        }
+        if (cache != NULL) {
+            cache_report(cache, reply);
+        }
+        if (wbcache != NULL) {
+            wbcache_report(wbcache, reply);
+        }
+    } else {
+        fprintf(reply, "ERROR unknown command '%s' (commands: add DEVICE, status)\n", argv[0]);
+    }
+}
 
 /* argument parsing using argp */
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"integrity", 'I', 0, 0, "Keep a CRC32C of every 4 KiB block in a table at the end of each device, and fail reads whose data doesn't match it", 0},
+    {"control", 'C', "SOCKET", 0, "Accept commands (\"add DEVICE\", \"status\") on the Unix socket SOCKET", 0},
+    {"state", 's', "FILE", 0, "Keep the array geometry and reshape progress in FILE; needed to add devices, and on every start after that", 0},
+    {"mmap", 'm', 0, 0, "Map the devices and serve reads by copying from the mapping instead of read(); an I/O error then kills the process, so only for trusted storage", 0},
+    {"populate", 'P', 0, 0, "With --mmap, fault the devices in completely at start, for arrays that are hot from the first read", 0},
+    {"readahead", 'A', "KB", 0, "Detect sequential readers and read up to KB kilobytes ahead of each (0 disables, the default)", 0},
+    {"cache", 'M', "MB", 0, "Keep a read cache of MB megabytes in memory in front of the array (0 disables, the default)", 0},
+    {"wb-cache", 'B', "FILE", 0, "Use the fast device or file FILE as a write-back cache: writes are acknowledged once logged there and destaged to the array in the background", 0},
+    {"stats", 'T', "SOCKET", 0, "Serve latency histograms and counters for requests and for each device on the Unix socket SOCKET (read them with buse-stat)", 0},
+    {"trace", 'R', "FILE", 0, "Record every request (type, offset, length, timing) in the binary trace FILE, for buse-replay", 0},
+    {"trace-hashes", 'X', 0, 0, "With --trace, also record a CRC32C of the data of every read and write", 0},
+    {"log", 'L', "FILE", 0, "Write the -v request log to the binary FILE instead of stderr, for buse-log (implies -v)", 0},
+    {"merge-window", 'G', "USEC", 0, "Hold requests for up to USEC microseconds to merge adjacent reads and writes into larger ones (raid4: into full-stripe writes)", 0},
     {0},
 };
 
 struct arguments {
     uint32_t block_size;
-    char* device[2];
+    char* device[16];
     char* raid_device;
     int verbose;
+    int integrity;
+    int mmap;
+    int populate;
+    char* control;
+    char* state;
+    uint32_t readahead_kb;
+    uint32_t cache_mb;
+    char *wb_cache;
+    char *stats;
+    char *trace;
+    int trace_hashes;
+    char *log;
+    uint32_t merge_window_us;
 };
 
 /* Parse a single option. */
@@ -157,37 +416,89 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 'I':
+            arguments->integrity = 1;
+            break;
+
+        case 'P':
+            arguments->populate = 1;
+            /* fall through */
+        case 'm':
+            arguments->mmap = 1;
+            break;
+
+        case 'C':
+            arguments->control = arg;
+            break;
+
+        case 's':
+            arguments->state = arg;
+            break;
+
+        case 'B':
+            arguments->wb_cache = arg;
+            break;
+
+        case 'T':
+            arguments->stats = arg;
+            break;
+
+        case 'R':
+            arguments->trace = arg;
+            break;
+
+        case 'X':
+            arguments->trace_hashes = 1;
+            break;
+
+        case 'L':
+            arguments->log = arg;
+            break;
+
+        case 'G':
+            arguments->merge_window_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "merge window must be an integer");
+            }
+            break;
+
+        case 'A':
+            arguments->readahead_kb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "readahead KB must be an integer");
+            }
+            break;
+
+        case 'M':
+            arguments->cache_mb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "cache MB must be an integer");
+            }
+            break;
+
         case ARGP_KEY_ARG:
-            switch (state->arg_num) {
-
-                case 0:
-                    arguments->block_size = strtoul(arg, &endptr, 10);
-                    if (*endptr != '\0') {
-                        /* failed to parse integer */
-                        errx(EXIT_FAILURE, "SIZE must be an integer");
-                    }
-                    break;
-
-                case 1:
-                    arguments->raid_device = arg;
-                    break;
-
-                case 2:
-                    arguments->device[0] = arg;
-                    break;
-
-                case 3:
-                    arguments->device[1] = arg;
-                    break;
-                    
-                default:
-                    /* Too many arguments. */
-                    return ARGP_ERR_UNKNOWN;
+            if (state->arg_num == 0) {
+                arguments->block_size = strtoul(arg, &endptr, 10);
+                if (*endptr != '\0') {
+                    /* failed to parse integer */
+                    errx(EXIT_FAILURE, "SIZE must be an integer");
+                }
+            } else if (state->arg_num == 1) {
+                arguments->raid_device = arg;
+            } else if (state->arg_num < 18) {
+                arguments->device[dev_total++] = arg;
+            } else {
+                warnx("too many arguments (valid number of drives are 2 to 16)");
+                /* Too many arguments. */
+                return ARGP_ERR_UNKNOWN;
             }
             break;
 
         case ARGP_KEY_END:
-            if (state->arg_num < 3) {
+            if (state->arg_num < 4) {
                 warnx("not enough arguments");
                 argp_usage(state);
             }
@@ -202,13 +513,16 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = {
     .options = options,
     .parser = parse_opt,
-    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2",
-    .doc = "BUSE implementation of RAID1 for two devices.\n" 
+    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2 ... (up to 16 DEVICEs)",
+    .doc = "BUSE implementation of RAID0 for 2 to 16 devices.\n" 
            "`BLOCKSIZE` is an integer number of bytes. "
            "\n\n"
            "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
            "\n\n"
            "`DEVICE*` is a path to underlying block devices. Normal files can be used too. "
+           "\n\n"
+           "A device added with \"add DEVICE\" on the --control socket is striped into the running array in the background, "
+           "and the array grows once that is done. List it last on later starts. "
 };
 
 
@@ -223,32 +537,101 @@ int main(int argc, char *argv[]) {
         .write = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
-        // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
+        .trim = xmp_trim,
     };
 
-    verbose = arguments.verbose;
     block_size = arguments.block_size;
-    raid_device_size=0; // will be detected from the drives available
+    integrity = arguments.integrity;
+    if (integrity && block_size % CSUM_BLOCK_SIZE != 0) {
+        fprintf(stderr, "ERROR: --integrity needs a BLOCKSIZE that is a multiple of %d.\n", CSUM_BLOCK_SIZE);
+        exit(1);
+    }
+    if (arguments.mmap && integrity) {
+        fprintf(stderr, "ERROR: --mmap can't be used with --integrity, whose checksums are verified on the read() path.\n");
+        exit(1);
+    }
+    member_size=0; // will be detected from the drives available
 
-    for (int i=0; i<2; i++) {
+    for (int i=0; i<dev_total; i++) {
         char* dev_path = arguments.device[i];
 
-        dev_fd[i] = open(dev_path,O_RDWR);
-        if (dev_fd[i] < 0) {
+        int fd = open(dev_path,O_RDWR);
+        if (fd < 0) {
+            perror(dev_path);
+            exit(1);
+        }
+        uint64_t size = lseek(fd,0,SEEK_END); // used to find device size by seeking to end
+        if (integrity) {
+            if ((dev[i].csum = csum_open(fd, dev_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+                exit(1);
+            }
+            size = dev[i].csum->data_size; // the checksum table lives at the end
+        }
+        dev[i].index = i;
+        if (member_start(&dev[i], fd, dev_path) != 0) {
+            exit(1);
+        }
+        if (arguments.mmap && member_map(&dev[i], arguments.populate) != 0) {
             perror(dev_path);
             exit(1);
         }
-        uint64_t size = lseek(dev_fd[i],0,SEEK_END); // used to find device size by seeking to end
         fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
-        if (raid_device_size==0 || size<raid_device_size) {
-            raid_device_size = size; // raid_device_size is minimum size of available devices
+        if (member_size==0 || size<member_size) {
+            member_size = size; // member_size is minimum size of available devices
         }
     }
-    raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
-    raid_device_size *= 2; // raid 0 does striping on both drives, and usable capcity is determined by smallest drive
+    member_size = member_size/block_size*block_size; // divide+mult to truncate to block size
+
+    // the geometry comes from the state file once devices were added, otherwise from the command line
+    geo = (struct reshape){ .path = arguments.state, .ndevs = dev_total, .parity = UINT32_MAX, .old_ndata = dev_total, .new_ndata = dev_total };
+    if (arguments.state) {
+        int r = reshape_load(&geo, arguments.state);
+        if (r < 0) {
+            exit(1);
+        }
+        if (r == 0 && geo.ndevs != (uint32_t)dev_total) {
+            fprintf(stderr, "ERROR: '%s' describes an array of %u devices, but %d were given.\n", arguments.state, geo.ndevs, dev_total);
+            exit(1);
+        }
+    }
+    if (!reshape_running(&geo)) {
+        geo.old_ndata = geo.new_ndata; // a reshape that got to the end but wasn't marked done
+        geo.pos = geo.total = 0;
+    }
+    raid_device_size = member_size * geo.old_ndata; // raid 0 stripes over all the drives, and usable capcity is determined by smallest drive
     bop.size = raid_device_size; // tell BUSE how big our block device is
+    if (integrity) {
+        bop.blksize = CSUM_BLOCK_SIZE; // so clients never write part of a checksummed block
+    }
 
+    if (arguments.control && control_start(arguments.control, control) != 0) {
+        exit(1);
+    }
+    if (reshape_running(&geo) && start_reshape() != 0) {
+        fprintf(stderr, "ERROR: can't start the reshape thread.\n");
+        exit(1);
+    }
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
     
-    return buse_main(arguments.raid_device, &bop, NULL);
+    if (arguments.stats && stats_start(arguments.stats, dev, &dev_total) != 0) {
+        exit(1);
+    }
+    if (arguments.trace && buse_trace(arguments.trace, arguments.trace_hashes) != 0) {
+        exit(1);
+    }
+    if ((arguments.verbose || arguments.log) && evlog_open(arguments.log) != 0) {
+        exit(1);
+    }
+    buse_merge(arguments.merge_window_us);
+    void *userdata = NULL;
+    if (arguments.readahead_kb > 0 && (ra = readahead_wrap(&bop, &userdata, (uint64_t)arguments.readahead_kb << 10)) == NULL) {
+        exit(1);
+    }
+    if (arguments.wb_cache && (wbcache = wbcache_wrap(&bop, &userdata, arguments.wb_cache, 0)) == NULL) {
+        exit(1);
+    }
+    if (arguments.cache_mb > 0 && (cache = cache_wrap(&bop, &userdata, (uint64_t)arguments.cache_mb << 20)) == NULL) {
+        exit(1);
+    }
+    return buse_main(arguments.raid_device, &bop, userdata);
 }
@@ -15,6 +15,7 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,98 +25,703 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "cache.h"
+#include "evlog.h"
+#include "intent.h"
+#include "member.h"
+#include "probes.h"
+#include "qos.h"
+#include "readahead.h"
+#include "scrub.h"
+#include "sparse.h"
+#include "stats.h"
+#include "wbcache.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[2]; // file descriptors for two underlying block devices that make up the RAID
+#define MAX_DEVS 16
+
+int dev_total = 0; // number of mirrors, including missing ones
+struct member dev[MAX_DEVS]; // the 2-16 underlying block devices that make up the RAID (dev[i].fd is -1 if missing)
 int block_size;  //NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
 uint64_t raid_device_size; // size of raid device in bytes
-bool verbose = false;  // set to true by -v option for debug output
+struct cache *cache = NULL;  // read cache, if enabled by -M
+struct wbcache *wbcache = NULL;  // write-back cache device, if enabled by -B
+struct readahead *ra = NULL;  // sequential readahead, if enabled by -A
 bool degraded = false; // true if we're missing a device
 
-int ok_dev = -1; // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
+int ok_dev = -1; // index of a member that has a valid drive (used as the rebuild source)
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
-int last_read_dev = 0; // used to interleave reading between the two devices
+uint32_t split_threshold = 128*1024; // reads of at least this many bytes are split across all mirrors (0 = never)
+#define SEQ_WINDOW (64*1024) // a read starting at most this far past a mirror's head position counts as sequential for it
+
+uint32_t hedge_min_us = 0; // hedge reads that take longer than max(p99, this) microseconds (0 = no hedging)
+
+uint32_t write_behind = 0; // max writes to write-mostly devices that may still be outstanding after we acknowledge (0 = write synchronously)
+struct intent_log intent; // records regions with outstanding write-behind writes, required for write-behind
+#define INTENT_REGION_SIZE (1024*1024)
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+int wb_outstanding = 0; // write-behind writes not yet completed
+
+pthread_mutex_t array_lock = PTHREAD_MUTEX_INITIALIZER; // keeps writes out of the region the online rebuild is copying
+char* spare_path = NULL; // hot spare that replaces the first device to fail
+int spare_fd = -1;
+struct csum_table *spare_csum = NULL; // the spare's checksum table, with --integrity
+pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spare_cond = PTHREAD_COND_INITIALIZER;
+bool spare_wanted = false; // a device failed and the spare thread should step in
+#define REBUILD_CHUNK (1024*1024) // the online rebuild copies (and locks out writes to) this much at a time
+uint32_t scrub_mbps = 0; // background scrub rate cap in MB/s (0 = no scrubbing)
+#define SCRUB_WINDOW (1024*1024) // the scrubber compares (and locks out writes to) this much at a time
+#define SCRUB_INTERVAL (24*60*60) // seconds between the end of one scrub pass and the start of the next
+
+/* Number of healthy, fully synced members that are not write-mostly. */
+static int fast_members() {
+    int n = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (member_in_sync(&dev[i], 0, raid_device_size) && !dev[i].write_mostly) n++;
+    }
+    return n;
+}
+
+/* Whether a read of [offset, offset+len) may be sent to member i. Write-mostly
+ * members are only read when no other mirror is left. */
+static bool readable(int i, uint64_t offset, uint64_t len) {
+    return member_in_sync(&dev[i], offset, len) && (!dev[i].write_mostly || fast_members() == 0);
+}
+
+static void write_behind_done(struct member_io *io) {
+    struct member *m = io->priv;
+    if (io->result < 0) {
+        fprintf(stderr, "Write-behind error on device %s at offset %lu: %s (region stays dirty)\n", m->path, io->offset, strerror(io->error));
+    }
+    intent_complete(&intent, io->offset, io->len, io->result >= 0);
+    free(io); // the data buffer was allocated along with the io
+
+    pthread_mutex_lock(&wb_lock);
+    wb_outstanding--;
+    pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Queue a copy of the write to a write-mostly member without waiting for it.
+ * Blocks while write_behind writes are already outstanding. */
+static int write_behind_submit(int i, const void *buf, u_int32_t len, u_int64_t offset) {
+    pthread_mutex_lock(&wb_lock);
+    while (wb_outstanding >= (int)write_behind)
+        pthread_cond_wait(&wb_cond, &wb_lock);
+    wb_outstanding++;
+    pthread_mutex_unlock(&wb_lock);
+
+    struct member_io *io = malloc(sizeof(*io) + len);
+    if (io == NULL || intent_mark(&intent, offset, len) != 0) {
+        perror("write-behind");
+        free(io);
+        pthread_mutex_lock(&wb_lock);
+        wb_outstanding--;
+        pthread_mutex_unlock(&wb_lock);
+        return -1;
+    }
+    *io = (struct member_io){ .op = MEMBER_WRITE, .buf = io + 1, .len = len, .offset = offset, .done = write_behind_done, .priv = &dev[i] };
+    memcpy(io->buf, buf, len);
+    member_submit(&dev[i], io, NULL);
+    return 0;
+}
+
+/* Wait until every write-behind write has completed. */
+static void write_behind_drain() {
+    pthread_mutex_lock(&wb_lock);
+    while (wb_outstanding > 0)
+        pthread_cond_wait(&wb_cond, &wb_lock);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Sync the write-mostly members and clear the intent bits of the regions that
+ * are now stable on them. */
+static void intent_sync() {
+    uint64_t seq = intent_seq(&intent);
+    for (int i=0; i<dev_total; i++) {
+        if (!member_ok(&dev[i]) || !dev[i].write_mostly) continue;
+        struct member_io io = { .op = MEMBER_FSYNC };
+        if (member_run(&dev[i], &io) < 0) {
+            return; // the member layer has failed it
+        }
+    }
+    if (intent_clean(&intent, seq) != 0) {
+        perror("intent bitmap");
+    }
+}
+
+/* Background thread that keeps the intent bitmap from filling up. */
+static void *intent_cleaner(void *arg) {
+    UNUSED(arg);
+    for (;;) {
+        sleep(1);
+        if (intent.dirty > 0) {
+            intent_sync();
+        }
+    }
+    return NULL;
+}
+
+/* Copy the regions left dirty by an unclean shutdown from a fast member to
+ * the write-mostly members. A '+' device is left out; the rebuild copies it
+ * whole afterwards. */
+static int intent_resync() {
+    int source_dev = -1;
+    uint64_t pos = 0, offset, len, regions = 0;
+
+    for (int i=0; i<dev_total; i++) {
+        if (i != rebuild_dev && member_ok(&dev[i]) && !dev[i].write_mostly) {
+            source_dev = i;
+            break;
+        }
+    }
+    if (source_dev == -1) {
+        fprintf(stderr, "ERROR: no up-to-date mirror to resync %lu dirty regions from.\n", intent.dirty);
+        return -1;
+    }
+    while (intent_next_dirty(&intent, pos, &offset, &len) == 0) {
+        for (int i=0; i<dev_total; i++) {
+            if (i == rebuild_dev || !member_ok(&dev[i]) || !dev[i].write_mostly) continue;
+            if (member_copy(&dev[source_dev], &dev[i], offset, len) != 0) {
+                perror("resync");
+                return -1;
+            }
+        }
+        regions++;
+        pos = offset + len;
+    }
+    fprintf(stderr, "Resynced %lu dirty regions to the write-mostly devices.\n", regions);
+    return intent_clear_all(&intent);
+}
+
+/* Pick the mirror to serve a read at offset: keep sequential streams on the
+ * mirror whose head is already there, otherwise pick the least loaded mirror,
+ * breaking ties by seek distance. Returns -1 if no mirror outside the exclude
+ * bitmask can serve it. */
+static int choose_read_dev(uint64_t offset, uint32_t len, uint32_t exclude) {
+    int best = -1;
+    int best_load = 0;
+    uint64_t best_dist = 0;
+
+    for (int i=0; i<dev_total; i++) {
+        if (((exclude >> i) & 1) || !readable(i, offset, len)) continue;
+        uint64_t head = member_head(&dev[i]);
+        int load = member_inflight(&dev[i]);
+        if (offset >= head && offset - head <= SEQ_WINDOW && load == 0) {
+            return i; // sequential continuation
+        }
+        uint64_t dist = offset > head ? offset - head : head - offset;
+        if (best == -1 || load < best_load || (load == best_load && dist < best_dist)) {
+            best = i;
+            best_load = load;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+/* Hedged read: if the chosen mirror doesn't answer within its recent p99
+ * latency (but at least hedge_min_us), or fails, send the same read to
+ * another mirror and take whichever finishes first. */
+static int hedged_read(int d, void *buf, u_int32_t len, u_int64_t offset, uint32_t exclude) {
+    struct member_hedge *h = member_hedge_new();
+    void *leg_buf[2] = {NULL, NULL};
+    int leg = MEMBER_HEDGE_FAILED;
+
+    if (h == NULL || (leg_buf[0] = member_hedge_submit(h, 0, &dev[d], MEMBER_READ, len, offset)) == NULL) {
+        perror("hedged read");
+        if (h) member_hedge_put(h);
+        return -1;
+    }
+    uint32_t deadline = member_p99(&dev[d]);
+    leg = member_hedge_wait(h, deadline > hedge_min_us ? deadline : hedge_min_us);
+    if (leg < 0) {
+        int e = choose_read_dev(offset, len, exclude | 1u << d);
+        if (e != -1) {
+            leg_buf[1] = member_hedge_submit(h, 1, &dev[e], MEMBER_READ, len, offset);
+        }
+        leg = member_hedge_wait(h, -1);
+    }
+    if (leg >= 0) {
+        memcpy(buf, leg_buf[leg], len);
+    }
+    member_hedge_put(h);
+    return leg < 0 ? -1 : 0;
+}
+
+/* Serve one large read from all mirrors at once, each mirror reading a
+ * block-aligned slice of the request. */
+static int split_read(void *buf, u_int32_t len, u_int64_t offset, int readers) {
+    struct member_io io[MAX_DEVS];
+    int n = 0;
+    uint64_t slice = ((uint64_t)len / readers + block_size - 1) / block_size * block_size;
+    struct member_batch batch;
+
+    member_batch_init(&batch);
+    for (int i=0; i<dev_total && n*slice < len; i++) {
+        if (!readable(i, offset, len)) continue;
+        uint64_t start = n*slice;
+        uint64_t size = len - start < slice ? len - start : slice;
+        io[n] = (struct member_io){ .op = MEMBER_READ, .buf = (char *)buf + start, .len = size, .offset = offset + start };
+        member_submit(&dev[i], &io[n], &batch);
+        n++;
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) {
+            return -1; // the member layer has reported it, the caller retries the whole read elsewhere
+        }
+    }
+    return 0;
+}
 
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    evlog(EVLOG_READ, offset, len);
+    qos_note_foreground();
     
-    if (degraded) {
-        // read from surviving drive
-        pread(dev_fd[ok_dev], buf, len, offset);
-    } else {
-        // read from one of the two drives (we dont care which)
-        last_read_dev = (last_read_dev+1) % 2; // alternate which device we do the read from
-        pread(dev_fd[last_read_dev], buf, len, offset);
+    int readers = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (readable(i, offset, len)) readers++;
+    }
+    if (split_threshold && len >= split_threshold && readers > 1) {
+        if (split_read(buf, len, offset, readers) == 0) {
+            return 0; // one big read gets the bandwidth of every mirror
+        }
+    }
+
+    // try the mirrors one by one until one of them can serve the read
+    uint32_t tried = 0;
+    uint32_t piece = block_size < CSUM_BLOCK_SIZE ? CSUM_BLOCK_SIZE : block_size; // unit of the block-by-block retry
+    for (;;) {
+        int d = choose_read_dev(offset, len, tried);
+        if (d == -1 && tried != 0 && len > piece) {
+            // every mirror failed somewhere in the range, but maybe not in the same place: go block by block
+            for (uint32_t pos = 0; pos < len; pos += piece) {
+                if (xmp_read((char *)buf + pos, len - pos < piece ? len - pos : piece, offset + pos, NULL) != 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        if (d == -1) {
+            fprintf(stderr, "Read error at offset %lu: no mirror could serve it\n", offset);
+            return -1;
+        }
+        if (dev[d].write_mostly) {
+            write_behind_drain(); // only a lagging mirror is left, let it catch up first
+        }
+        int r;
+        if (hedge_min_us > 0) {
+            r = hedged_read(d, buf, len, offset, tried);
+        } else {
+            struct member_io io = { .op = MEMBER_READ, .buf = buf, .len = len, .offset = offset };
+            r = member_run(&dev[d], &io) < 0 ? -1 : 0;
+        }
+        if (r == 0) {
+            break;
+        }
+        tried |= 1u << d;
     }
+
+    // rewrite the good data over the mirrors that failed to read it, giving them a chance to remap the bad sectors;
+    // under array_lock like any write, so a rebuild or scrub of the range can't interleave with it
+    if (tried == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&array_lock);
+    for (int i=0; i<dev_total; i++) {
+        if (((tried >> i) & 1) && member_ok(&dev[i])) {
+            if (dev[i].write_mostly) {
+                write_behind_drain(); // or a queued write-behind write could land after the repair
+            }
+            struct member_io io = { .op = MEMBER_WRITE, .buf = buf, .len = len, .offset = offset };
+            member_run(&dev[i], &io);
+        }
+    }
+    pthread_mutex_unlock(&array_lock);
     return 0;
 }
 
 static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
+    evlog(EVLOG_WRITE, offset, len);
+    qos_note_foreground();
     
-    if (degraded) {
-        // write to surviving drive
-        pwrite(dev_fd[ok_dev], buf, len, offset); // write to ok drive only
-    } else {
-        // write to both drives
-        for (int i=0; i<2; i++) {
-            pwrite(dev_fd[i], buf, len, offset); 
+    // write-mostly members may lag behind, but only while an up-to-date mirror holds the data
+    bool behind = write_behind > 0 && fast_members() > 0;
+    bool queued[MAX_DEVS] = {false};
+
+    // write to all surviving drives at once; the request completes when every mirror has acknowledged
+    struct member_io io[MAX_DEVS];
+    struct member_batch batch;
+    member_batch_init(&batch);
+    pthread_mutex_lock(&array_lock);
+    for (int i=0; i<dev_total; i++) {
+        if (!member_ok(&dev[i])) continue; // handle degraded mode (a rebuilding member is written too)
+        if (behind && dev[i].write_mostly && write_behind_submit(i, buf, len, offset) == 0) {
+            continue; // acknowledged by the fast members, completes in the background
         }
+        io[i] = (struct member_io){ .op = MEMBER_WRITE, .buf = (void *)buf, .len = len, .offset = offset };
+        member_submit(&dev[i], &io[i], &batch);
+        queued[i] = true;
     }
-    return 0;
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+    pthread_mutex_unlock(&array_lock);
+
+    // a mirror that missed the write has been failed by the member layer; we're fine as long as an in-sync one has it
+    for (int i=0; i<dev_total; i++) {
+        if (queued[i] && io[i].result >= 0 && member_in_sync(&dev[i], offset, len)) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Write error at offset %lu: no mirror could store it\n", offset);
+    return -1;
 }
 
 static int xmp_flush(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a flush request.\n");
-    for (int i=0; i<2; i++) {
-        if (dev_fd[i] != -1) { // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
+    evlog(EVLOG_FLUSH, 0, 0);
+    // we use fsync to flush OS buffers to underlying devices, all mirrors in parallel
+    struct member_io io[MAX_DEVS];
+    struct member_batch batch;
+    member_batch_init(&batch);
+    // lagging write-behind members are left out: the data is stable on the fast ones and the intent bitmap covers the rest
+    bool queued[MAX_DEVS] = {false};
+    for (int i=0; i<dev_total; i++) {
+        if (!member_ok(&dev[i])) continue; // handle degraded mode
+        if (write_behind > 0 && dev[i].write_mostly && fast_members() > 0) continue;
+        io[i] = (struct member_io){ .op = MEMBER_FSYNC };
+        member_submit(&dev[i], &io[i], &batch);
+        queued[i] = true;
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+
+    // members that failed to flush are failed by the member layer; the data is safe if a fully synced one flushed
+    for (int i=0; i<dev_total; i++) {
+        if (queued[i] && io[i].result >= 0 && member_in_sync(&dev[i], 0, raid_device_size)) {
+            return 0;
         }
     }
-    return 0;
+    fprintf(stderr, "Flush error: no mirror could be flushed\n");
+    return -1;
 }
 
 static void xmp_disc(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    evlog(EVLOG_DISC, 0, 0);
+    if (write_behind > 0) {
+        // let the write-mostly members catch up so we shut down with a clean bitmap
+        write_behind_drain();
+        intent_sync();
+    }
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i]) && dev[i].csum) {
+            struct member_io io = { .op = MEMBER_FSYNC };
+            member_run(&dev[i], &io); // leaves the checksum table marked clean
+        }
+    }
 }
 
-/*
-// we'll disable trim support, you can add it back if you want it
+/* Punch the range out of every mirror. A write-mostly member gets the punch
+ * queued behind its write-behind writes, so an older write can't land on top. */
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "T - %lu, %u\n", from, len);
-    // trim is a no-op for us
+    evlog(EVLOG_TRIM, from, len);
+
+    struct member_io io[MAX_DEVS];
+    struct member_batch batch;
+    bool queued[MAX_DEVS] = {false};
+    member_batch_init(&batch);
+    pthread_mutex_lock(&array_lock);
+    for (int i=0; i<dev_total; i++) {
+        if (!member_ok(&dev[i])) continue; // a rebuilding member is punched too
+        io[i] = (struct member_io){ .op = MEMBER_PUNCH, .len = len, .offset = from };
+        member_submit(&dev[i], &io[i], &batch);
+        queued[i] = true;
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+    pthread_mutex_unlock(&array_lock);
+
+    for (int i=0; i<dev_total; i++) {
+        if (queued[i] && io[i].result >= 0 && member_in_sync(&dev[i], from, len)) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Trim error at offset %lu: no mirror could be punched\n", from);
+    return -1;
+}
+
+/* Called by the member layer when a device fails; the spare thread takes it from there. */
+static void device_failed(struct member *m) {
+    UNUSED(m);
+    pthread_mutex_lock(&spare_lock);
+    spare_wanted = true;
+    pthread_cond_signal(&spare_cond);
+    pthread_mutex_unlock(&spare_lock);
+}
+
+/* Copy [pos, end) from member src to member f, skipping holes in the source. */
+static int rebuild_chunk(int src, int f, uint64_t pos, uint64_t end, char *buf) {
+    uint64_t data, hole;
+    int r;
+
+    while ((r = sparse_next_data(dev[src].fd, pos, end, &data, &hole)) == 0) {
+        if (member_punch(&dev[f], pos, data - pos) != 0) {
+            perror("rebuild_punch");
+            member_fail(&dev[f]);
+            return -1;
+        }
+        struct member_io rd = { .op = MEMBER_READ, .buf = buf, .len = hole - data, .offset = data, .qos = MEMBER_QOS_REBUILD };
+        struct member_io wr = { .op = MEMBER_WRITE, .buf = buf, .len = hole - data, .offset = data, .qos = MEMBER_QOS_REBUILD };
+        if (member_run(&dev[src], &rd) < 0 || member_run(&dev[f], &wr) < 0) {
+            return -1;
+        }
+        pos = hole;
+    }
+    if (r < 0) {
+        perror("rebuild_seek");
+        return -1;
+    }
+    if (member_punch(&dev[f], pos, end - pos) != 0) {
+        perror("rebuild_punch");
+        member_fail(&dev[f]);
+        return -1;
+    }
     return 0;
 }
-*/
+
+/* Bring member f up to date while the array stays online. Writes keep going to
+ * f throughout, so only the chunk being copied has to be locked, and reads
+ * use f for everything below its rebuilt mark. */
+static int rebuild_online(int f) {
+    char *buf = malloc(REBUILD_CHUNK);
+    if (buf == NULL) {
+        perror("rebuild");
+        return -1;
+    }
+    for (uint64_t pos = 0; pos < raid_device_size; ) {
+        uint64_t end = raid_device_size - pos < REBUILD_CHUNK ? raid_device_size : pos + REBUILD_CHUNK;
+        pthread_mutex_lock(&array_lock);
+        int src = -1;
+        for (int i=0; i<dev_total; i++) {
+            if (i != f && member_in_sync(&dev[i], 0, raid_device_size) && (src == -1 || dev[src].write_mostly)) {
+                src = i; // prefer a mirror that isn't lagging
+            }
+        }
+        if (src != -1 && dev[src].write_mostly) {
+            write_behind_drain();
+        }
+        int r = src == -1 ? -1 : rebuild_chunk(src, f, pos, end, buf);
+        if (r == 0) {
+            member_set_rebuilt(&dev[f], end);
+            PROBE3(rebuild, f, end, raid_device_size);
+        }
+        pthread_mutex_unlock(&array_lock);
+        if (src == -1 || !member_ok(&dev[f])) {
+            fprintf(stderr, "Online rebuild of device %d stopped at offset %lu: %s\n", f, pos, src == -1 ? "no in-sync mirror left" : "the new device failed");
+            free(buf);
+            return -1;
+        }
+        if (r == 0) {
+            qos_wait(MEMBER_QOS_REBUILD, end - pos);
+            pos = end; // otherwise the source failed, try the chunk again from another mirror
+        }
+    }
+    member_set_rebuilt(&dev[f], UINT64_MAX);
+    free(buf);
+    return 0;
+}
+
+/* Waits for a device to fail, swaps the hot spare in for it and rebuilds it. */
+static void *spare_thread(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&spare_lock);
+    while (!spare_wanted) {
+        pthread_cond_wait(&spare_cond, &spare_lock);
+    }
+    pthread_mutex_unlock(&spare_lock);
+
+    int f = -1;
+    for (int i=0; i<dev_total && f == -1; i++) {
+        if (!member_ok(&dev[i])) f = i;
+    }
+    if (f == -1) {
+        return NULL;
+    }
+    fprintf(stderr, "Activating hot spare '%s' in place of device %d, rebuilding in the background...\n", spare_path, f);
+    pthread_mutex_lock(&array_lock); // no write is half-way through the old member while we swap
+    int r = member_replace(&dev[f], spare_fd, spare_path, spare_csum);
+    pthread_mutex_unlock(&array_lock);
+    if (r == 0 && rebuild_online(f) == 0) {
+        fprintf(stderr, "Rebuild of device %d onto '%s' complete, array is no longer degraded.\n", f, spare_path);
+    }
+    return NULL;
+}
+
+/* Compare [pos, end) on every in-sync mirror, and rewrite the mirrors that
+ * disagree with the majority (or, with only two copies, with the first
+ * mirror that isn't write-mostly) or that failed to read it. */
+static void scrub_window(struct scrub *sc, uint64_t pos, uint64_t end, char *bufs) {
+    uint64_t len = end - pos;
+    struct member_io io[MAX_DEVS];
+    int io_dev[MAX_DEVS];
+    int n = 0;
+
+    pthread_mutex_lock(&array_lock);
+    write_behind_drain(); // write-mostly members must have caught up before they are compared
+
+    // nothing to compare where every mirror is unallocated
+    bool sparse = true;
+    for (int i=0; i<dev_total && sparse; i++) {
+        uint64_t data, hole;
+        if (member_in_sync(&dev[i], pos, len) && sparse_next_data(dev[i].fd, pos, end, &data, &hole) != 1) sparse = false;
+    }
+
+    struct member_batch batch;
+    member_batch_init(&batch);
+    for (int i=0; i<dev_total && !sparse; i++) {
+        if (!member_in_sync(&dev[i], pos, len)) continue;
+        io[n] = (struct member_io){ .op = MEMBER_READ, .buf = bufs + (uint64_t)n*SCRUB_WINDOW, .len = len, .offset = pos, .qos = MEMBER_QOS_SCRUB };
+        io_dev[n] = i;
+        member_submit(&dev[i], &io[n], &batch);
+        n++;
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+
+    // pick the reference copy: the one most other readable copies agree with, preferring fast mirrors on a tie
+    int ref = -1, ref_votes = -1;
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) continue;
+        int votes = 0;
+        for (int j=0; j<n; j++) {
+            if (j != k && io[j].result >= 0 && memcmp(io[k].buf, io[j].buf, len) == 0) votes++;
+        }
+        if (votes > ref_votes || (votes == ref_votes && dev[io_dev[ref]].write_mostly && !dev[io_dev[k]].write_mostly)) {
+            ref = k;
+            ref_votes = votes;
+        }
+    }
+
+    for (int k=0; k<n && ref != -1; k++) {
+        if (k == ref) continue;
+        if (io[k].result < 0) {
+            sc->read_errors++;
+        } else {
+            // count the mismatching blocks, and only rewrite if there are any
+            uint64_t bad = 0;
+            for (uint64_t b = 0; b < len; b += block_size) {
+                uint64_t bl = len - b < (uint64_t)block_size ? len - b : (uint64_t)block_size;
+                if (memcmp((char *)io[k].buf + b, (char *)io[ref].buf + b, bl) != 0) bad++;
+            }
+            if (bad == 0) continue;
+            sc->mismatches += bad;
+            fprintf(stderr, "Scrub: device %d (%s) differs from device %d in %lu blocks at offset %lu, repairing\n",
+                    io_dev[k], dev[io_dev[k]].path, io_dev[ref], bad, pos);
+            sc->repaired += bad;
+        }
+        struct member_io fix = { .op = MEMBER_WRITE, .buf = io[ref].buf, .len = len, .offset = pos, .qos = MEMBER_QOS_SCRUB };
+        if (member_ok(&dev[io_dev[k]])) member_run(&dev[io_dev[k]], &fix);
+    }
+    if (ref == -1 && n > 0) {
+        sc->read_errors++;
+        fprintf(stderr, "Scrub: no mirror could read offset %lu\n", pos);
+    }
+    pthread_mutex_unlock(&array_lock);
+}
+
+/* Verifies the mirrors against each other in the background, forever. */
+static void *scrub_thread(void *arg) {
+    UNUSED(arg);
+    char *bufs = malloc((uint64_t)dev_total * SCRUB_WINDOW);
+    if (bufs == NULL) {
+        perror("scrub");
+        return NULL;
+    }
+    for (;;) {
+        struct scrub sc;
+        scrub_begin(&sc, "raid1", raid_device_size, scrub_mbps);
+        for (uint64_t pos = 0; pos < raid_device_size; pos += SCRUB_WINDOW) {
+            uint64_t end = raid_device_size - pos < SCRUB_WINDOW ? raid_device_size : pos + SCRUB_WINDOW;
+            scrub_window(&sc, pos, end, bufs);
+            scrub_throttle(&sc, end - pos);
+        }
+        scrub_end(&sc);
+        sleep(SCRUB_INTERVAL);
+    }
+    return NULL;
+}
 
 /* argument parsing using argp */
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"split", 's', "BYTES", 0, "Split reads of at least BYTES across all mirrors (default 131072, 0 disables)", 0},
+    {"hedge", 'H', "USEC", 0, "Re-issue a read to another mirror when it takes longer than the device's recent p99 latency, but at least USEC (0 disables, the default)", 0},
+    {"write-mostly", 'W', "DEVNUM", 0, "Don't read from device number DEVNUM (counting from 0) while another mirror is available; may be repeated", 0},
+    {"write-behind", 'b', "COUNT", 0, "Let up to COUNT writes to write-mostly devices complete after the request is acknowledged (requires --bitmap)", 0},
+    {"bitmap", 'i', "FILE", 0, "Write-intent bitmap recording regions with outstanding write-behind writes", 0},
+    {"spare", 'S', "DEVICE", 0, "Hot spare: when a device fails (or is MISSING), DEVICE takes its place and is rebuilt in the background", 0},
+    {"retries", 'r', "COUNT", 0, "Retry I/Os that fail with a transient error COUNT times (default 3)", 0},
+    {"max-errors", 'e', "COUNT", 0, "Fail a device after COUNT read errors that retrying didn't fix (default 10); write errors fail it right away", 0},
+    {"integrity", 'I', 0, 0, "Keep a CRC32C of every 4 KiB block in a table at the end of each device, verify it on every read, and treat a mismatch like a read error", 0},
+    {"scrub", 'c', "MBPS", 0, "Verify the mirrors against each other in the background at up to MBPS MB/s, backing off while clients are busy, and repair differences (0 disables, the default)", 0},
+    {"mmap", 'm', 0, 0, "Map the devices and serve reads by copying from the mapping instead of read(); an I/O error then kills the process, so only for trusted storage", 0},
+    {"populate", 'P', 0, 0, "With --mmap, fault the devices in completely at start, for arrays that are hot from the first read", 0},
+    {"readahead", 'A', "KB", 0, "Detect sequential readers and read up to KB kilobytes ahead of each (0 disables, the default)", 0},
+    {"cache", 'M', "MB", 0, "Keep a read cache of MB megabytes in memory in front of the array (0 disables, the default)", 0},
+    {"wb-cache", 'B', "FILE", 0, "Use the fast device or file FILE as a write-back cache: writes are acknowledged once logged there and destaged to the array in the background", 0},
+    {"stats", 'T', "SOCKET", 0, "Serve latency histograms and counters for requests and for each device on the Unix socket SOCKET (read them with buse-stat)", 0},
+    {"trace", 'R', "FILE", 0, "Record every request (type, offset, length, timing) in the binary trace FILE, for buse-replay", 0},
+    {"trace-hashes", 'X', 0, 0, "With --trace, also record a CRC32C of the data of every read and write", 0},
+    {"log", 'L', "FILE", 0, "Write the -v request log to the binary FILE instead of stderr, for buse-log (implies -v)", 0},
+    {"merge-window", 'G', "USEC", 0, "Hold requests for up to USEC microseconds to merge adjacent reads and writes into larger ones (raid4: into full-stripe writes)", 0},
+    {"latency-target", 'Q', "USEC", 0, "Slow the background rebuild and scrub down while the p99 latency of client reads on any device is above USEC microseconds (0, the default: whenever clients are busy)", 0},
+    {"rebuild-rate", 'U', "MBPS", 0, "Rebuild a replaced device online at up to MBPS MB/s, less while clients need the devices (0, the default: unlimited)", 0},
     {0},
 };
 
 struct arguments {
     uint32_t block_size;
-    char* device[2];
+    char* device[MAX_DEVS];
     char* raid_device;
     int verbose;
+    uint32_t split_threshold;
+    uint32_t hedge_min_us;
+    uint32_t write_mostly; // bitmask of device numbers
+    uint32_t write_behind;
+    char* bitmap;
+    char* spare;
+    int retries;
+    int max_errors;
+    uint32_t scrub_mbps;
+    int integrity;
+    int mmap;
+    int populate;
+    uint32_t readahead_kb;
+    uint32_t cache_mb;
+    char *wb_cache;
+    char *stats;
+    char *trace;
+    int trace_hashes;
+    char *log;
+    uint32_t merge_window_us;
+    uint32_t latency_target_us;
+    uint32_t rebuild_mbps;
 };
 
 /* Parse a single option. */
@@ -129,37 +735,161 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
-        case ARGP_KEY_ARG:
-            switch (state->arg_num) {
-
-                case 0:
-                    arguments->block_size = strtoul(arg, &endptr, 10);
-                    if (*endptr != '\0') {
-                        /* failed to parse integer */
-                        errx(EXIT_FAILURE, "SIZE must be an integer");
-                    }
-                    break;
-
-                case 1:
-                    arguments->raid_device = arg;
-                    break;
-
-                case 2:
-                    arguments->device[0] = arg;
-                    break;
-
-                case 3:
-                    arguments->device[1] = arg;
-                    break;
-                    
-                default:
-                    /* Too many arguments. */
-                    return ARGP_ERR_UNKNOWN;
+        case 's':
+            arguments->split_threshold = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "split threshold must be an integer");
+            }
+            break;
+
+        case 'H':
+            arguments->hedge_min_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "hedge USEC must be an integer");
+            }
+            break;
+
+        case 'W': {
+            unsigned long n = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || n >= MAX_DEVS) {
+                errx(EXIT_FAILURE, "DEVNUM must be a device number between 0 and %d", MAX_DEVS-1);
+            }
+            arguments->write_mostly |= 1u << n;
+            break;
+        }
+
+        case 'b':
+            arguments->write_behind = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "write-behind COUNT must be an integer");
+            }
+            break;
+
+        case 'i':
+            arguments->bitmap = arg;
+            break;
+
+        case 'S':
+            arguments->spare = arg;
+            break;
+
+        case 'r':
+            arguments->retries = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "retries COUNT must be an integer");
+            }
+            break;
+
+        case 'e':
+            arguments->max_errors = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->max_errors == 0) {
+                errx(EXIT_FAILURE, "max-errors COUNT must be a positive integer");
+            }
+            break;
+
+        case 'I':
+            arguments->integrity = 1;
+            break;
+
+        case 'P':
+            arguments->populate = 1;
+            /* fall through */
+        case 'm':
+            arguments->mmap = 1;
+            break;
+
+        case 'c':
+            arguments->scrub_mbps = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "scrub MBPS must be an integer");
+            }
+            break;
+
+        case 'B':
+            arguments->wb_cache = arg;
+            break;
+
+        case 'T':
+            arguments->stats = arg;
+            break;
+
+        case 'R':
+            arguments->trace = arg;
+            break;
+
+        case 'X':
+            arguments->trace_hashes = 1;
+            break;
+
+        case 'L':
+            arguments->log = arg;
+            break;
+
+        case 'G':
+            arguments->merge_window_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "merge window must be an integer");
+            }
+            break;
+
+        case 'Q':
+            arguments->latency_target_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "latency target must be an integer");
+            }
+            break;
+
+        case 'U':
+            arguments->rebuild_mbps = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "rebuild MBPS must be an integer");
+            }
+            break;
+
+        case 'A':
+            arguments->readahead_kb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "readahead KB must be an integer");
+            }
+            break;
+
+        case 'M':
+            arguments->cache_mb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "cache MB must be an integer");
+            }
+            break;
+
+        case ARGP_KEY_ARG: // parsing arguments after options
+            if (state->arg_num == 0) {
+                arguments->block_size = strtoul(arg, &endptr, 10);
+                if (*endptr != '\0') {
+                    /* failed to parse integer */
+                    errx(EXIT_FAILURE, "SIZE must be an integer");
+                }
+            } else if (state->arg_num == 1) {
+                arguments->raid_device = arg;
+            } else if (state->arg_num < 2 + MAX_DEVS) {
+                arguments->device[dev_total++] = arg;
+            } else {
+                warnx("too many arguments (valid number of drives are 2 to %d)", MAX_DEVS);
+                /* Too many arguments. */
+                return ARGP_ERR_UNKNOWN;
             }
             break;
 
         case ARGP_KEY_END:
-            if (state->arg_num < 3) {
+            if (state->arg_num < 4) {
                 warnx("not enough arguments");
                 argp_usage(state);
             }
@@ -174,13 +904,14 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = {
     .options = options,
     .parser = parse_opt,
-    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2",
-    .doc = "BUSE implementation of RAID1 for two devices.\n"
+    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2 ... (up to 16 DEVICEs)",
+    .doc = "BUSE implementation of RAID1 for two or more mirrored devices.\n"
            "`BLOCKSIZE` is an integer number of bytes. "
            "\n\n"
            "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
            "\n\n"
-           "`DEVICE*` is a path to underlying block devices. Normal files can be used too. A `DEVICE` may be specified as \"MISSING\" to run in degraded mode. "
+           "`DEVICE*` is a path to underlying block devices. Normal files can be used too. A `DEVICE` may be specified as \"MISSING\" to run in degraded mode, "
+           "as long as at least one mirror is present. "
            "\n\n"
            "If you prepend '+' to a DEVICE, you are re-adding it as a replacement to the RAID, and we will rebuild the array. "
            "This is synchronous; the rebuild will have to finish before the RAID is started. "
@@ -188,37 +919,52 @@ static struct argp argp = {
 
 static int do_raid_rebuild() {
     // target drive index is: rebuild_dev
-    int source_dev = (rebuild_dev+1)%2; // the other one
-    char buf[block_size]; 
-    lseek(dev_fd[source_dev],0,SEEK_SET);
-    lseek(dev_fd[rebuild_dev],0,SEEK_SET);
-    
-    // simple block copy
-    for (uint64_t cursor=0; cursor<raid_device_size; cursor+=block_size) {
-        int r;
-        r = read(dev_fd[source_dev],buf,block_size);
-        if (r<0) {
-            perror("rebuild_read");
+    int source_dev = ok_dev; // any present mirror other than the one being rebuilt, preferably one that doesn't lag
+    uint64_t cursor = 0, data, hole, copied = 0;
+    int r;
+
+    for (int i=0; i<dev_total; i++) {
+        if (i != rebuild_dev && member_ok(&dev[i]) && !dev[i].write_mostly) {
+            source_dev = i;
+            break;
+        }
+    }
+    if (dev[source_dev].write_mostly && intent.dirty > 0) {
+        fprintf(stderr, "ERROR: Only write-mostly devices are left to rebuild from, and the intent bitmap says they are missing %lu regions.\n", intent.dirty);
+        return -1;
+    }
+
+    // extent-aware copy: holes in the source are punched on the target, allocated extents are copied in-kernel
+    while ((r = sparse_next_data(dev[source_dev].fd, cursor, raid_device_size, &data, &hole)) == 0) {
+        if (member_punch(&dev[rebuild_dev], cursor, data - cursor) != 0) {
+            perror("rebuild_punch");
             return -1;
-        } else if (r != block_size) {
-            fprintf(stderr, "rebuild_read: short read (%d bytes), offset=%zu\n", r, cursor);
-            return 1;
         }
-        r = write(dev_fd[rebuild_dev],buf,block_size);
-        if (r<0) {
-            perror("rebuild_write");
+        if (member_copy(&dev[source_dev], &dev[rebuild_dev], data, hole - data) != 0) {
+            perror("rebuild_copy");
             return -1;
-        } else if (r != block_size) {
-            fprintf(stderr, "rebuild_write: short write (%d bytes), offset=%zu\n", r, cursor);
-            return 1;
         }
+        copied += hole - data;
+        cursor = hole;
+    }
+    if (r < 0) {
+        perror("rebuild_seek");
+        return -1;
     }
+    if (member_punch(&dev[rebuild_dev], cursor, raid_device_size - cursor) != 0) { // trailing hole
+        perror("rebuild_punch");
+        return -1;
+    }
+    fprintf(stderr, "Rebuild copied %lu of %lu bytes, the rest was unallocated.\n", copied, raid_device_size);
     return 0;
 }
 
 int main(int argc, char *argv[]) {
     struct arguments arguments = {
         .verbose = 0,
+        .split_threshold = 128*1024,
+        .retries = 3,
+        .max_errors = 10,
     };
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     
@@ -227,20 +973,37 @@ int main(int argc, char *argv[]) {
         .write = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
-        // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
+        .trim = xmp_trim,
     };
 
-    verbose = arguments.verbose;
     block_size = arguments.block_size;
+    split_threshold = arguments.split_threshold;
+    hedge_min_us = arguments.hedge_min_us;
+    write_behind = arguments.write_behind;
+    member_retries = arguments.retries;
+    member_max_errors = arguments.max_errors;
+    qos_members(dev, &dev_total);
+    qos_target_us = arguments.latency_target_us;
+    qos_set_cap(MEMBER_QOS_REBUILD, arguments.rebuild_mbps);
+    scrub_mbps = arguments.scrub_mbps;
+    if (arguments.mmap && arguments.integrity) {
+        fprintf(stderr, "ERROR: --mmap can't be used with --integrity, whose checksums are verified on the read() path.\n");
+        exit(1);
+    }
+    if (write_behind > 0 && arguments.bitmap == NULL) {
+        fprintf(stderr, "ERROR: --write-behind needs a write-intent --bitmap to record writes that haven't reached every mirror.\n");
+        exit(1);
+    }
     
     raid_device_size=0; // will be detected from the drives available
     ok_dev=-1;
     bool rebuild_needed = false; // will be set to true if a drive is MISSING
-    for (int i=0; i<2; i++) {
+    int fd[MAX_DEVS];
+    for (int i=0; i<dev_total; i++) {
         char* dev_path = arguments.device[i];
         if (strcmp(dev_path,"MISSING")==0) {
             degraded = true;
-            dev_fd[i] = -1;
+            fd[i] = -1;
             fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
         } else {
             if (dev_path[0] == '+') { // RAID rebuild mode!!
@@ -253,25 +1016,59 @@ int main(int argc, char *argv[]) {
                 rebuild_dev = i;
                 rebuild_needed = true;
             }
-            ok_dev = i;
-            dev_fd[i] = open(dev_path,O_RDWR);
-            if (dev_fd[i] < 0) {
+            if (rebuild_dev != i) {
+                ok_dev = i;
+            }
+            fd[i] = open(dev_path,O_RDWR);
+            if (fd[i] < 0) {
                 perror(dev_path);
                 exit(1);
             }
-            uint64_t size = lseek(dev_fd[i],0,SEEK_END); // used to find device size by seeking to end
+            uint64_t size = lseek(fd[i],0,SEEK_END); // used to find device size by seeking to end
+            if (arguments.integrity) {
+                if ((dev[i].csum = csum_open(fd[i], dev_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+                    exit(1);
+                }
+                size = dev[i].csum->data_size; // the checksum table lives at the end
+            }
             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
             if (raid_device_size==0 || size<raid_device_size) {
                 raid_device_size = size; // raid_device_size is minimum size of available devices
             }
         }
+        dev[i].index = i;
+        if (member_start(&dev[i], fd[i], dev_path) != 0) {
+            exit(1);
+        }
+        if (arguments.mmap && fd[i] >= 0 && member_map(&dev[i], arguments.populate) != 0) {
+            perror(dev_path);
+            exit(1);
+        }
+        dev[i].write_mostly = (arguments.write_mostly >> i) & 1;
+        dev[i].on_fail = device_failed;
+        if (dev[i].write_mostly) {
+            fprintf(stderr, "Device %d is write-mostly.\n", i);
+        }
     }
     
     raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
     bop.size = raid_device_size; // tell BUSE how big our block device is
+    if (arguments.integrity) {
+        bop.blksize = CSUM_BLOCK_SIZE; // so clients never write part of a checksummed block
+    }
+    // write-mostly members catch up first, they may have to be the rebuild source
+    if (arguments.bitmap) {
+        if (intent_open(&intent, arguments.bitmap, INTENT_REGION_SIZE, raid_device_size) != 0) {
+            exit(1);
+        }
+        if (intent.dirty > 0 && intent_resync() != 0) {
+            fprintf(stderr, "Resync failed, aborting.\n");
+            exit(1);
+        }
+    }
     if (rebuild_needed) {
-        if (degraded) {
-            fprintf(stderr, "ERROR: Can't rebuild from a missing device (i.e., you can't combine MISSING and '+').\n");
+        if (ok_dev == -1) {
+            fprintf(stderr, "ERROR: Can't rebuild from a missing device (at least one mirror besides the '+' one must be present).\n");
             exit(1);
         }
         fprintf(stderr, "Doing RAID rebuild...\n");
@@ -281,11 +1078,70 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
     }
-    if (degraded && ok_dev==-1) {
+    if (ok_dev==-1) {
         fprintf(stderr, "ERROR: No functioning devices found. Aborting.\n");
         exit(1);
     }
+    if (arguments.bitmap) {
+        pthread_t cleaner;
+        if (pthread_create(&cleaner, NULL, intent_cleaner, NULL) != 0) {
+            fprintf(stderr, "ERROR: can't start the intent bitmap thread.\n");
+            exit(1);
+        }
+    }
+    if (arguments.spare) {
+        spare_path = arguments.spare;
+        spare_fd = open(spare_path, O_RDWR);
+        if (spare_fd < 0) {
+            perror(spare_path);
+            exit(1);
+        }
+        uint64_t size = lseek(spare_fd, 0, SEEK_END);
+        if (arguments.integrity) {
+            if ((spare_csum = csum_open(spare_fd, spare_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+                exit(1);
+            }
+            size = spare_csum->data_size;
+        }
+        if (size < raid_device_size) {
+            fprintf(stderr, "ERROR: Hot spare '%s' is smaller than the array.\n", spare_path);
+            exit(1);
+        }
+        spare_wanted = degraded; // a MISSING device is replaced right away
+        pthread_t spare;
+        if (pthread_create(&spare, NULL, spare_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: can't start the hot spare thread.\n");
+            exit(1);
+        }
+    }
+    if (scrub_mbps > 0) {
+        pthread_t scrubber;
+        if (pthread_create(&scrubber, NULL, scrub_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: can't start the scrub thread.\n");
+            exit(1);
+        }
+    }
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
     
-    return buse_main(arguments.raid_device, &bop, NULL);
+    if (arguments.stats && stats_start(arguments.stats, dev, &dev_total) != 0) {
+        exit(1);
+    }
+    if (arguments.trace && buse_trace(arguments.trace, arguments.trace_hashes) != 0) {
+        exit(1);
+    }
+    if ((arguments.verbose || arguments.log) && evlog_open(arguments.log) != 0) {
+        exit(1);
+    }
+    buse_merge(arguments.merge_window_us);
+    void *userdata = NULL;
+    if (arguments.readahead_kb > 0 && (ra = readahead_wrap(&bop, &userdata, (uint64_t)arguments.readahead_kb << 10)) == NULL) {
+        exit(1);
+    }
+    if (arguments.wb_cache && (wbcache = wbcache_wrap(&bop, &userdata, arguments.wb_cache, 0)) == NULL) {
+        exit(1);
+    }
+    if (arguments.cache_mb > 0 && (cache = cache_wrap(&bop, &userdata, (uint64_t)arguments.cache_mb << 20)) == NULL) {
+        exit(1);
+    }
+    return buse_main(arguments.raid_device, &bop, userdata);
 }
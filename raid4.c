@@ -15,6 +15,7 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,27 +25,239 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "cache.h"
+#include "evlog.h"
+#include "control.h"
+#include "member.h"
+#include "probes.h"
+#include "qos.h"
+#include "readahead.h"
+#include "reshape.h"
+#include "scrub.h"
+#include "sparse.h"
+#include "stats.h"
+#include "wbcache.h"
+#include "xor.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
 int dev_total = 0;
-int dev_fd[16] = {0}; // file descriptors for 3-16 underlying block devices that make up the RAID
+struct member dev[16]; // the 3-16 underlying block devices that make up the RAID (dev[i].fd is -1 if missing)
 int block_size;  //NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
 uint64_t raid_device_size; // size of raid device in bytes
-bool verbose = false;  // set to true by -v option for debug output
+struct cache *cache = NULL;  // read cache, if enabled by -M
+struct wbcache *wbcache = NULL;  // write-back cache device, if enabled by -B
+struct readahead *ra = NULL;  // sequential readahead, if enabled by -A
 bool degraded = false; // true if we're missing a device
+bool integrity = false; // set by -I, devices added later get a checksum table too
 
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 int degraded_dev = -1;
 int parity_dev = -1;
+struct reshape geo; // which members hold data and parity, and how far a reshape onto an added device has come
+pthread_rwlock_t layout_lock = PTHREAD_RWLOCK_INITIALIZER; // taken for writing while a reshape window moves blocks
+uint32_t hedge_min_us = 0; // reconstruct reads that take longer than max(p99, this) microseconds (0 = no hedging)
 
-static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-    UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "R - %lu, %u\n", offset, len);
+pthread_mutex_t array_lock = PTHREAD_MUTEX_INITIALIZER; // keeps writes out of the region the online rebuild is computing
+char* spare_path = NULL; // hot spare that replaces the first device to fail
+int spare_fd = -1;
+struct csum_table *spare_csum = NULL; // the spare's checksum table, with --integrity
+pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spare_cond = PTHREAD_COND_INITIALIZER;
+bool spare_wanted = false; // a device failed and the spare thread should step in
+#define REBUILD_CHUNK (1024*1024) // the online rebuild recomputes (and locks out writes to) this much at a time
+uint32_t scrub_mbps = 0; // background scrub rate cap in MB/s (0 = no scrubbing)
+#define SCRUB_WINDOW (1024*1024) // the scrubber verifies (and locks out writes to) this much of every member at a time
+#define SCRUB_INTERVAL (24*60*60) // seconds between the end of one scrub pass and the start of the next
+
+/* Whether every member but d holds valid data for n bytes at off, so d's part can be recomputed. */
+static bool others_in_sync(int d, uint64_t off, size_t n) {
+    for (int i=0; i < dev_total; i++) {
+        if (i != d && !member_in_sync(&dev[i], off, n)) return false;
+    }
+    return true;
+}
+
+/* Read n bytes at off from member d. Errors are reported by the member layer. */
+static int read_member(int d, void *out, size_t n, uint64_t off) {
+    struct member_io io = { .op = MEMBER_READ, .buf = out, .len = n, .offset = off };
+    return member_run(&dev[d], &io) < 0 ? -1 : 0;
+}
+
+static uint32_t run_batch(struct member_io *io, int *io_dev, int n);
+
+/* Recompute n bytes at off of member missing by XORing all other members,
+ * which are read concurrently. */
+static int reconstruct(int missing, void *out, size_t n, uint64_t off, enum member_qos qos) {
+    if (!others_in_sync(missing, off, n)) {
+        return -1;
+    }
+    PROBE3(reconstruct, missing, off, n);
+    char *tmp = malloc(n * (dev_total - 1));
+    if (tmp == NULL) {
+        perror("reconstruct");
+        return -1;
+    }
+    struct member_io io[16];
+    int io_dev[16];
+    void *parts[16];
+    int k = 0;
+    for (int i=0; i < dev_total; i++) {
+        if (i == missing) continue;
+        parts[k] = tmp + k*n;
+        io[k] = (struct member_io){ .op = MEMBER_READ, .buf = parts[k], .len = n, .offset = off, .qos = qos };
+        io_dev[k++] = i;
+    }
+    int r = run_batch(io, io_dev, k) == 0 ? 0 : -1;
+    if (r == 0) {
+        xor_blocks(out, parts, k, n);
+    }
+    free(tmp);
+    return r;
+}
+
+/* Hedged read: if member d doesn't answer within its recent p99 latency (but
+ * at least hedge_min_us), or fails, reconstruct the same range from the other
+ * members plus parity and take whichever finishes first. */
+static int hedged_read(int d, void *out, size_t n, uint64_t off) {
+    struct member_hedge *h = member_hedge_new();
+    void *direct = NULL;
+    void *parts[16];
+    int nparts = 0;
+
+    if (h == NULL || (direct = member_hedge_submit(h, 0, &dev[d], MEMBER_READ, n, off)) == NULL) {
+        perror("hedged read");
+        if (h) member_hedge_put(h);
+        return -1;
+    }
+    uint32_t deadline = member_p99(&dev[d]);
+    int leg = member_hedge_wait(h, deadline > hedge_min_us ? deadline : hedge_min_us);
+    if (leg < 0) {
+        bool redundant = others_in_sync(d, off, n); // otherwise already degraded, nothing to reconstruct from
+        for (int i=0; i < dev_total && redundant; i++) {
+            if (i == d) continue;
+            if ((parts[nparts++] = member_hedge_submit(h, 1, &dev[i], MEMBER_READ, n, off)) == NULL) {
+                break; // the reconstruct leg has failed, only the direct read can still answer
+            }
+        }
+        leg = member_hedge_wait(h, -1);
+    }
+    if (leg == 0) {
+        memcpy(out, direct, n);
+    } else if (leg == 1) {
+        PROBE3(reconstruct, d, off, n);
+        xor_blocks(out, parts, nparts, n);
+    }
+    member_hedge_put(h);
+    return leg < 0 ? -1 : 0;
+}
+
+/* Read n bytes at off from member d, reconstructing them if d is missing,
+ * still being rebuilt there, or fails. Data recovered after a read error is
+ * written back so the device can remap the bad sectors. */
+static int read_block(int d, void *out, size_t n, uint64_t off) {
+    bool tried = member_in_sync(&dev[d], off, n);
+    if (tried) {
+        int r = hedge_min_us > 0 ? hedged_read(d, out, n, off) : read_member(d, out, n, off);
+        if (r == 0) {
+            return 0;
+        }
+    }
+    if (reconstruct(d, out, n, off, MEMBER_QOS_CLIENT) != 0) {
+        fprintf(stderr, "Read error on device %d (%s) at offset %lu, and it could not be reconstructed\n", d, dev[d].path, off);
+        return -1;
+    }
+    if (tried && member_ok(&dev[d])) {
+        struct member_io io = { .op = MEMBER_WRITE, .buf = out, .len = n, .offset = off };
+        member_run(&dev[d], &io);
+    }
+    return 0;
+}
+
+/* Serve a read spanning several blocks with one I/O per member: every
+ * member involved reads its part of the stripe rows at once into a bounce
+ * buffer, a missing member's part is XORed together from all the others in
+ * one pass, and the blocks are then copied out in order. Returns 1 if the
+ * request has to go block by block instead (errors, or more redundancy lost
+ * than a row-wide reconstruct can cover). */
+static int stripe_read(void *buf, u_int32_t len, u_int64_t offset) {
+    uint64_t first = offset / block_size, last = (offset + len - 1) / block_size;
+    if (first < geo.pos && last >= geo.pos) {
+        return 1; // straddles the reshape front, the two parts are striped differently
+    }
+    uint32_t ndata = first < geo.pos ? geo.new_ndata : geo.old_ndata;
+    uint64_t row_from = first / ndata, row_to = last / ndata;
+    uint64_t base = row_from * block_size;
+    size_t span = (row_to - row_from + 1) * block_size;
+
+    // which data members hold part of the request, and which of them can't be read directly
+    bool needed[16] = {false};
+    int missing = -1;
+    for (uint64_t b = first; b <= last && b < first + ndata; b++) {
+        needed[reshape_member(&geo, b % ndata)] = true;
+    }
+    for (int i=0; i < dev_total; i++) {
+        if (needed[i] && !member_in_sync(&dev[i], base, span)) {
+            if (missing != -1) return 1;
+            missing = i;
+        }
+    }
+    if (missing == -1 && hedge_min_us > 0) {
+        return 1; // healthy reads that may stall are hedged block by block
+    }
+    if (missing != -1) {
+        if (!others_in_sync(missing, base, span)) return 1;
+        for (int i=0; i < dev_total; i++) {
+            needed[i] = i != missing;
+        }
+    }
+
+    char *bounce = malloc(span * dev_total);
+    if (bounce == NULL) {
+        return 1;
+    }
+    struct member_io io[16];
+    int io_dev[16];
+    void *parts[16];
+    int n = 0;
+    for (int i=0; i < dev_total; i++) {
+        if (!needed[i]) continue;
+        parts[n] = bounce + i*span;
+        io[n] = (struct member_io){ .op = MEMBER_READ, .buf = parts[n], .len = span, .offset = base };
+        io_dev[n++] = i;
+    }
+    if (run_batch(io, io_dev, n) != 0) {
+        free(bounce);
+        return 1;
+    }
+    if (missing != -1) {
+        PROBE3(reconstruct, missing, base, span);
+        xor_blocks(bounce + missing*span, parts, n, span);
+    }
+
+    uint64_t done = 0;
+    for (uint64_t b = first; b <= last; b++) {
+        uint64_t block_offset = (offset + done) % block_size;
+        size_t chunk = block_size - block_offset < len - done ? block_size - block_offset : len - done;
+        char *src = bounce + reshape_member(&geo, b % ndata)*span + (b / ndata - row_from)*block_size + block_offset;
+        memcpy((char *)buf + done, src, chunk);
+        done += chunk;
+    }
+    free(bounce);
+    return 0;
+}
+
+static int raid_read(void *buf, u_int32_t len, u_int64_t offset) {
+    // multi-block reads go to all the members at once
+    if (len > 0 && offset / block_size != (offset + len - 1) / block_size) {
+        if (stripe_read(buf, len, offset) == 0) {
+            return 0;
+        }
+    }
     
     // if(offset < 0 || offset > raid_device_size || offset + len > raid_device_size) {
     //     perror("Read error: invalid offset or len");  //////// error needed???????
@@ -57,8 +270,8 @@ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
     u_int64_t bytes_read = 0;
 
     for(u_int64_t b = block_num_from; b <= block_num_to; b++){
-        int dev_num = b % (dev_total - 1);
-        u_int64_t dev_block_index = b / (dev_total - 1);
+        u_int64_t dev_block_index;
+        int dev_num = reshape_locate(&geo, b, &dev_block_index); // old or new layout, depending on reshape progress
         u_int64_t block_offset = (offset + bytes_read) % block_size;
         u_int64_t dev_offset = dev_block_index * block_size + block_offset;
         ssize_t curr_bytes_read = -1;
@@ -67,35 +280,13 @@ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
             block_byte_to = (offset+len) % block_size; 
         }
 
-        // replace the degraded drive with:
-        // XOR with surviving drive and all other drives
-        if (dev_fd[dev_num] == -1){ // degraded drive
-            int r;
-            char temp_buf[block_byte_to - block_offset];
-            char result_buf[block_byte_to - block_offset];
-            memset(temp_buf, 0, block_byte_to - block_offset); 
-            memset(result_buf, 0, block_byte_to - block_offset); 
-            for(int i=0; i < dev_total; i++){
-                if (i == dev_num) continue;
-                r = pread(dev_fd[i], temp_buf, block_byte_to - block_offset, dev_offset);
-                for(int j = 0; j < block_byte_to - block_offset; j++){
-                    result_buf[j] ^= temp_buf[j];
-                }
-                if (r<0) {
-                    perror("Read error");
-                    return -1;
-                } else if (r != block_byte_to - block_offset) {
-                    fprintf(stderr, "read: short read (%d bytes)\n", r);
-                    return 1;
-                }
-            }
-            curr_bytes_read = block_byte_to - block_offset;
-            memcpy(buf + bytes_read, result_buf, block_byte_to - block_offset);
-        }else{ // normal drive
-            curr_bytes_read = pread(dev_fd[dev_num], buf + bytes_read, block_byte_to - block_offset, dev_offset);
+        if (block_byte_to == block_offset) {
+            break; // request ends on a block boundary
         }
-        if (curr_bytes_read < 0){
-            perror("Read error");
+        curr_bytes_read = block_byte_to - block_offset;
+
+        // a missing, rebuilding or failing drive is replaced by the XOR of all the others
+        if (read_block(dev_num, (char *)buf + bytes_read, curr_bytes_read, dev_offset) != 0){
             return -1;
         }
         bytes_read += curr_bytes_read;
@@ -106,91 +297,135 @@ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
     return 0;
 }
 
-static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "W - %lu, %u\n", offset, len);
-    
-    // if(offset < 0 || offset > raid_device_size || offset + len > raid_device_size) {
-    //     perror("Write error: invalid offset or len");  //// error needed?????
-    //     return -1;
-    // }
+    evlog(EVLOG_READ, offset, len);
+    qos_note_foreground();
+
+    pthread_rwlock_rdlock(&layout_lock);
+    int ret = raid_read(buf, len, offset);
+    pthread_rwlock_unlock(&layout_lock);
+    return ret;
+}
+
+/* Run the I/Os queued in io[0..n) on their members concurrently. Returns the
+ * bitmask of the ones that failed. */
+static uint32_t run_batch(struct member_io *io, int *io_dev, int n) {
+    struct member_batch batch;
+    member_batch_init(&batch);
+    for (int k=0; k<n; k++) {
+        member_submit(&dev[io_dev[k]], &io[k], &batch);
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+
+    uint32_t failed = 0;
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) failed |= 1u << k;
+    }
+    return failed;
+}
+
+/* Like run_batch, for any number of I/Os. Returns -1 if any of them failed. */
+static int run_all(struct member_io *io, int *io_dev, int n) {
+    struct member_batch batch;
+    member_batch_init(&batch);
+    for (int k=0; k<n; k++) {
+        member_submit(&dev[io_dev[k]], &io[k], &batch);
+    }
+    member_batch_wait(&batch);
+    member_batch_destroy(&batch);
+    for (int k=0; k<n; k++) {
+        if (io[k].result < 0) return -1;
+    }
+    return 0;
+}
+
+/* Write n bytes of data at off to data member d and update the parity.
+ * Scratch must hold 3*n bytes. Succeeds as long as the new data can be read
+ * back, directly or through parity. */
+static int write_block(int d, const void *data, size_t n, uint64_t off, char *scratch) {
+    char *old_d = scratch, *old_p = scratch + n, *new_p = scratch + 2*n;
+    struct member_io io[2];
+    int io_dev[2];
+
+    if (!member_ok(&dev[parity_dev])) {
+        // no parity to keep up to date
+        struct member_io w = { .op = MEMBER_WRITE, .buf = (void *)data, .len = n, .offset = off };
+        return member_ok(&dev[d]) && member_run(&dev[d], &w) >= 0 ? 0 : -1;
+    }
+
+    PROBE3(parity_start, d, off, n);
+    bool rmw = member_in_sync(&dev[d], off, n) && member_in_sync(&dev[parity_dev], off, n);
+    if (rmw) {
+        // read-modify-write: fetch old data and old parity at once
+        io[0] = (struct member_io){ .op = MEMBER_READ, .buf = old_d, .len = n, .offset = off };
+        io[1] = (struct member_io){ .op = MEMBER_READ, .buf = old_p, .len = n, .offset = off };
+        io_dev[0] = d;
+        io_dev[1] = parity_dev;
+        if (run_batch(io, io_dev, 2) == 0) {
+            memcpy(new_p, data, n);
+            xor_into(new_p, old_d, n);
+            xor_into(new_p, old_p, n);
+        } else {
+            rmw = false; // one of them is unreadable here, compute the parity from the other drives instead
+        }
+    }
+    if (!rmw) {
+        // reconstruct-write: new parity is the new data XOR every other data drive
+        memcpy(new_p, data, n);
+        for (int i=0; i < dev_total; i++) {
+            if (i == d || i == parity_dev) continue;
+            if (!member_in_sync(&dev[i], off, n) || read_member(i, old_d, n, off) != 0) {
+                fprintf(stderr, "Write error on device %d at offset %lu: parity can't be computed\n", d, off);
+                return -1;
+            }
+            xor_into(new_p, old_d, n);
+        }
+    }
+
+    PROBE3(parity_done, d, off, n);
+
+    // write data and parity at once; a drive being rebuilt gets the write too
+    int k = 0;
+    if (member_ok(&dev[d])) {
+        io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = (void *)data, .len = n, .offset = off };
+        io_dev[k++] = d;
+    }
+    io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = new_p, .len = n, .offset = off };
+    io_dev[k++] = parity_dev;
+    uint32_t failed = run_batch(io, io_dev, k);
+    if (failed == (1u << k) - 1) {
+        fprintf(stderr, "Write error on device %d at offset %lu: neither data nor parity could be stored\n", d, off);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write len bytes at offset block by block, each with its own parity update. */
+static int write_blocks(const char *buf, u_int64_t len, u_int64_t offset, char *scratch) {
     u_int64_t block_num_from = offset / block_size;
     u_int64_t block_num_to = (offset+len) / block_size;
     u_int64_t block_byte_to = block_size;
     u_int64_t bytes_written = 0;
 
     for(u_int64_t b = block_num_from; b <= block_num_to; b++){
-        int dev_num = b % (dev_total - 1);
-        u_int64_t dev_block_index = b / (dev_total - 1);
+        u_int64_t dev_block_index;
+        int dev_num = reshape_locate(&geo, b, &dev_block_index);
         u_int64_t block_offset = (offset + bytes_written) % block_size;
         u_int64_t dev_offset = dev_block_index * block_size + block_offset;
-        ssize_t curr_bytes_written = -1;
         
         if(b == block_num_to) {
             block_byte_to = (offset+len) % block_size; 
         }
 
-        // replace the degraded drive with:
-        // XOR all surviving drive with the writing content -> store in parity
-        if (dev_fd[dev_num] == -1 && dev_num != dev_total - 1){ // degraded drive
-            int r;
-            char temp_buf[block_byte_to - block_offset];
-            char result_buf[block_byte_to - block_offset];
-            memset(temp_buf, 0, block_byte_to - block_offset);
-            memset(result_buf, 0, block_byte_to - block_offset);
-            for(int i=0; i < dev_total-1; i++){
-                if (i == dev_num) continue;
-                r = pread(dev_fd[i], temp_buf, block_byte_to - block_offset, dev_offset);
-                for(int j = 0; j < block_byte_to - block_offset; j++){
-                    result_buf[j] ^= temp_buf[j];
-                }
-                if (r<0) {
-                    perror("Read error in write");
-                    return -1;
-                } else if (r != block_byte_to - block_offset) {
-                    fprintf(stderr, "Read error in write: short read (%d bytes)\n", r);
-                    return 1;
-                }
-            }
-            // XOR with the data to be written in degraded drive -> write to parity directly
-            memcpy(temp_buf, buf + bytes_written, block_byte_to - block_offset);
-            for (int i = block_offset; i < block_byte_to; i++){
-                result_buf[i] ^= temp_buf[i];
-            }
-            curr_bytes_written = pwrite(dev_fd[parity_dev], result_buf, block_byte_to - block_offset, dev_offset);
-        }else{ // normal drive
-            char old_b[block_byte_to - block_offset];
-            char old_p[block_byte_to - block_offset];
-            int rb = pread(dev_fd[dev_num], old_b, block_byte_to - block_offset, dev_offset);
-            if (rb < 0){
-                perror("Read error");
-                return -1;
-            }
-            int rp = pread(dev_fd[parity_dev], old_p, block_byte_to - block_offset, dev_offset);
-            if (rp < 0){
-                perror("Read error");
-                return -1;
-            }
-            curr_bytes_written = pwrite(dev_fd[dev_num], buf + bytes_written, block_byte_to - block_offset, dev_offset);
-            if (curr_bytes_written < 0){
-                perror("Write error");
-                return -1;
-            }
-            // write to parity (using single small write)
-            if (dev_fd[dev_total - 1] != -1){
-                char new_p[block_byte_to - block_offset];
-                char new_b[block_byte_to - block_offset];
-                memcpy(new_b, buf + bytes_written, block_byte_to - block_offset);
-                for(int i = block_offset; i < block_byte_to; i++){
-                    new_p[i] = old_b[i] ^ old_p[i] ^ new_b[i];
-                }
-                ssize_t parity_bytes_written = pwrite(dev_fd[parity_dev], new_p, block_byte_to - block_offset, dev_offset);
-                if (parity_bytes_written < 0){
-                    perror("Write error");
-                    return -1;
-                }
-            }   
+        if (block_byte_to == block_offset) {
+            break; // request ends on a block boundary
+        }
+        size_t curr_bytes_written = block_byte_to - block_offset;
+
+        if (write_block(dev_num, buf + bytes_written, curr_bytes_written, dev_offset, scratch) != 0) {
+            return -1;
         }
         bytes_written += curr_bytes_written;
         if (bytes_written >= len) {
@@ -200,40 +435,679 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
     return 0;
 }
 
+/* Write nrows whole rows starting at row. The parity is computed from the new
+ * data alone, so nothing is read, and every member is written at once.
+ * Returns 1 without writing if a member is missing or out of sync there; the
+ * caller then goes block by block. */
+static int write_rows(const char *buf, uint64_t row, uint64_t nrows) {
+    int ndata = geo.new_ndata;
+    size_t span = nrows * block_size;
+    uint64_t off = row * block_size;
+    if (!others_in_sync(-1, off, span)) {
+        return 1;
+    }
+    char *bounce = malloc((size_t)dev_total * span);
+    if (bounce == NULL) {
+        perror("write");
+        return -1;
+    }
+    void *parts[16];
+    for (int k=0; k < ndata; k++) {
+        parts[k] = bounce + reshape_member(&geo, k)*span;
+        for (uint64_t r=0; r < nrows; r++) {
+            memcpy((char *)parts[k] + r*block_size, buf + (r*ndata + k)*block_size, block_size);
+        }
+    }
+    PROBE3(parity_start, -1, off, span);
+    xor_blocks(bounce + parity_dev*span, parts, ndata, span);
+    PROBE3(parity_done, -1, off, span);
+
+    struct member_io io[16];
+    int io_dev[16];
+    for (int i=0; i < dev_total; i++) {
+        io[i] = (struct member_io){ .op = MEMBER_WRITE, .buf = bounce + i*span, .len = span, .offset = off };
+        io_dev[i] = i;
+    }
+    uint32_t failed = run_batch(io, io_dev, dev_total);
+    free(bounce);
+    if (failed & (failed - 1)) {
+        fprintf(stderr, "Write error at row %lu: more than one device failed\n", row);
+        return -1;
+    }
+    return 0;
+}
+
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    UNUSED(userdata);
+    evlog(EVLOG_WRITE, offset, len);
+    qos_note_foreground();
+    
+    // if(offset < 0 || offset > raid_device_size || offset + len > raid_device_size) {
+    //     perror("Write error: invalid offset or len");  //// error needed?????
+    //     return -1;
+    // }
+    int ret = 0;
+    char *scratch = malloc(3 * (size_t)block_size);
+    if (scratch == NULL) {
+        perror("write");
+        return -1;
+    }
+    pthread_rwlock_rdlock(&layout_lock);
+    pthread_mutex_lock(&array_lock);
+
+    // rows the request covers completely are written as full stripes, the rest block by block
+    uint64_t row_bytes = (uint64_t)geo.new_ndata * block_size;
+    uint64_t row = (offset + row_bytes - 1) / row_bytes, end_row = (offset + len) / row_bytes;
+    uint64_t done = 0;
+    if (!reshape_running(&geo) && end_row > row) {
+        done = row * row_bytes - offset;
+        if (done > 0) {
+            ret = write_blocks(buf, done, offset, scratch);
+        }
+        uint64_t max_rows = (1024*1024) / block_size > 0 ? (1024*1024) / block_size : 1; // bounce buffer of up to 1 MiB per member
+        while (ret == 0 && row < end_row) {
+            uint64_t n = end_row - row < max_rows ? end_row - row : max_rows;
+            ret = write_rows((const char *)buf + done, row, n);
+            if (ret == 1) {
+                ret = write_blocks((const char *)buf + done, n * row_bytes, offset + done, scratch);
+            }
+            row += n;
+            done += n * row_bytes;
+        }
+    }
+    if (ret == 0 && done < len) {
+        ret = write_blocks((const char *)buf + done, len - done, offset + done, scratch);
+    }
+    pthread_mutex_unlock(&array_lock);
+    pthread_rwlock_unlock(&layout_lock);
+    free(scratch);
+    return ret;
+}
+
 static int xmp_flush(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a flush request.\n");
+    evlog(EVLOG_FLUSH, 0, 0);
+
+    // we use fsync to flush OS buffers to underlying devices, all of them at once
+    struct member_io io[16];
+    int io_dev[16];
+    int n = 0;
+    pthread_rwlock_rdlock(&layout_lock);
     for (int i=0; i<dev_total; i++) {
-        if (dev_fd[i] != -1) { // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
+        if (member_ok(&dev[i])) { // handle degraded mode
+            io[n] = (struct member_io){ .op = MEMBER_FSYNC };
+            io_dev[n++] = i;
         }
     }
+    run_batch(io, io_dev, n);
+
+    // drives that failed to flush are failed by the member layer; the data survives as long as only one is gone
+    int missing = 0;
+    for (int i=0; i<dev_total; i++) {
+        if (!member_in_sync(&dev[i], 0, raid_device_size)) missing++;
+    }
+    pthread_rwlock_unlock(&layout_lock);
+    if (missing > 1) {
+        fprintf(stderr, "Flush error: %d devices are unavailable\n", missing);
+        return -1;
+    }
     return 0;
 }
 
 static void xmp_disc(void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "Received a disconnect request.\n");
-    // disconnect is a no-op for us
+    evlog(EVLOG_DISC, 0, 0);
+    pthread_rwlock_rdlock(&layout_lock);
+    for (int i=0; i<dev_total; i++) {
+        if (member_ok(&dev[i]) && dev[i].csum) {
+            struct member_io io = { .op = MEMBER_FSYNC };
+            member_run(&dev[i], &io); // leaves the checksum table marked clean
+        }
+    }
+    pthread_rwlock_unlock(&layout_lock);
 }
 
-/*
-// we'll disable trim support, you can add it back if you want it
+/* Trim n bytes at off of data member d: punch them and fold the old data out
+ * of the parity. Data that is a hole already reads as zeros and is in the
+ * parity as zeros, so it is left alone; trimming the same range twice, or a
+ * range that was never written, costs nothing. Where the array is degraded
+ * zeros are written instead. Scratch must hold 3*n bytes. */
+static int trim_block(int d, size_t n, uint64_t off, char *scratch, const char *zeros) {
+    char *old_d = scratch, *old_p = scratch + n;
+    struct member_io io[2];
+    int io_dev[2] = { d, parity_dev };
+    uint64_t data, hole;
+
+    if (!member_in_sync(&dev[d], off, n) || !member_in_sync(&dev[parity_dev], off, n)) {
+        return write_block(d, zeros, n, off, scratch);
+    }
+    if (sparse_next_data(dev[d].fd, off, off + n, &data, &hole) == 1) {
+        return 0;
+    }
+    io[0] = (struct member_io){ .op = MEMBER_READ, .buf = old_d, .len = n, .offset = off };
+    io[1] = (struct member_io){ .op = MEMBER_READ, .buf = old_p, .len = n, .offset = off };
+    if (run_batch(io, io_dev, 2) != 0) {
+        return write_block(d, zeros, n, off, scratch);
+    }
+    xor_into(old_p, old_d, n);
+    io[0] = (struct member_io){ .op = MEMBER_PUNCH, .len = n, .offset = off };
+    io[1] = (struct member_io){ .op = MEMBER_WRITE, .buf = old_p, .len = n, .offset = off };
+    if (run_batch(io, io_dev, 2) == 3) {
+        fprintf(stderr, "Trim error on device %d at offset %lu: neither data nor parity could be updated\n", d, off);
+        return -1;
+    }
+    return 0;
+}
+
+/* Trim len bytes at offset block by block. */
+static int trim_blocks(u_int64_t len, u_int64_t offset, char *scratch, const char *zeros) {
+    for (u_int64_t pos = offset; pos < offset + len; ) {
+        u_int64_t b = pos / block_size, dev_block_index;
+        int d = reshape_locate(&geo, b, &dev_block_index);
+        u_int64_t end = (b + 1) * block_size < offset + len ? (b + 1) * block_size : offset + len;
+        if (trim_block(d, end - pos, dev_block_index * block_size + pos % block_size, scratch, zeros) != 0) {
+            return -1;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+/* Rows the trim covers completely are punched on every member, parity
+ * included: the parity of zeros is zeros. The rows at either end are trimmed
+ * block by block with their parity updated. */
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
     UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "T - %lu, %u\n", from, len);
-    // trim is a no-op for us
+    evlog(EVLOG_TRIM, from, len);
+    qos_note_foreground();
+
+    int ret = 0;
+    char *scratch = malloc(3 * (size_t)block_size);
+    char *zeros = calloc(1, block_size);
+    if (scratch == NULL || zeros == NULL) {
+        perror("trim");
+        free(scratch);
+        free(zeros);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&layout_lock);
+    pthread_mutex_lock(&array_lock);
+
+    uint64_t row_bytes = (uint64_t)geo.new_ndata * block_size;
+    uint64_t row = (from + row_bytes - 1) / row_bytes, end_row = (from + len) / row_bytes;
+    uint64_t done = 0;
+    if (!reshape_running(&geo) && end_row > row) {
+        done = row * row_bytes - from;
+        ret = trim_blocks(done, from, scratch, zeros);
+        uint64_t off = row * block_size, n = (end_row - row) * block_size;
+        if (ret == 0 && others_in_sync(-1, off, n)) {
+            struct member_io io[16];
+            int io_dev[16];
+            for (int i=0; i < dev_total; i++) {
+                io[i] = (struct member_io){ .op = MEMBER_PUNCH, .len = n, .offset = off };
+                io_dev[i] = i;
+            }
+            uint32_t failed = run_batch(io, io_dev, dev_total);
+            if (failed & (failed - 1)) {
+                fprintf(stderr, "Trim error at row %lu: more than one device failed\n", row);
+                ret = -1;
+            }
+        } else if (ret == 0) {
+            ret = trim_blocks((end_row - row) * row_bytes, from + done, scratch, zeros);
+        }
+        done += (end_row - row) * row_bytes;
+    }
+    if (ret == 0 && done < len) {
+        ret = trim_blocks(len - done, from + done, scratch, zeros);
+    }
+    pthread_mutex_unlock(&array_lock);
+    pthread_rwlock_unlock(&layout_lock);
+    free(scratch);
+    free(zeros);
+    return ret;
+}
+
+/* Called by the member layer when a device fails; the spare thread takes it from there. */
+static void device_failed(struct member *m) {
+    UNUSED(m);
+    pthread_mutex_lock(&spare_lock);
+    spare_wanted = true;
+    pthread_cond_signal(&spare_cond);
+    pthread_mutex_unlock(&spare_lock);
+}
+
+/* Recompute [pos, end) of member f from all the others. Where every other
+ * member is a hole the result is zeros, so f gets a hole there too. */
+static int rebuild_chunk(int f, uint64_t pos, uint64_t end, char *buf) {
+    bool sparse = true;
+    for (int i=0; i < dev_total && sparse; i++) {
+        uint64_t data, hole;
+        if (i != f && sparse_next_data(dev[i].fd, pos, end, &data, &hole) != 1) sparse = false;
+    }
+    if (sparse) {
+        if (member_punch(&dev[f], pos, end - pos) != 0) {
+            perror("rebuild_punch");
+            member_fail(&dev[f]);
+            return -1;
+        }
+        return 0;
+    }
+    if (reconstruct(f, buf, end - pos, pos, MEMBER_QOS_REBUILD) != 0) {
+        return -1;
+    }
+    struct member_io io = { .op = MEMBER_WRITE, .buf = buf, .len = end - pos, .offset = pos, .qos = MEMBER_QOS_REBUILD };
+    return member_run(&dev[f], &io) < 0 ? -1 : 0;
+}
+
+/* Bring member f up to date while the array stays online. Writes keep
+ * updating f throughout, so only the chunk being recomputed has to be
+ * locked, and reads use f for everything below its rebuilt mark. */
+static int rebuild_online(int f) {
+    char *buf = malloc(REBUILD_CHUNK);
+    if (buf == NULL) {
+        perror("rebuild");
+        return -1;
+    }
+    for (uint64_t pos = 0; pos < raid_device_size; pos += REBUILD_CHUNK) {
+        uint64_t end = raid_device_size - pos < REBUILD_CHUNK ? raid_device_size : pos + REBUILD_CHUNK;
+        pthread_mutex_lock(&array_lock);
+        int r = rebuild_chunk(f, pos, end, buf);
+        if (r == 0) {
+            member_set_rebuilt(&dev[f], end);
+            PROBE3(rebuild, f, end, raid_device_size);
+        }
+        pthread_mutex_unlock(&array_lock);
+        if (r != 0) {
+            fprintf(stderr, "Online rebuild of device %d stopped at offset %lu: %s\n", f, pos,
+                    member_ok(&dev[f]) ? "another device failed, the array is lost" : "the new device failed");
+            free(buf);
+            return -1;
+        }
+        qos_wait(MEMBER_QOS_REBUILD, end - pos);
+    }
+    member_set_rebuilt(&dev[f], UINT64_MAX);
+    free(buf);
+    return 0;
+}
+
+/* Waits for a device to fail, swaps the hot spare in for it and rebuilds it. */
+static void *spare_thread(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&spare_lock);
+    while (!spare_wanted) {
+        pthread_cond_wait(&spare_cond, &spare_lock);
+    }
+    pthread_mutex_unlock(&spare_lock);
+
+    int f = -1;
+    for (int i=0; i<dev_total && f == -1; i++) {
+        if (!member_ok(&dev[i])) f = i;
+    }
+    if (f == -1) {
+        return NULL;
+    }
+    fprintf(stderr, "Activating hot spare '%s' in place of device %d, rebuilding in the background...\n", spare_path, f);
+    pthread_mutex_lock(&array_lock); // no write is half-way through the old member while we swap
+    int r = member_replace(&dev[f], spare_fd, spare_path, spare_csum);
+    pthread_mutex_unlock(&array_lock);
+    if (r == 0 && rebuild_online(f) == 0) {
+        fprintf(stderr, "Rebuild of device %d onto '%s' complete, array is no longer degraded.\n", f, spare_path);
+    }
+    return NULL;
+}
+
+/* Verify that parity is the XOR of the data over [pos, end) of every member.
+ * Blocks that don't match get their parity rewritten, since without
+ * checksums there is no telling which member is wrong; a range one member
+ * can't read is recomputed from the others and written back. Windows the
+ * array can't verify (degraded, rebuilding, reshaping) are skipped. */
+static void scrub_window(struct scrub *sc, uint64_t pos, uint64_t end, char *bufs) {
+    uint64_t len = end - pos;
+    struct member_io io[16];
+    int io_dev[16];
+    void *parts[16];
+
+    pthread_mutex_lock(&array_lock);
+    if (reshape_running(&geo)) {
+        pthread_mutex_unlock(&array_lock); // rows between the two layouts hold stale parity
+        return;
+    }
+    bool sparse = true;
+    for (int i=0; i < dev_total; i++) {
+        uint64_t data, hole;
+        if (!member_in_sync(&dev[i], pos, len)) {
+            pthread_mutex_unlock(&array_lock);
+            return;
+        }
+        if (sparse_next_data(dev[i].fd, pos, end, &data, &hole) != 1) sparse = false;
+    }
+    if (sparse) {
+        pthread_mutex_unlock(&array_lock); // all zeros, which is consistent parity
+        return;
+    }
+
+    for (int i=0; i < dev_total; i++) {
+        parts[i] = bufs + (uint64_t)i*SCRUB_WINDOW;
+        io[i] = (struct member_io){ .op = MEMBER_READ, .buf = parts[i], .len = len, .offset = pos, .qos = MEMBER_QOS_SCRUB };
+        io_dev[i] = i;
+    }
+    uint32_t failed = run_batch(io, io_dev, dev_total);
+    char *expect = bufs + (uint64_t)dev_total*SCRUB_WINDOW;
+
+    if (failed == 0) {
+        void *data[16];
+        int ndata = 0;
+        for (int i=0; i < dev_total; i++) {
+            if (i != parity_dev) data[ndata++] = parts[i];
+        }
+        xor_blocks(expect, data, ndata, len);
+        for (uint64_t b = 0; b < len; b += block_size) {
+            uint64_t bl = len - b < (uint64_t)block_size ? len - b : (uint64_t)block_size;
+            if (memcmp(expect + b, (char *)parts[parity_dev] + b, bl) == 0) continue;
+            sc->mismatches++;
+            fprintf(stderr, "Scrub: parity mismatch at offset %lu of every device, rewriting parity\n", pos + b);
+            struct member_io fix = { .op = MEMBER_WRITE, .buf = expect + b, .len = bl, .offset = pos + b, .qos = MEMBER_QOS_SCRUB };
+            if (member_run(&dev[parity_dev], &fix) >= 0) sc->repaired++;
+        }
+    } else if ((failed & (failed - 1)) == 0) {
+        // exactly one member couldn't be read: rebuild that range from the others
+        int bad = __builtin_ctz(failed);
+        sc->read_errors++;
+        for (int i=bad; i < dev_total - 1; i++) {
+            parts[i] = parts[i + 1];
+        }
+        xor_blocks(expect, parts, dev_total - 1, len);
+        struct member_io fix = { .op = MEMBER_WRITE, .buf = expect, .len = len, .offset = pos, .qos = MEMBER_QOS_SCRUB };
+        if (member_ok(&dev[bad])) member_run(&dev[bad], &fix);
+    } else {
+        sc->read_errors++;
+        fprintf(stderr, "Scrub: several devices failed to read offset %lu, can't repair it\n", pos);
+    }
+    pthread_mutex_unlock(&array_lock);
+}
+
+/* Verifies parity in the background, forever. */
+static void *scrub_thread(void *arg) {
+    UNUSED(arg);
+    char *bufs = malloc((uint64_t)(16 + 1) * SCRUB_WINDOW); // devices may be added while we run
+    if (bufs == NULL) {
+        perror("scrub");
+        return NULL;
+    }
+    for (;;) {
+        struct scrub sc;
+        scrub_begin(&sc, "raid4", raid_device_size * dev_total, scrub_mbps);
+        for (uint64_t pos = 0; pos < raid_device_size; pos += SCRUB_WINDOW) {
+            uint64_t end = raid_device_size - pos < SCRUB_WINDOW ? raid_device_size : pos + SCRUB_WINDOW;
+            scrub_window(&sc, pos, end, bufs);
+            scrub_throttle(&sc, (end - pos) * dev_total);
+        }
+        scrub_end(&sc);
+        sleep(SCRUB_INTERVAL);
+    }
+    return NULL;
+}
+
+/* Move the n blocks at geo.pos from the old layout to the new one, recompute
+ * the parity of the new rows they land in, and make it all durable. */
+static int reshape_move(uint64_t n, char *buf) {
+    struct member_io io[RESHAPE_MAX_WINDOW];
+    int io_dev[RESHAPE_MAX_WINDOW];
+    uint64_t row;
+
+    for (uint64_t k=0; k<n; k++) {
+        io_dev[k] = reshape_place(&geo, geo.pos + k, geo.old_ndata, &row);
+        io[k] = (struct member_io){ .op = MEMBER_READ, .buf = buf + k*block_size, .len = block_size, .offset = row * block_size };
+    }
+    if (run_all(io, io_dev, n) != 0) {
+        return -1;
+    }
+    for (uint64_t k=0; k<n; k++) {
+        io_dev[k] = reshape_place(&geo, geo.pos + k, geo.new_ndata, &row);
+        io[k] = (struct member_io){ .op = MEMBER_WRITE, .buf = buf + k*block_size, .len = block_size, .offset = row * block_size };
+    }
+    if (run_all(io, io_dev, n) != 0) {
+        return -1;
+    }
+
+    // parity is the XOR of whatever the data members now hold in those rows,
+    // including blocks that are still waiting to be moved there
+    uint64_t row_from = geo.pos / geo.new_ndata, row_to = (geo.pos + n - 1) / geo.new_ndata;
+    size_t span = (row_to - row_from + 1) * block_size;
+    char *rows = malloc(span * (dev_total + 1));
+    if (rows == NULL) {
+        perror("reshape");
+        return -1;
+    }
+    void *parts[16];
+    int k = 0;
+    for (int i=0; i < dev_total; i++) {
+        if (i == parity_dev) continue;
+        parts[k] = rows + k*span;
+        io[k] = (struct member_io){ .op = MEMBER_READ, .buf = parts[k], .len = span, .offset = row_from * block_size };
+        io_dev[k++] = i;
+    }
+    int r = run_all(io, io_dev, k);
+    if (r == 0) {
+        char *parity = rows + k*span;
+        xor_blocks(parity, parts, k, span);
+        struct member_io w = { .op = MEMBER_WRITE, .buf = parity, .len = span, .offset = row_from * block_size };
+        r = member_run(&dev[parity_dev], &w) < 0 ? -1 : 0;
+    }
+    free(rows);
+    if (r != 0) {
+        return -1;
+    }
+
+    for (int i=0; i<dev_total; i++) {
+        io[i] = (struct member_io){ .op = MEMBER_FSYNC }; // durable before the checkpoint moves past them
+        io_dev[i] = i;
+    }
+    return run_all(io, io_dev, dev_total);
+}
+
+/* Restripes the array onto the added device one window at a time, then grows
+ * the exported size. Only this thread changes geo while it runs. */
+static void *reshape_thread(void *arg) {
+    UNUSED(arg);
+    char *buf = malloc((size_t)RESHAPE_MAX_WINDOW * block_size);
+    if (buf == NULL) {
+        perror("reshape");
+        return NULL;
+    }
+    fprintf(stderr, "Reshape: restriping from %u to %u data devices, %lu of %lu blocks to go...\n",
+            geo.old_ndata, geo.new_ndata, geo.total - geo.pos, geo.total);
+    int reported = geo.pos * 10 / geo.total;
+    while (reshape_running(&geo)) {
+        uint64_t n = reshape_window(&geo);
+        pthread_rwlock_wrlock(&layout_lock);
+        pthread_mutex_lock(&array_lock); // keeps the rebuild and the scrubber out too
+        int r = -1;
+        if (others_in_sync(-1, 0, raid_device_size)) { // every member, data and parity
+            r = reshape_move(n, buf);
+        }
+        if (r == 0) {
+            geo.pos += n;
+            r = reshape_save(&geo);
+        }
+        pthread_mutex_unlock(&array_lock);
+        pthread_rwlock_unlock(&layout_lock);
+        if (r != 0) {
+            fprintf(stderr, "Reshape stopped at block %lu; restart the array to resume it once every device is healthy.\n", geo.pos);
+            free(buf);
+            return NULL;
+        }
+        if ((int)(geo.pos * 10 / geo.total) > reported) {
+            reported = geo.pos * 10 / geo.total;
+            fprintf(stderr, "Reshape: %d%% done\n", reported * 10);
+        }
+    }
+    free(buf);
+
+    // everything is in the new layout now, which also covers the rest of the added device
+    pthread_rwlock_wrlock(&layout_lock);
+    pthread_mutex_lock(&array_lock);
+    geo.old_ndata = geo.new_ndata;
+    geo.pos = geo.total = 0;
+    reshape_save(&geo); // if this fails, the next start sees pos == total and finishes the same way
+    pthread_mutex_unlock(&array_lock);
+    pthread_rwlock_unlock(&layout_lock);
+    uint64_t size = raid_device_size * geo.new_ndata;
+    // the wrappers took the size and stripe width when they were set up
+    if (ra) readahead_resize(ra, size);
+    if (wbcache) wbcache_resize(wbcache, size, (uint64_t)block_size * geo.new_ndata);
+    if (cache) cache_resize(cache, size);
+    if (buse_set_size(size) != 0) {
+        perror("Reshape: can't grow the nbd device (it will have the new size after a restart)");
+    }
+    fprintf(stderr, "Reshape complete, RAID device resulting size: %lu.\n", size);
+    return NULL;
+}
+
+static int start_reshape(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reshape_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
     return 0;
 }
-*/
+
+/* Add the device at path to the array as a data device and start restriping
+ * onto it. It is zeroed first, so every row keeps XORing to zero across all
+ * the members and parity stays valid in both layouts. */
+static void add_device(const char *path, FILE *reply) {
+    if (geo.path == NULL) {
+        fprintf(reply, "ERROR adding a device needs a --state file\n");
+        return;
+    }
+    if (reshape_running(&geo)) {
+        fprintf(reply, "ERROR a reshape is already running\n");
+        return;
+    }
+    if (dev_total == 16) {
+        fprintf(reply, "ERROR the array already has 16 devices\n");
+        return;
+    }
+    if (!others_in_sync(-1, 0, raid_device_size)) {
+        fprintf(reply, "ERROR the array is degraded or rebuilding\n");
+        return;
+    }
+    char *dev_path = strdup(path); // the member keeps it
+    int fd = dev_path ? open(dev_path, O_RDWR) : -1;
+    if (fd < 0) {
+        fprintf(reply, "ERROR %s: %s\n", path, strerror(errno));
+        free(dev_path);
+        return;
+    }
+    struct member *m = &dev[dev_total];
+    m->index = dev_total;
+    uint64_t size = lseek(fd, 0, SEEK_END);
+    m->csum = NULL;
+    if (integrity) {
+        if ((m->csum = csum_open(fd, dev_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+            fprintf(reply, "ERROR can't set up the checksum table of %s\n", path);
+            close(fd);
+            free(dev_path);
+            return;
+        }
+        size = m->csum->data_size;
+    }
+    m->on_fail = device_failed;
+    if (size < raid_device_size || member_start(m, fd, dev_path) != 0) {
+        fprintf(reply, "ERROR %s is smaller than the other devices, or unusable\n", path);
+        if (m->csum) csum_close(m->csum);
+        close(fd);
+        free(dev_path);
+        return;
+    }
+    if (member_punch(m, 0, raid_device_size) != 0) {
+        fprintf(reply, "ERROR can't zero %s\n", path);
+        member_stop(m);
+        if (m->csum) csum_close(m->csum);
+        close(fd);
+        free(dev_path);
+        return;
+    }
+
+    struct reshape next = geo;
+    next.ndevs = dev_total + 1;
+    next.new_ndata = geo.old_ndata + 1;
+    next.pos = 0;
+    next.total = raid_device_size / block_size * geo.old_ndata;
+    pthread_rwlock_wrlock(&layout_lock);
+    pthread_mutex_lock(&array_lock);
+    int r = reshape_save(&next); // the new geometry is on disk before any block moves
+    if (r == 0) {
+        geo = next;
+        dev_total++;
+    }
+    pthread_mutex_unlock(&array_lock);
+    pthread_rwlock_unlock(&layout_lock);
+    if (r != 0) {
+        fprintf(reply, "ERROR can't write the state file %s\n", geo.path);
+        member_stop(m);
+        if (m->csum) csum_close(m->csum);
+        close(fd);
+        free(dev_path);
+        return;
+    }
+    fprintf(stderr, "Added device '%s' as device %d.\n", dev_path, dev_total - 1);
+    if (start_reshape() != 0) {
+        fprintf(reply, "ERROR can't start the reshape thread, restart the array to resume it\n");
+        return;
+    }
+    fprintf(reply, "OK restriping onto %u data devices\n", geo.new_ndata);
+}
+
+/* Commands on the control socket. */
+static void control(int argc, char **argv, FILE *reply) {
+    if (strcmp(argv[0], "add") == 0 && argc == 2) {
+        add_device(argv[1], reply);
+    } else if (strcmp(argv[0], "status") == 0 && argc == 1) {
+        pthread_rwlock_rdlock(&layout_lock);
+        fprintf(reply, "devices %d parity %d size %lu", dev_total, parity_dev, raid_device_size * geo.old_ndata);
+        if (reshape_running(&geo)) {
+            fprintf(reply, " reshape %lu/%lu", geo.pos, geo.total);
+        }
+        fprintf(reply, "\n");
+        pthread_rwlock_unlock(&layout_lock);
+        if (ra != NULL) {
+            readahead_report(ra, reply);
+        }
+        if (cache != NULL) {
+            cache_report(cache, reply);
+        }
+        if (wbcache != NULL) {
+            wbcache_report(wbcache, reply);
+        }
+    } else {
+        fprintf(reply, "ERROR unknown command '%s' (commands: add DEVICE, status)\n", argv[0]);
+    }
+}
 
 /* argument parsing using argp */
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"hedge", 'H', "USEC", 0, "Reconstruct a read from the other devices when it takes longer than the device's recent p99 latency, but at least USEC (0 disables, the default)", 0},
+    {"spare", 'S', "DEVICE", 0, "Hot spare: when a device fails (or is MISSING), DEVICE takes its place and is rebuilt in the background", 0},
+    {"retries", 'r', "COUNT", 0, "Retry I/Os that fail with a transient error COUNT times (default 3)", 0},
+    {"max-errors", 'e', "COUNT", 0, "Fail a device after COUNT read errors that retrying didn't fix (default 10); write errors fail it right away", 0},
+    {"integrity", 'I', 0, 0, "Keep a CRC32C of every 4 KiB block in a table at the end of each device, verify it on every read, and treat a mismatch like a read error", 0},
+    {"scrub", 'c', "MBPS", 0, "Verify parity in the background at up to MBPS MB/s, backing off while clients are busy, and repair mismatches (0 disables, the default)", 0},
+    {"control", 'C', "SOCKET", 0, "Accept commands (\"add DEVICE\", \"status\") on the Unix socket SOCKET", 0},
+    {"state", 's', "FILE", 0, "Keep the array geometry and reshape progress in FILE; needed to add devices, and on every start after that", 0},
+    {"readahead", 'A', "KB", 0, "Detect sequential readers and read up to KB kilobytes ahead of each (0 disables, the default)", 0},
+    {"cache", 'M', "MB", 0, "Keep a read cache of MB megabytes in memory in front of the array (0 disables, the default)", 0},
+    {"wb-cache", 'B', "FILE", 0, "Use the fast device or file FILE as a write-back cache: writes are acknowledged once logged there and destaged to the array in the background", 0},
+    {"stats", 'T', "SOCKET", 0, "Serve latency histograms and counters for requests and for each device on the Unix socket SOCKET (read them with buse-stat)", 0},
+    {"trace", 'R', "FILE", 0, "Record every request (type, offset, length, timing) in the binary trace FILE, for buse-replay", 0},
+    {"trace-hashes", 'X', 0, 0, "With --trace, also record a CRC32C of the data of every read and write", 0},
+    {"log", 'L', "FILE", 0, "Write the -v request log to the binary FILE instead of stderr, for buse-log (implies -v)", 0},
+    {"merge-window", 'G', "USEC", 0, "Hold requests for up to USEC microseconds to merge adjacent reads and writes into larger ones (raid4: into full-stripe writes)", 0},
+    {"latency-target", 'Q', "USEC", 0, "Slow the background rebuild and scrub down while the p99 latency of client reads on any device is above USEC microseconds (0, the default: whenever clients are busy)", 0},
+    {"rebuild-rate", 'U', "MBPS", 0, "Rebuild a replaced device online at up to MBPS MB/s, less while clients need the devices (0, the default: unlimited)", 0},
     {0},
 };
 
@@ -242,6 +1116,24 @@ struct arguments {
     char* device[16];
     char* raid_device;
     int verbose;
+    uint32_t hedge_min_us;
+    char* spare;
+    int retries;
+    int max_errors;
+    uint32_t scrub_mbps;
+    int integrity;
+    char* control;
+    char* state;
+    uint32_t readahead_kb;
+    uint32_t cache_mb;
+    char *wb_cache;
+    char *stats;
+    char *trace;
+    int trace_hashes;
+    char *log;
+    uint32_t merge_window_us;
+    uint32_t latency_target_us;
+    uint32_t rebuild_mbps;
 };
 
 /* Parse a single option. */
@@ -255,6 +1147,113 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 'H':
+            arguments->hedge_min_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "hedge USEC must be an integer");
+            }
+            break;
+
+        case 'S':
+            arguments->spare = arg;
+            break;
+
+        case 'r':
+            arguments->retries = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "retries COUNT must be an integer");
+            }
+            break;
+
+        case 'e':
+            arguments->max_errors = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->max_errors == 0) {
+                errx(EXIT_FAILURE, "max-errors COUNT must be a positive integer");
+            }
+            break;
+
+        case 'I':
+            arguments->integrity = 1;
+            break;
+
+        case 'c':
+            arguments->scrub_mbps = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "scrub MBPS must be an integer");
+            }
+            break;
+
+        case 'C':
+            arguments->control = arg;
+            break;
+
+        case 's':
+            arguments->state = arg;
+            break;
+
+        case 'B':
+            arguments->wb_cache = arg;
+            break;
+
+        case 'T':
+            arguments->stats = arg;
+            break;
+
+        case 'R':
+            arguments->trace = arg;
+            break;
+
+        case 'X':
+            arguments->trace_hashes = 1;
+            break;
+
+        case 'L':
+            arguments->log = arg;
+            break;
+
+        case 'G':
+            arguments->merge_window_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "merge window must be an integer");
+            }
+            break;
+
+        case 'Q':
+            arguments->latency_target_us = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "latency target must be an integer");
+            }
+            break;
+
+        case 'U':
+            arguments->rebuild_mbps = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "rebuild MBPS must be an integer");
+            }
+            break;
+
+        case 'A':
+            arguments->readahead_kb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "readahead KB must be an integer");
+            }
+            break;
+
+        case 'M':
+            arguments->cache_mb = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0') {
+                /* failed to parse integer */
+                errx(EXIT_FAILURE, "cache MB must be an integer");
+            }
+            break;
+
         case ARGP_KEY_ARG: // parsing arguments after options
             if (state->arg_num == 0){
                 arguments->block_size = strtoul(arg, &endptr, 10);
@@ -308,6 +1307,9 @@ static struct argp argp = {
            "\n\n"
            "If you prepend '+' to a DEVICE, you are re-adding it as a replacement to the RAID, and we will rebuild the array. "
            "This is synchronous; the rebuild will have to finish before the RAID is started. "
+           "\n\n"
+           "A device added with \"add DEVICE\" on the --control socket becomes a data device of the running array and is striped into it in the background; "
+           "the array grows once that is done. List it last on later starts, the --state file remembers which device holds parity. "
 };
 
 static int do_raid_rebuild() {
@@ -316,34 +1318,25 @@ static int do_raid_rebuild() {
     char result_buf[block_size];
     memset(buf, 0, block_size); 
 
-    //lseek(dev_fd[source_dev],0,SEEK_SET);
-    //lseek(dev_fd[rebuild_dev],0,SEEK_SET);
+    //lseek(dev[source_dev].fd,0,SEEK_SET);
+    //lseek(dev[rebuild_dev].fd,0,SEEK_SET);
     
     // simple block copy
     for (uint64_t cursor=0; cursor<raid_device_size; cursor+=block_size) {
-        int r;
         memset(result_buf, 0, block_size); 
         for(int i=0; i < dev_total; i++){
             if (i == rebuild_dev) continue;
-            r = pread(dev_fd[i], buf, block_size, cursor);
-            for(int j = 0; j < block_size; j++){
-                result_buf[j] ^= buf[j];
-            }
-            if (r<0) {
-                perror("rebuild_read");
+            struct member_io rd = { .op = MEMBER_READ, .buf = buf, .len = block_size, .offset = cursor };
+            if (member_run(&dev[i], &rd) < 0) { // through the member layer, so checksums are verified
+                fprintf(stderr, "rebuild_read: %s, offset=%zu\n", strerror(rd.error), cursor);
                 return -1;
-            } else if (r != block_size) {
-                fprintf(stderr, "rebuild_read: short read (%d bytes), offset=%zu\n", r, cursor);
-                return 1;
             }
+            xor_into(result_buf, buf, block_size);
         }
-        r = pwrite(dev_fd[rebuild_dev],result_buf,block_size,cursor);
-        if (r<0) {
-            perror("rebuild_write");
+        struct member_io wr = { .op = MEMBER_WRITE, .buf = result_buf, .len = block_size, .offset = cursor };
+        if (member_run(&dev[rebuild_dev], &wr) < 0) {
+            fprintf(stderr, "rebuild_write: %s, offset=%zu\n", strerror(wr.error), cursor);
             return -1;
-        } else if (r != block_size) {
-            fprintf(stderr, "rebuild_write: short write (%d bytes), offset=%zu\n", r, cursor);
-            return 1;
         }
     }
     degraded_dev = -1;
@@ -354,6 +1347,8 @@ static int do_raid_rebuild() {
 int main(int argc, char *argv[]) {
     struct arguments arguments = {
         .verbose = 0,
+        .retries = 3,
+        .max_errors = 10,
     };
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     
@@ -362,11 +1357,22 @@ int main(int argc, char *argv[]) {
         .write = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
-        // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
+        .trim = xmp_trim,
     };
 
-    verbose = arguments.verbose;
     block_size = arguments.block_size;
+    integrity = arguments.integrity;
+    if (arguments.integrity && block_size % CSUM_BLOCK_SIZE != 0) {
+        fprintf(stderr, "ERROR: --integrity needs a BLOCKSIZE that is a multiple of %d.\n", CSUM_BLOCK_SIZE);
+        exit(1);
+    }
+    hedge_min_us = arguments.hedge_min_us;
+    member_retries = arguments.retries;
+    member_max_errors = arguments.max_errors;
+    qos_members(dev, &dev_total);
+    qos_target_us = arguments.latency_target_us;
+    qos_set_cap(MEMBER_QOS_REBUILD, arguments.rebuild_mbps);
+    scrub_mbps = arguments.scrub_mbps;
     raid_device_size=0; // will be detected from the drives available
     bool rebuild_needed = false; // will be set to true if a drive is MISSING
     printf("device count: %d\n", dev_total);
@@ -378,7 +1384,7 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
             degraded = true;
-            dev_fd[i] = -1;
+            dev[i].fd = -1;
             degraded_dev = i;
             fprintf(stderr, "DEGRADED: Device number %d is missing!\n", i);
         } else {
@@ -392,28 +1398,54 @@ int main(int argc, char *argv[]) {
                 rebuild_dev = i;
                 rebuild_needed = true;
             }
-            dev_fd[i] = open(dev_path,O_RDWR);
-            if (dev_fd[i] < 0) {
+            dev[i].fd = open(dev_path,O_RDWR);
+            if (dev[i].fd < 0) {
                 perror(dev_path);
                 exit(1);
             }
-            uint64_t size = lseek(dev_fd[i],0,SEEK_END); // used to find device size by seeking to end
+            uint64_t size = lseek(dev[i].fd,0,SEEK_END); // used to find device size by seeking to end
+            if (arguments.integrity) {
+                if ((dev[i].csum = csum_open(dev[i].fd, dev_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+                    exit(1);
+                }
+                size = dev[i].csum->data_size; // the checksum table lives at the end
+            }
             fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
             if (raid_device_size==0 || size<raid_device_size) {
                 raid_device_size = size; // raid_device_size is minimum size of available devices
             }
         }
-
+        dev[i].on_fail = device_failed;
+        dev[i].index = i;
+        if (member_start(&dev[i], dev[i].fd, dev_path) != 0) {
+            exit(1);
+        }
+    }
+    // the geometry comes from the state file once devices were added, otherwise parity is the last device
+    geo = (struct reshape){ .path = arguments.state, .ndevs = dev_total, .parity = dev_total - 1, .old_ndata = dev_total - 1, .new_ndata = dev_total - 1 };
+    if (arguments.state) {
+        int r = reshape_load(&geo, arguments.state);
+        if (r < 0) {
+            exit(1);
+        }
+        if (r == 0 && (geo.ndevs != (uint32_t)dev_total || geo.parity >= geo.ndevs)) {
+            fprintf(stderr, "ERROR: '%s' describes an array of %u devices, but %d were given.\n", arguments.state, geo.ndevs, dev_total);
+            exit(1);
+        }
+    }
+    if (!reshape_running(&geo)) {
+        geo.old_ndata = geo.new_ndata; // a reshape that got to the end but wasn't marked done
+        geo.pos = geo.total = 0;
     }
-    parity_dev = dev_total - 1;
-    if (dev_fd[parity_dev] != -1){
+    parity_dev = geo.parity;
+    if (dev[parity_dev].fd != -1){
         fprintf(stderr, "Assigning '%s' as parity.\n", arguments.device[parity_dev]);
     }else{
         fprintf(stderr, "Parity is missing.\n");
     }
 
     raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
-    bop.size = raid_device_size * (dev_total - 1); // tell BUSE how big our block device is
+    bop.size = raid_device_size * geo.old_ndata; // tell BUSE how big our block device is
     bop.blksize = arguments.block_size;
     if (rebuild_needed) {
         if (degraded) {
@@ -427,7 +1459,66 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
     }
+    if (arguments.spare) {
+        spare_path = arguments.spare;
+        spare_fd = open(spare_path, O_RDWR);
+        if (spare_fd < 0) {
+            perror(spare_path);
+            exit(1);
+        }
+        uint64_t size = lseek(spare_fd, 0, SEEK_END);
+        if (arguments.integrity) {
+            if ((spare_csum = csum_open(spare_fd, spare_path, CSUM_BLOCK_SIZE, size)) == NULL) {
+                exit(1);
+            }
+            size = spare_csum->data_size;
+        }
+        if (size < raid_device_size) {
+            fprintf(stderr, "ERROR: Hot spare '%s' is smaller than the other devices.\n", spare_path);
+            exit(1);
+        }
+        spare_wanted = degraded; // a MISSING device is replaced right away
+        pthread_t spare;
+        if (pthread_create(&spare, NULL, spare_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: can't start the hot spare thread.\n");
+            exit(1);
+        }
+    }
+    if (arguments.control && control_start(arguments.control, control) != 0) {
+        exit(1);
+    }
+    if (reshape_running(&geo) && start_reshape() != 0) {
+        fprintf(stderr, "ERROR: can't start the reshape thread.\n");
+        exit(1);
+    }
+    if (scrub_mbps > 0) {
+        pthread_t scrubber;
+        if (pthread_create(&scrubber, NULL, scrub_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: can't start the scrub thread.\n");
+            exit(1);
+        }
+    }
     fprintf(stderr, "RAID device resulting size: %ld.\nRAID device: %s\n", bop.size, arguments.raid_device);
     
-    return buse_main(arguments.raid_device, &bop, NULL);
+    if (arguments.stats && stats_start(arguments.stats, dev, &dev_total) != 0) {
+        exit(1);
+    }
+    if (arguments.trace && buse_trace(arguments.trace, arguments.trace_hashes) != 0) {
+        exit(1);
+    }
+    if ((arguments.verbose || arguments.log) && evlog_open(arguments.log) != 0) {
+        exit(1);
+    }
+    buse_merge(arguments.merge_window_us);
+    void *userdata = NULL;
+    if (arguments.readahead_kb > 0 && (ra = readahead_wrap(&bop, &userdata, (uint64_t)arguments.readahead_kb << 10)) == NULL) {
+        exit(1);
+    }
+    if (arguments.wb_cache && (wbcache = wbcache_wrap(&bop, &userdata, arguments.wb_cache, (uint64_t)block_size * geo.new_ndata)) == NULL) {
+        exit(1);
+    }
+    if (arguments.cache_mb > 0 && (cache = cache_wrap(&bop, &userdata, (uint64_t)arguments.cache_mb << 20)) == NULL) {
+        exit(1);
+    }
+    return buse_main(arguments.raid_device, &bop, userdata);
 }
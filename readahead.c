@@ -0,0 +1,304 @@
+/*
+ * readahead - sequential stream detection and readahead for the backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readahead.h"
+
+enum { RA_EMPTY, RA_QUEUED, RA_LOADING, RA_READY };
+
+struct ra_slot {
+    char *buf;         // max_window bytes, allocated on first use
+    uint64_t off, len;
+    uint64_t consumed; // end of the part the stream has read
+    int state;
+    bool stale;        // a write hit the range while it was loading, drop it when it lands
+};
+
+struct ra_stream {
+    uint64_t next;     // offset a sequential read would start at
+    uint32_t run;      // sequential reads in a row
+    uint64_t window;
+    uint64_t tick;     // last use, 0 if the stream was never used
+    struct ra_slot slot[2];
+};
+
+struct readahead {
+    struct buse_operations inner;
+    void *inner_userdata;
+    uint64_t size;
+    uint64_t max_window;
+
+    pthread_mutex_t lock;         // everything below
+    pthread_cond_t work;          // a slot was queued
+    pthread_cond_t loaded;        // a slot finished loading
+    pthread_rwlock_t backend_lock; // shared by reads, exclusive for everything that changes the data
+    struct ra_stream stream[RA_STREAMS];
+    uint64_t tick;
+
+    uint64_t reads, hits, prefetched, wasted;
+};
+
+static bool slot_holds(struct ra_slot *sl, uint64_t pos) {
+    return sl->state != RA_EMPTY && pos >= sl->off && pos < sl->off + sl->len;
+}
+
+/* Forget sl. Data that was read ahead but never used halves the window. */
+static void drop(struct readahead *ra, struct ra_stream *s, struct ra_slot *sl) {
+    if (sl->state == RA_LOADING) {
+        sl->stale = true;
+        return;
+    }
+    if (sl->state == RA_READY && sl->consumed < sl->off + sl->len) {
+        ra->wasted += sl->off + sl->len - sl->consumed;
+        s->window = s->window / 2 > RA_MIN_WINDOW ? s->window / 2 : RA_MIN_WINDOW;
+    }
+    sl->state = RA_EMPTY;
+}
+
+/* The stream offset continues, or the least recently used one, reset. */
+static struct ra_stream *find_stream(struct readahead *ra, uint64_t offset) {
+    struct ra_stream *lru = &ra->stream[0];
+    for (int k=0; k < RA_STREAMS; k++) {
+        struct ra_stream *s = &ra->stream[k];
+        if (s->tick > 0 && (s->next == offset || slot_holds(&s->slot[0], offset) || slot_holds(&s->slot[1], offset))) {
+            s->run++;
+            return s;
+        }
+        if (s->tick < lru->tick) lru = s;
+    }
+    drop(ra, lru, &lru->slot[0]);
+    drop(ra, lru, &lru->slot[1]);
+    lru->run = 0;
+    lru->window = RA_MIN_WINDOW < ra->max_window ? RA_MIN_WINDOW : ra->max_window;
+    return lru;
+}
+
+/* Queue readahead until a window's worth past the stream's position is
+ * buffered or on its way. */
+static void schedule(struct readahead *ra, struct ra_stream *s) {
+    uint64_t ahead = s->next;
+    for (int i=0; i < 2; i++) {
+        struct ra_slot *sl = &s->slot[i];
+        if (sl->state != RA_EMPTY && sl->off + sl->len <= s->next) {
+            drop(ra, s, sl); // the stream has moved past it
+        }
+        if (sl->state != RA_EMPTY && sl->off + sl->len > ahead) {
+            ahead = sl->off + sl->len;
+        }
+    }
+    for (int i=0; i < 2; i++) {
+        struct ra_slot *sl = &s->slot[i];
+        if (sl->state != RA_EMPTY || ahead - s->next >= s->window || ahead >= ra->size) {
+            continue;
+        }
+        if (sl->buf == NULL && (sl->buf = malloc(ra->max_window)) == NULL) {
+            return;
+        }
+        sl->off = ahead;
+        sl->len = ra->size - ahead < s->window ? ra->size - ahead : s->window;
+        sl->consumed = ahead;
+        sl->state = RA_QUEUED;
+        ahead += sl->len;
+        pthread_cond_signal(&ra->work);
+    }
+}
+
+static int ra_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct readahead *ra = userdata;
+    uint64_t pos = offset, end = offset + len;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->reads++;
+    struct ra_stream *s = find_stream(ra, offset);
+    s->tick = ++ra->tick;
+    s->next = end;
+    while (pos < end) {
+        struct ra_slot *sl = slot_holds(&s->slot[0], pos) ? &s->slot[0] : slot_holds(&s->slot[1], pos) ? &s->slot[1] : NULL;
+        if (sl == NULL) {
+            break;
+        }
+        if (sl->state != RA_READY) {
+            pthread_cond_wait(&ra->loaded, &ra->lock);
+            continue;
+        }
+        uint64_t to = sl->off + sl->len < end ? sl->off + sl->len : end;
+        memcpy((char *)buf + (pos - offset), sl->buf + (pos - sl->off), to - pos);
+        pos = to;
+        if (pos > sl->consumed) {
+            sl->consumed = pos;
+        }
+        if (sl->consumed == sl->off + sl->len) {
+            // read to the end: reuse the buffer and read further ahead next time
+            sl->state = RA_EMPTY;
+            s->window = s->window * 2 < ra->max_window ? s->window * 2 : ra->max_window;
+        }
+    }
+    if (pos == end) {
+        ra->hits++;
+    }
+    if (s->run >= RA_DETECT) {
+        schedule(ra, s);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if (pos == end) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&ra->backend_lock); // alongside a load in flight, not behind it
+    int r = ra->inner.read((char *)buf + (pos - offset), end - pos, pos, ra->inner_userdata);
+    pthread_rwlock_unlock(&ra->backend_lock);
+    return r;
+}
+
+/* Drop everything read ahead or loading in [from, to). The caller holds
+ * backend_lock for writing, so no load can start until the write is through. */
+static void invalidate(struct readahead *ra, uint64_t from, uint64_t to) {
+    pthread_mutex_lock(&ra->lock);
+    for (int k=0; k < RA_STREAMS; k++) {
+        for (int i=0; i < 2; i++) {
+            struct ra_slot *sl = &ra->stream[k].slot[i];
+            if (sl->state != RA_EMPTY && sl->off < to && from < sl->off + sl->len) {
+                drop(ra, &ra->stream[k], sl);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+static int ra_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct readahead *ra = userdata;
+    pthread_rwlock_wrlock(&ra->backend_lock);
+    invalidate(ra, offset, offset + len);
+    int r = ra->inner.write(buf, len, offset, ra->inner_userdata);
+    pthread_rwlock_unlock(&ra->backend_lock);
+    return r;
+}
+
+static int ra_trim(u_int64_t from, u_int32_t len, void *userdata) {
+    struct readahead *ra = userdata;
+    pthread_rwlock_wrlock(&ra->backend_lock);
+    invalidate(ra, from, from + len);
+    int r = ra->inner.trim(from, len, ra->inner_userdata);
+    pthread_rwlock_unlock(&ra->backend_lock);
+    return r;
+}
+
+static int ra_flush(void *userdata) {
+    struct readahead *ra = userdata;
+    pthread_rwlock_wrlock(&ra->backend_lock);
+    int r = ra->inner.flush(ra->inner_userdata);
+    pthread_rwlock_unlock(&ra->backend_lock);
+    return r;
+}
+
+static void ra_disc(void *userdata) {
+    struct readahead *ra = userdata;
+    if (ra->inner.disc) {
+        pthread_rwlock_wrlock(&ra->backend_lock);
+        ra->inner.disc(ra->inner_userdata);
+        pthread_rwlock_unlock(&ra->backend_lock);
+    }
+    readahead_report(ra, stderr);
+}
+
+/* Loads queued slots one at a time, each with a single backend read. */
+static void *prefetch_thread(void *arg) {
+    struct readahead *ra = arg;
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        struct ra_stream *s = NULL;
+        struct ra_slot *sl = NULL;
+        for (int k=0; k < RA_STREAMS && sl == NULL; k++) {
+            for (int i=0; i < 2 && sl == NULL; i++) {
+                if (ra->stream[k].slot[i].state == RA_QUEUED) {
+                    s = &ra->stream[k];
+                    sl = &s->slot[i];
+                }
+            }
+        }
+        if (sl == NULL) {
+            pthread_cond_wait(&ra->work, &ra->lock);
+            continue;
+        }
+        sl->state = RA_LOADING;
+        sl->stale = false;
+        uint64_t off = sl->off, len = sl->len;
+        pthread_mutex_unlock(&ra->lock);
+
+        pthread_rwlock_rdlock(&ra->backend_lock);
+        int r = ra->inner.read(sl->buf, len, off, ra->inner_userdata);
+        pthread_rwlock_unlock(&ra->backend_lock);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->prefetched += len;
+        sl->state = RA_READY;
+        if (r != 0 || sl->stale) {
+            drop(ra, s, sl); // the reader goes to the backend itself, and gets the error there
+        }
+        pthread_cond_broadcast(&ra->loaded);
+    }
+    return NULL;
+}
+
+void readahead_resize(struct readahead *ra, uint64_t size) {
+    pthread_mutex_lock(&ra->lock);
+    if (size > ra->size) {
+        ra->size = size;
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void readahead_report(struct readahead *ra, FILE *out) {
+    pthread_mutex_lock(&ra->lock);
+    fprintf(out, "readahead: %lu of %lu reads served from readahead (%.1f%%), %.1f MiB read ahead, %.1f MiB of it unused\n",
+            ra->hits, ra->reads, ra->reads ? 100.0 * ra->hits / ra->reads : 0.0, ra->prefetched / 1048576.0, ra->wasted / 1048576.0);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+struct readahead *readahead_wrap(struct buse_operations *bop, void **userdata, uint64_t max_window) {
+    if (max_window < RA_MIN_WINDOW || max_window > UINT32_MAX) {
+        fprintf(stderr, "ERROR: the readahead window must be between %d and %u bytes.\n", RA_MIN_WINDOW, UINT32_MAX);
+        return NULL;
+    }
+    struct readahead *ra = calloc(1, sizeof(*ra));
+    if (ra == NULL) {
+        perror("readahead");
+        return NULL;
+    }
+    ra->inner = *bop;
+    ra->inner_userdata = *userdata;
+    ra->size = bop->size ? bop->size : bop->size_blocks * bop->blksize;
+    ra->max_window = max_window;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work, NULL);
+    pthread_cond_init(&ra->loaded, NULL);
+    pthread_rwlock_init(&ra->backend_lock, NULL);
+
+    pthread_t prefetcher;
+    if (pthread_create(&prefetcher, NULL, prefetch_thread, ra) != 0) {
+        fprintf(stderr, "ERROR: can't start the readahead thread.\n");
+        return NULL;
+    }
+    pthread_detach(prefetcher);
+
+    bop->read = ra_read;
+    bop->write = ra_write;
+    bop->disc = ra_disc;
+    if (bop->flush) bop->flush = ra_flush;
+    if (bop->trim) bop->trim = ra_trim;
+    *userdata = ra;
+    return ra;
+}
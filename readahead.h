@@ -0,0 +1,43 @@
+#ifndef READAHEAD_H_INCLUDED
+#define READAHEAD_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buse.h"
+
+/*
+ * Sequential stream detection and readahead in front of any backend.
+ *
+ * Up to RA_STREAMS streams are tracked by the offset their next read would
+ * start at. Once a stream has made RA_DETECT reads in a row, a background
+ * thread reads ahead of it in windows, one large backend read per window,
+ * into one of the stream's two buffers. The backends split such a read over
+ * their members and submit the parts together, so the window is read from
+ * all of them at once. A window that is read to the end doubles the next
+ * one, up to the maximum. One that is dropped unused (the stream jumped, or
+ * a write hit it) halves it, down to RA_MIN_WINDOW.
+ *
+ * Client reads that miss go to the backend alongside a window being loaded.
+ * Writes and trims wait for it, and invalidate buffers and readahead in
+ * flight that overlap them.
+ */
+
+#define RA_STREAMS 8
+#define RA_DETECT 2               // sequential reads before a stream gets readahead
+#define RA_MIN_WINDOW (128*1024)
+
+struct readahead;
+
+/* Put readahead with windows of up to max_window bytes in front of *bop,
+ * which serves *userdata, as cache_wrap() does. Memory use is bounded by
+ * 2 * RA_STREAMS * max_window. Returns NULL on error (reported). */
+struct readahead *readahead_wrap(struct buse_operations *bop, void **userdata, uint64_t max_window);
+
+/* Let readahead go up to the new end of a backend that grew to size bytes. */
+void readahead_resize(struct readahead *ra, uint64_t size);
+
+/* Print how many reads readahead served and how much of it went unused. */
+void readahead_report(struct readahead *ra, FILE *out);
+
+#endif /* READAHEAD_H_INCLUDED */
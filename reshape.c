@@ -0,0 +1,70 @@
+/*
+ * reshape - checkpointed progress of an online restripe
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+#include "reshape.h"
+#include "state.h"
+
+#define RESHAPE_MAGIC "BUSERSH1"
+
+struct reshape_record {
+    uint32_t ndevs;
+    uint32_t parity;
+    uint32_t old_ndata;
+    uint32_t new_ndata;
+    uint64_t pos;
+    uint64_t total;
+};
+
+int reshape_load(struct reshape *r, const char *path) {
+    struct reshape_record rec;
+    int ret = state_load(path, RESHAPE_MAGIC, &rec, sizeof(rec));
+    if (ret != 0) {
+        return ret;
+    }
+    if (rec.old_ndata == 0 || rec.new_ndata < rec.old_ndata || rec.ndevs > 16 || rec.pos > rec.total) {
+        fprintf(stderr, "ERROR: reshape state file '%s' describes an impossible geometry.\n", path);
+        return -1;
+    }
+    r->path = path;
+    r->ndevs = rec.ndevs;
+    r->parity = rec.parity;
+    r->old_ndata = rec.old_ndata;
+    r->new_ndata = rec.new_ndata;
+    r->pos = rec.pos;
+    r->total = rec.total;
+    return 0;
+}
+
+int reshape_save(const struct reshape *r) {
+    struct reshape_record rec = {
+        .ndevs = r->ndevs,
+        .parity = r->parity,
+        .old_ndata = r->old_ndata,
+        .new_ndata = r->new_ndata,
+        .pos = r->pos,
+        .total = r->total,
+    };
+    return state_save(r->path, RESHAPE_MAGIC, &rec, sizeof(rec));
+}
+
+uint64_t reshape_window(const struct reshape *r) {
+    // Blocks at and above pos still live in old rows >= pos / old_ndata, so the
+    // window may fill new rows up to just below that. One block at a time is
+    // always safe: its destination holds itself, a block moved earlier, or nothing.
+    uint64_t row = r->pos / r->old_ndata;
+    uint64_t limit = row * r->new_ndata;
+    uint64_t n = limit > r->pos ? limit - r->pos : 1;
+    if (n > RESHAPE_MAX_WINDOW) n = RESHAPE_MAX_WINDOW;
+    if (n > r->total - r->pos) n = r->total - r->pos;
+    return n;
+}
@@ -0,0 +1,62 @@
+#ifndef RESHAPE_H_INCLUDED
+#define RESHAPE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Online restriping onto more members, for raid0 and raid4.
+ *
+ * A reshape moves the logical blocks in ascending order from the old layout
+ * (old_ndata data members) to the new one (new_ndata), one window at a time.
+ * Blocks below pos are in the new layout and the rest still in the old one,
+ * so I/O picks the layout by comparing the block number with pos. After each
+ * window the backend makes the data durable and saves pos to a state file;
+ * after a crash the last window is simply moved again. reshape_window() keeps
+ * a window's destinations clear of where any block at or above pos lives in
+ * the old layout, which is what makes redoing a window safe.
+ */
+
+#define RESHAPE_MAX_WINDOW 256 // blocks moved (with I/O locked out) at a time, at most
+
+struct reshape {
+    const char *path;   // state file, NULL if the array can't be reshaped
+    uint32_t ndevs;     // members, including the one being restriped onto
+    uint32_t parity;    // member holding parity (raid4), UINT32_MAX if there is none
+    uint32_t old_ndata; // data members in the layout at and above pos
+    uint32_t new_ndata; // data members in the layout below pos
+    uint64_t pos;       // logical blocks already moved to the new layout
+    uint64_t total;     // logical blocks to move; pos == total once the reshape is done
+};
+
+/* Read the state file at path into r. Returns 0 if it was loaded, 1 if there
+ * is no state file yet, -1 on error (reported). */
+int reshape_load(struct reshape *r, const char *path);
+
+/* Atomically replace the state file with r. Returns 0 or -1 (reported). */
+int reshape_save(const struct reshape *r);
+
+/* Blocks to move in the next window, starting at r->pos. */
+uint64_t reshape_window(const struct reshape *r);
+
+static inline bool reshape_running(const struct reshape *r) {
+    return r->pos < r->total;
+}
+
+/* Member holding the k-th data block of a row. */
+static inline uint32_t reshape_member(const struct reshape *r, uint32_t k) {
+    return k < r->parity ? k : k + 1;
+}
+
+/* Member and row (in blocks) of logical block b in a layout with ndata data members. */
+static inline uint32_t reshape_place(const struct reshape *r, uint64_t b, uint32_t ndata, uint64_t *row) {
+    *row = b / ndata;
+    return reshape_member(r, b % ndata);
+}
+
+/* Member and row of logical block b in whichever layout currently holds it. */
+static inline uint32_t reshape_locate(const struct reshape *r, uint64_t b, uint64_t *row) {
+    return reshape_place(r, b, b < r->pos ? r->new_ndata : r->old_ndata, row);
+}
+
+#endif /* RESHAPE_H_INCLUDED */
@@ -0,0 +1,50 @@
+/*
+ * scrub - pacing and reporting for background array verification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "qos.h"
+#include "scrub.h"
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void scrub_begin(struct scrub *s, const char *name, uint64_t total, uint32_t rate_mbps) {
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->total = total;
+    s->start_us = now_us();
+    qos_set_cap(MEMBER_QOS_SCRUB, rate_mbps);
+    fprintf(stderr, "%s: scrub started, %lu bytes at up to %u MB/s\n", name, total, rate_mbps);
+}
+
+void scrub_throttle(struct scrub *s, uint64_t bytes) {
+    s->done += bytes;
+
+    int pct = s->total ? s->done * 100 / s->total : 100;
+    if (pct / 10 > s->reported / 10 && pct < 100) {
+        s->reported = pct;
+        fprintf(stderr, "%s: scrub %d%% done, %lu mismatches (%lu repaired), %lu read errors\n",
+                s->name, pct, s->mismatches, s->repaired, s->read_errors);
+    }
+
+    qos_wait(MEMBER_QOS_SCRUB, bytes);
+}
+
+void scrub_end(struct scrub *s) {
+    fprintf(stderr, "%s: scrub finished in %lu s, %lu mismatches (%lu repaired), %lu read errors\n",
+            s->name, (now_us() - s->start_us) / 1000000, s->mismatches, s->repaired, s->read_errors);
+}
@@ -0,0 +1,36 @@
+#ifndef SCRUB_H_INCLUDED
+#define SCRUB_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Pacing and reporting for the background scrubbers.
+ *
+ * A scrub pass walks the whole array window by window; after each window the
+ * backend calls scrub_throttle(), which paces the pass as the scrub QoS class
+ * (see qos.h): at most its MB/s cap, less while clients need the members.
+ */
+
+struct scrub {
+    const char *name;
+    uint64_t total;       // bytes to scrub in this pass
+    uint64_t done;        // bytes scrubbed so far
+    uint64_t start_us;    // pass start
+    int reported;         // last progress percentage printed
+
+    uint64_t mismatches;  // blocks whose copies or parity didn't agree
+    uint64_t repaired;    // of those, rewritten from redundancy
+    uint64_t read_errors; // ranges a member failed to read, rewritten when possible
+};
+
+/* Start a pass over total bytes at up to rate_mbps MB/s. */
+void scrub_begin(struct scrub *s, const char *name, uint64_t total, uint32_t rate_mbps);
+
+/* Account bytes just scrubbed, print progress every 10%, and sleep as
+ * qos_wait() requires. */
+void scrub_throttle(struct scrub *s, uint64_t bytes);
+
+/* Print the summary of the pass. */
+void scrub_end(struct scrub *s);
+
+#endif /* SCRUB_H_INCLUDED */
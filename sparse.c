@@ -0,0 +1,132 @@
+/*
+ * sparse - extent-aware helpers for RAID member files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse.h"
+
+#define SPARSE_BOUNCE_SIZE (1024*1024) // buffer size for the read/write fallbacks
+
+/* True for the errors that mean "this fd or kernel doesn't do that", as
+ * opposed to a real I/O error. */
+static int unsupported(int e) {
+    return e == EINVAL || e == EOPNOTSUPP || e == ENOSYS || e == EXDEV || e == ENODEV || e == ENOTTY;
+}
+
+int sparse_next_data(int fd, uint64_t pos, uint64_t end, uint64_t *data, uint64_t *hole) {
+    if (pos >= end)
+        return 1;
+    off_t d = lseek(fd, pos, SEEK_DATA);
+    if (d < 0) {
+        if (errno == ENXIO)
+            return 1; // nothing but hole from here to EOF
+        if (!unsupported(errno))
+            return -1;
+        // no SEEK_DATA support: treat everything as data
+        *data = pos;
+        *hole = end;
+        return 0;
+    }
+    if ((uint64_t)d >= end)
+        return 1;
+    off_t h = lseek(fd, d, SEEK_HOLE);
+    if (h < 0 || (uint64_t)h > end)
+        h = end;
+    *data = d;
+    *hole = h;
+    return 0;
+}
+
+static int write_zeros(int fd, uint64_t offset, uint64_t len) {
+    char *zero = calloc(1, SPARSE_BOUNCE_SIZE);
+    if (zero == NULL)
+        return -1;
+    while (len > 0) {
+        size_t n = len < SPARSE_BOUNCE_SIZE ? len : SPARSE_BOUNCE_SIZE;
+        ssize_t r = pwrite(fd, zero, n, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            free(zero);
+            return -1;
+        }
+        offset += r;
+        len -= r;
+    }
+    free(zero);
+    return 0;
+}
+
+int sparse_punch(int fd, uint64_t offset, uint64_t len) {
+    if (len == 0)
+        return 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (!unsupported(errno))
+        return -1;
+    return write_zeros(fd, offset, len);
+}
+
+static int bounce_copy(int src, int dst, uint64_t offset, uint64_t len) {
+    char *buf = malloc(SPARSE_BOUNCE_SIZE);
+    if (buf == NULL)
+        return -1;
+    while (len > 0) {
+        size_t n = len < SPARSE_BOUNCE_SIZE ? len : SPARSE_BOUNCE_SIZE;
+        ssize_t r = pread(src, buf, n, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            if (r == 0)
+                fprintf(stderr, "sparse_copy: unexpected EOF at offset %lu\n", offset);
+            free(buf);
+            return -1;
+        }
+        for (ssize_t done = 0; done < r; ) {
+            ssize_t w = pwrite(dst, buf + done, r - done, offset + done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                free(buf);
+                return -1;
+            }
+            done += w;
+        }
+        offset += r;
+        len -= r;
+    }
+    free(buf);
+    return 0;
+}
+
+int sparse_copy(int src, int dst, uint64_t offset, uint64_t len) {
+    loff_t off_in = offset, off_out = offset;
+    while (len > 0) {
+        ssize_t r = copy_file_range(src, &off_in, dst, &off_out, len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && unsupported(errno))
+            return bounce_copy(src, dst, off_in, len); // e.g. block devices, or across filesystems on old kernels
+        if (r <= 0) {
+            if (r == 0)
+                fprintf(stderr, "sparse_copy: unexpected EOF at offset %ld\n", (long)off_in);
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef SPARSE_H_INCLUDED
+#define SPARSE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Helpers for working with sparse member files: finding allocated extents,
+ * punching holes, and in-kernel copies. Every helper falls back to plain
+ * read/write when the file or kernel does not support the fast path, so they
+ * are safe to use on block devices too.
+ */
+
+/* Find the next allocated extent in [pos, end). On success returns 0 and sets
+ * [*data, *hole) to the extent (clipped to end). Returns 1 if there is no
+ * more data before end, or -1 on error. Files that don't support SEEK_DATA
+ * are reported as a single extent covering the whole range. */
+int sparse_next_data(int fd, uint64_t pos, uint64_t end, uint64_t *data, uint64_t *hole);
+
+/* Deallocate [offset, offset+len) so it reads back as zeros. Uses
+ * FALLOC_FL_PUNCH_HOLE and falls back to writing zeros. */
+int sparse_punch(int fd, uint64_t offset, uint64_t len);
+
+/* Copy [offset, offset+len) from src to the same offset in dst, using
+ * copy_file_range where possible. */
+int sparse_copy(int src, int dst, uint64_t offset, uint64_t len);
+
+#endif /* SPARSE_H_INCLUDED */
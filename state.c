@@ -0,0 +1,84 @@
+/*
+ * state - crash-safe state files for the RAID backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "state.h"
+
+struct state_header {
+    char magic[8];
+    uint32_t len; // bytes of data following the header
+    uint32_t crc; // CRC32C of the data
+};
+
+int state_save(const char *path, const char magic[8], const void *data, size_t len) {
+    struct state_header h;
+    memcpy(h.magic, magic, 8);
+    h.len = len;
+    h.crc = crc32c(0, data, len);
+    struct iovec iov[2] = { { &h, sizeof(h) }, { (void *)data, len } };
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return -1;
+    }
+    if (pwritev(fd, iov, 2, 0) != (ssize_t)(sizeof(h) + len) || fdatasync(fd) != 0) {
+        perror(tmp);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) != 0) {
+        perror(path);
+        return -1;
+    }
+    char *copy = strdup(path);
+    if (copy != NULL) {
+        int dir = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+        if (dir >= 0) {
+            fsync(dir); // make the rename itself durable
+            close(dir);
+        }
+        free(copy);
+    }
+    return 0;
+}
+
+int state_load(const char *path, const char magic[8], void *data, size_t len) {
+    struct state_header h;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 1;
+        perror(path);
+        return -1;
+    }
+    struct iovec iov[2] = { { &h, sizeof(h) }, { data, len } };
+    ssize_t n = preadv(fd, iov, 2, 0);
+    close(fd);
+    if (n != (ssize_t)(sizeof(h) + len) || memcmp(h.magic, magic, 8) != 0 || h.len != len
+            || h.crc != crc32c(0, data, len)) {
+        fprintf(stderr, "ERROR: '%s' is not a valid state file.\n", path);
+        return -1;
+    }
+    return 0;
+}
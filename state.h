@@ -0,0 +1,23 @@
+#ifndef STATE_H_INCLUDED
+#define STATE_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * Small state files that survive crashes, such as reshape and rebuild
+ * progress.
+ *
+ * A record is written to a temporary file, synced, and renamed over the old
+ * one, so a crash leaves either the old or the new record. Each record is
+ * tagged with an 8-byte magic, its length and a CRC32C, and is rejected on
+ * load if any of them don't match.
+ */
+
+/* Atomically replace the file at path with len bytes of data. Returns 0 or -1 (reported). */
+int state_save(const char *path, const char magic[8], const void *data, size_t len);
+
+/* Read len bytes of data from the file at path. Returns 0 if it was loaded,
+ * 1 if there is no such file, -1 if it can't be read or isn't valid (reported). */
+int state_load(const char *path, const char magic[8], void *data, size_t len);
+
+#endif /* STATE_H_INCLUDED */
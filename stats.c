@@ -0,0 +1,80 @@
+/*
+ * stats - request and member statistics over a Unix socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "buse.h"
+#include "control.h"
+#include "qos.h"
+#include "stats.h"
+
+static const char *op_names[BUSE_OPS] = { "read", "write", "flush", "trim" };
+
+// what stats_start() serves; there is one array per process
+static struct member *stats_devs;
+static const int *stats_ndevs;
+static uint64_t started_us;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static const char *member_state(struct member *m) {
+    if (m->fd == -1) return "missing";
+    if (!member_ok(m)) return "failed";
+    if (__atomic_load_n(&m->rebuilt, __ATOMIC_ACQUIRE) != UINT64_MAX) return "rebuilding";
+    return "ok";
+}
+
+void stats_report(FILE *out, struct member *devs, const int *ndevs) {
+    fprintf(out, "uptime_us %lu\n", now_us() - started_us);
+    for (int op = 0; op < BUSE_OPS; op++) {
+        fprintf(out, "op %s bytes %lu errors %lu", op_names[op],
+                __atomic_load_n(&buse_stats.bytes[op], __ATOMIC_RELAXED),
+                __atomic_load_n(&buse_stats.errors[op], __ATOMIC_RELAXED));
+        hist_print(&buse_stats.latency[op], "lat", out);
+        fprintf(out, "\n");
+    }
+    int n = devs ? *ndevs : 0;
+    for (int i = 0; i < n; i++) {
+        struct member *m = &devs[i];
+        fprintf(out, "member %d path %s state %s inflight %d errors %d read_bytes %lu write_bytes %lu",
+                i, m->path ? m->path : "-", member_state(m), member_inflight(m),
+                __atomic_load_n(&m->errors, __ATOMIC_RELAXED),
+                __atomic_load_n(&m->read_bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&m->write_bytes, __ATOMIC_RELAXED));
+        hist_print(&m->read_hist, "read", out);
+        hist_print(&m->write_hist, "write", out);
+        fprintf(out, " rebuild_bytes %lu scrub_bytes %lu client_read_p99_us %u\n",
+                __atomic_load_n(&m->qos_bytes[MEMBER_QOS_REBUILD], __ATOMIC_RELAXED),
+                __atomic_load_n(&m->qos_bytes[MEMBER_QOS_SCRUB], __ATOMIC_RELAXED), member_p99(m));
+    }
+    if (devs)
+        qos_report(out);
+}
+
+static void stats_command(int argc, char **argv, FILE *reply) {
+    if (strcmp(argv[0], "stats") == 0 && argc == 1) {
+        stats_report(reply, stats_devs, stats_ndevs);
+    } else {
+        fprintf(reply, "ERROR unknown command '%s' (commands: stats)\n", argv[0]);
+    }
+}
+
+int stats_start(const char *path, struct member *devs, const int *ndevs) {
+    stats_devs = devs;
+    stats_ndevs = ndevs;
+    started_us = now_us();
+    return control_start(path, stats_command);
+}
@@ -0,0 +1,29 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdio.h>
+
+#include "member.h"
+
+/*
+ * Statistics socket.
+ *
+ * Answers "stats" with one line per NBD request type (latency histogram,
+ * bytes, errors; see buse_stats) and one per member device (read and write
+ * latency histograms, bytes, errors, queue depth and state, and bytes moved
+ * for rebuild and scrub) and one per background QoS class (see qos.h), as
+ * "key value" pairs after the line's first two words. All counters are
+ * totals since start; buse-stat turns two samples into rates.
+ *
+ *     buse-stat -i 1 /run/raid4.stats
+ */
+
+/* Print the report described above. devs may be NULL for a backend without
+ * members; *ndevs is read on every report, so the array may grow. */
+void stats_report(FILE *out, struct member *devs, const int *ndevs);
+
+/* Serve stats_report() on the Unix socket at path, as control_start() does.
+ * Returns 0, or -1 on error (reported). */
+int stats_start(const char *path, struct member *devs, const int *ndevs);
+
+#endif /* STATS_H_INCLUDED */
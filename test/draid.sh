@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# seven sparse 8M devices (two stripes of 2+1 and a spare block per row) and some data
+TESTDIR=$(mktemp -d)
+for i in 0 1 2 3 4 5 6; do
+	truncate -s 8M "$TESTDIR/img$i"
+done
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=4
+
+# start the array with device 3 given as $1
+function attach () {
+	draid -s "$TESTDIR/state" 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" "$TESTDIR/img2" \
+		"$1" "$TESTDIR/img4" "$TESTDIR/img5" "$TESTDIR/img6" 2> "$TESTDIR/log" &
+	BUSEPID=$!
+	sleep 1
+}
+
+function detach () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+}
+
+attach "$TESTDIR/img3"
+
+### do checks ###
+
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=1 oflag=direct
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+detach
+
+# device 3 fails: its blocks are reconstructed from parity, and rebuilt into
+# the spare space of the others in the background
+rm "$TESTDIR/img3"
+truncate -s 8M "$TESTDIR/img3"
+attach MISSING
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+for try in $(seq 30); do
+	if grep -q "spare complete" "$TESTDIR/log"; then
+		break
+	fi
+	sleep 1
+done
+grep -q "spare complete" "$TESTDIR/log"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+detach
+
+# the replacement gets its blocks copied back before the array starts
+attach "+$TESTDIR/img3"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+detach
+
+# and then serves them without the spare
+attach "$TESTDIR/img3"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
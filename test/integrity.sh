@@ -0,0 +1,103 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# sparse 16M devices: three for mirrors, four for a raid4 with a spare; and some data
+TESTDIR=$(mktemp -d)
+for i in 0 1 2; do
+	truncate -s 16M "$TESTDIR/mirror$i"
+done
+for i in 0 1 2 3; do
+	truncate -s 16M "$TESTDIR/img$i"
+done
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=4
+
+# start the backend given as $1 with the rest of the arguments
+function attach () {
+	"$@" 2> "$TESTDIR/log" &
+	BUSEPID=$!
+	sleep 1
+}
+
+function detach () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+}
+
+# wait for the hot spare to be rebuilt
+function wait_rebuild () {
+	for try in $(seq 30); do
+		if grep -q "Rebuild of device .* complete" "$TESTDIR/log"; then
+			break
+		fi
+		sleep 1
+	done
+	grep -q "Rebuild of device .* complete" "$TESTDIR/log"
+}
+
+attach raid1 -I 4096 "$BLOCKDEV" "$TESTDIR/mirror0" "$TESTDIR/mirror1"
+
+### do checks ###
+
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=1 oflag=direct
+detach
+
+# a different block goes bad on each mirror: the checksums catch both, and
+# the other mirror serves them
+$DD if=/dev/urandom of="$TESTDIR/mirror0" bs=4k count=1 seek=300 conv=notrunc
+$DD if=/dev/urandom of="$TESTDIR/mirror1" bs=4k count=1 seek=700 conv=notrunc
+attach raid1 -I 4096 "$BLOCKDEV" "$TESTDIR/mirror0" "$TESTDIR/mirror1"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+grep -q "Checksum mismatch" "$TESTDIR/log"
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=1 oflag=direct
+detach
+
+# a missing mirror is replaced by the hot spare, which gets a checksum table
+# of its own while it is rebuilt
+attach raid1 -I --spare "$TESTDIR/mirror2" 4096 "$BLOCKDEV" MISSING "$TESTDIR/mirror1"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+wait_rebuild
+detach
+attach raid1 -I 4096 "$BLOCKDEV" "$TESTDIR/mirror2" MISSING
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/data"
+detach
+
+# raid4 trims of whole rows and of part of a row
+attach raid4 -I 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" "$TESTDIR/img2"
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=1 oflag=direct
+blkdiscard -o $((2 << 20)) -l $((1 << 20)) "$BLOCKDEV"
+blkdiscard -o $(((3 << 20) + 4096)) -l 8192 "$BLOCKDEV"
+cp "$TESTDIR/data" "$TESTDIR/expected"
+$DD if=/dev/zero of="$TESTDIR/expected" bs=1M count=1 seek=1 conv=notrunc
+$DD if=/dev/zero of="$TESTDIR/expected" bs=4k count=2 seek=513 conv=notrunc
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/expected"
+detach
+
+# the parity was kept in step: a missing data device is reconstructed from
+# it, and rebuilt onto the hot spare
+attach raid4 -I --spare "$TESTDIR/img3" 4096 "$BLOCKDEV" MISSING "$TESTDIR/img1" "$TESTDIR/img2"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/expected"
+wait_rebuild
+detach
+attach raid4 -I 4096 "$BLOCKDEV" "$TESTDIR/img3" "$TESTDIR/img1" "$TESTDIR/img2"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=1 iflag=direct) "$TESTDIR/expected"
@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	if [ -n "$BUSEPID" ]; then
+		nbd-client -d "$BLOCKDEV" > /dev/null
+		wait $BUSEPID
+	fi
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+TESTDIR=$(mktemp -d)
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=16
+$DD if=/dev/urandom of="$TESTDIR/patch" bs=4k count=128
+
+# Four writers at once, each in its own 4M of the target: a buffered fill,
+# whose writeback sends many adjacent requests, then a series of direct
+# writes that each overlap the one before.
+function workload () {
+	local target=$1 flags=$2 pids=()
+	for w in 0 1 2 3; do
+		(
+			$DD if="$TESTDIR/data" of="$target" bs=1M count=4 skip=$((w * 4)) seek=$((w * 4)) conv=notrunc,fsync
+			for k in 0 1 2 3 4 5 6 7; do
+				$DD if="$TESTDIR/patch" of="$target" bs=4k count=$((8 * (k + 1))) skip=$((k * 8)) \
+					seek=$((w * 1024 + k * 8)) conv=notrunc $flags
+			done
+		) &
+		pids+=($!)
+	done
+	for pid in "${pids[@]}"; do
+		wait $pid
+	done
+}
+
+# what the writes must leave behind
+workload "$TESTDIR/expected"
+
+# run the same writes through a raid0 with and without a merge window
+for window in 0 2000; do
+	for i in 0 1; do
+		rm -f "$TESTDIR/img$i"
+		truncate -s 8M "$TESTDIR/img$i"
+	done
+	raid0 --merge-window=$window 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" &
+	BUSEPID=$!
+	sleep 1
+
+	workload "$BLOCKDEV" oflag=direct
+	$DD if="$BLOCKDEV" of="$TESTDIR/result$window" bs=1M count=16 iflag=direct
+
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	BUSEPID=
+done
+
+### do checks ###
+
+cmp "$TESTDIR/result0" "$TESTDIR/expected"
+cmp "$TESTDIR/result2000" "$TESTDIR/result0"
@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# a 16M golden image, a copy to check it against and some data
+TESTDIR=$(mktemp -d)
+$DD if=/dev/urandom of="$TESTDIR/base" bs=1M count=16
+cp "$TESTDIR/base" "$TESTDIR/base.orig"
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=2
+
+# clone it
+loopback -o "$TESTDIR/delta" "$TESTDIR/base" "$BLOCKDEV" &
+BUSEPID=$!
+sleep 1
+
+### do checks ###
+
+# whole and partial clusters written, whole and partial clusters trimmed, then flushed
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M count=1 seek=2 oflag=direct
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=4k count=3 skip=256 seek=1281 oflag=direct
+blkdiscard -o $((8 << 20)) -l $((1 << 20)) "$BLOCKDEV"
+blkdiscard -o $(((12 << 20) + 4096)) -l 8192 "$BLOCKDEV"
+blockdev --flushbufs "$BLOCKDEV"
+
+# the same changes made to a copy of the base
+cp "$TESTDIR/base" "$TESTDIR/expected"
+$DD if="$TESTDIR/data" of="$TESTDIR/expected" bs=1M count=1 seek=2 conv=notrunc
+$DD if="$TESTDIR/data" of="$TESTDIR/expected" bs=4k count=3 skip=256 seek=1281 conv=notrunc
+$DD if=/dev/zero of="$TESTDIR/expected" bs=1M count=1 seek=8 conv=notrunc
+$DD if=/dev/zero of="$TESTDIR/expected" bs=4k count=2 seek=3073 conv=notrunc
+
+cmp <($DD if="$BLOCKDEV" bs=1M iflag=direct) "$TESTDIR/expected"
+
+# the clone comes back from the same delta, the base was never touched
+nbd-client -d "$BLOCKDEV" > /dev/null
+wait $BUSEPID
+cmp "$TESTDIR/base" "$TESTDIR/base.orig"
+
+loopback -o "$TESTDIR/delta" "$TESTDIR/base" "$BLOCKDEV" &
+BUSEPID=$!
+sleep 1
+cmp <($DD if="$BLOCKDEV" bs=1M iflag=direct) "$TESTDIR/expected"
+cmp "$TESTDIR/base" "$TESTDIR/base.orig"
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# three sparse 16M mirrors and some data
+TESTDIR=$(mktemp -d)
+for i in 0 1 2; do
+	truncate -s 16M "$TESTDIR/img$i"
+done
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=4
+
+# attach a 3-way mirror
+raid1 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" "$TESTDIR/img2" &
+BUSEPID=$!
+sleep 1
+
+### do checks ###
+
+# write through the array, every mirror must hold the data afterwards
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=3 oflag=direct
+sync
+for i in 0 1 2; do
+	cmp <($DD if="$TESTDIR/img$i" bs=1M count=4 skip=3) "$TESTDIR/data"
+done
+
+# reads come back intact whichever mirror serves them
+for i in 1 2 3; do
+	cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=3 iflag=direct) "$TESTDIR/data"
+done
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# three sparse 64M devices, a fourth to add, and some data
+TESTDIR=$(mktemp -d)
+for i in 0 1 2 3; do
+	truncate -s 64M "$TESTDIR/img$i"
+done
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=64
+truncate -s 192M "$TESTDIR/expected"
+
+# start the array over the devices given
+function attach () {
+	raid0 --control "$TESTDIR/ctl" --state "$TESTDIR/state" 4096 "$BLOCKDEV" "$@" 2> "$TESTDIR/log" &
+	BUSEPID=$!
+	sleep 1
+}
+
+# write 1M chunks of data at scattered offsets, to the array and to the
+# expected contents, starting with chunk $1
+function write_load () {
+	for k in $(seq $1 $(($1 + 15))); do
+		$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M count=1 skip=$((k % 64)) seek=$((k * 37 % 192)) oflag=direct
+		$DD if="$TESTDIR/data" of="$TESTDIR/expected" bs=1M count=1 skip=$((k % 64)) seek=$((k * 37 % 192)) conv=notrunc
+	done
+}
+
+attach "$TESTDIR/img0" "$TESTDIR/img1" "$TESTDIR/img2"
+
+### do checks ###
+
+write_load 0
+
+# grow onto the fourth device while writing, and crash halfway
+echo "add $TESTDIR/img3" | socat - UNIX-CONNECT:"$TESTDIR/ctl"
+write_load 16
+MIDWAY=$(echo status | socat - UNIX-CONNECT:"$TESTDIR/ctl" | grep -c reshape || true)
+if [ "$MIDWAY" -eq 0 ]; then
+	echo "the reshape finished before the restart, only the online part was tested"
+fi
+kill -9 $BUSEPID
+wait $BUSEPID || true
+nbd-client -d "$BLOCKDEV" > /dev/null || true
+
+# the restarted array resumes the reshape from its checkpoint
+attach "$TESTDIR/img0" "$TESTDIR/img1" "$TESTDIR/img2" "$TESTDIR/img3"
+write_load 32
+if [ "$MIDWAY" -ne 0 ]; then
+	for try in $(seq 60); do
+		if grep -q "Reshape complete" "$TESTDIR/log"; then
+			break
+		fi
+		sleep 1
+	done
+	grep -q "Reshape complete" "$TESTDIR/log"
+fi
+
+# the old contents are where they were, and the added space reads as zeros
+truncate -s 256M "$TESTDIR/expected"
+[ "$(blockdev --getsize64 "$BLOCKDEV")" -eq $((256 << 20)) ]
+cmp <($DD if="$BLOCKDEV" bs=1M iflag=direct) "$TESTDIR/expected"
@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait $BUSEPID
+	rm -rf "$TESTDIR"
+}
+trap cleanup EXIT
+
+# two sparse 16M mirrors, a 64M write-back cache and some data
+TESTDIR=$(mktemp -d)
+for i in 0 1; do
+	truncate -s 16M "$TESTDIR/img$i"
+done
+truncate -s 64M "$TESTDIR/wbc"
+$DD if=/dev/urandom of="$TESTDIR/data" bs=1M count=4
+
+raid1 --wb-cache="$TESTDIR/wbc" 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" &
+BUSEPID=$!
+sleep 1
+
+### do checks ###
+
+# write through the cache and kill the backend before it destages (it waits
+# for a second without writes); the data is only in the cache then
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=3 oflag=direct conv=fsync
+kill -9 $BUSEPID
+wait $BUSEPID || true
+nbd-client -d "$BLOCKDEV" > /dev/null || true
+for i in 0 1; do
+	if cmp -s <($DD if="$TESTDIR/img$i" bs=1M count=4 skip=3) "$TESTDIR/data"; then
+		echo "mirror $i was written before the backend was killed"
+		exit 1
+	fi
+done
+
+# the restarted backend recovers the writes from the cache log
+raid1 --wb-cache="$TESTDIR/wbc" 4096 "$BLOCKDEV" "$TESTDIR/img0" "$TESTDIR/img1" &
+BUSEPID=$!
+sleep 1
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=3 iflag=direct) "$TESTDIR/data"
+
+# and destages them to both mirrors once idle
+for try in $(seq 10); do
+	if cmp -s <($DD if="$TESTDIR/img0" bs=1M count=4 skip=3) "$TESTDIR/data" &&
+	   cmp -s <($DD if="$TESTDIR/img1" bs=1M count=4 skip=3) "$TESTDIR/data"; then
+		break
+	fi
+	sleep 1
+done
+for i in 0 1; do
+	cmp <($DD if="$TESTDIR/img$i" bs=1M count=4 skip=3) "$TESTDIR/data"
+done
+
+# a raid0 that grows online keeps its cache: restart it at the new size with
+# writes still waiting to be destaged
+nbd-client -d "$BLOCKDEV" > /dev/null
+wait $BUSEPID
+for i in 0 1 2; do
+	truncate -s 16M "$TESTDIR/stripe$i"
+done
+truncate -s 64M "$TESTDIR/wbc0"
+raid0 --control "$TESTDIR/ctl" --state "$TESTDIR/state" --wb-cache="$TESTDIR/wbc0" 4096 "$BLOCKDEV" \
+	"$TESTDIR/stripe0" "$TESTDIR/stripe1" 2> "$TESTDIR/log" &
+BUSEPID=$!
+sleep 1
+echo "add $TESTDIR/stripe2" | socat - UNIX-CONNECT:"$TESTDIR/ctl"
+for try in $(seq 30); do
+	if grep -q "Reshape complete" "$TESTDIR/log"; then
+		break
+	fi
+	sleep 1
+done
+grep -q "Reshape complete" "$TESTDIR/log"
+$DD if="$TESTDIR/data" of="$BLOCKDEV" bs=1M seek=3 oflag=direct conv=fsync
+kill -9 $BUSEPID
+wait $BUSEPID || true
+nbd-client -d "$BLOCKDEV" > /dev/null || true
+
+raid0 --control "$TESTDIR/ctl" --state "$TESTDIR/state" --wb-cache="$TESTDIR/wbc0" 4096 "$BLOCKDEV" \
+	"$TESTDIR/stripe0" "$TESTDIR/stripe1" "$TESTDIR/stripe2" &
+BUSEPID=$!
+sleep 1
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=3 iflag=direct) "$TESTDIR/data"
+
+# disconnecting destages everything, so the array holds the data without the cache
+nbd-client -d "$BLOCKDEV" > /dev/null
+wait $BUSEPID
+raid0 --state "$TESTDIR/state" 4096 "$BLOCKDEV" "$TESTDIR/stripe0" "$TESTDIR/stripe1" "$TESTDIR/stripe2" &
+BUSEPID=$!
+sleep 1
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=3 iflag=direct) "$TESTDIR/data"
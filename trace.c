@@ -0,0 +1,166 @@
+/*
+ * trace - buffered binary request traces
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace {
+    int fd;
+    bool hashes;
+    uint64_t start_ns;           // CLOCK_MONOTONIC at open
+
+    char *buf[2];
+    int cur;                     // buffer being filled, by the request loop only
+    size_t fill;
+
+    pthread_mutex_t lock;        // the hand-off below
+    pthread_cond_t cond;
+    char *out;                   // full buffer for the writer, NULL while it is idle
+    size_t out_len;
+    bool closing;
+    bool failed;                 // a write failed; the rest of the trace is dropped
+    pthread_t writer;
+};
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void write_out(struct trace *t, const char *buf, size_t len) {
+    while (len > 0 && !t->failed) {
+        ssize_t n = write(t->fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("trace");
+            t->failed = true;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct trace *t = arg;
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (t->out == NULL && !t->closing) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->out == NULL) {
+            break; // closing, and everything is out
+        }
+        char *buf = t->out;
+        size_t len = t->out_len;
+        pthread_mutex_unlock(&t->lock);
+        write_out(t, buf, len);
+        pthread_mutex_lock(&t->lock);
+        t->out = NULL;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* Give the filled buffer to the writer and switch to the other one, waiting
+ * if the writer hasn't finished with it yet. */
+static void hand_off(struct trace *t) {
+    pthread_mutex_lock(&t->lock);
+    while (t->out != NULL) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    t->out = t->buf[t->cur];
+    t->out_len = t->fill;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    t->cur ^= 1;
+    t->fill = 0;
+}
+
+struct trace *trace_open(const char *path, bool hashes) {
+    struct trace *t = calloc(1, sizeof(*t));
+    if (t == NULL || (t->buf[0] = malloc(TRACE_BUFFER)) == NULL || (t->buf[1] = malloc(TRACE_BUFFER)) == NULL) {
+        perror("trace");
+        return NULL;
+    }
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    t->hashes = hashes;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    t->start_ns = mono_ns();
+    struct trace_header h = { .flags = hashes ? TRACE_HASHES : 0, .record_size = sizeof(struct trace_record),
+                              .start_unix_ns = now.tv_sec * 1000000000ull + now.tv_nsec };
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    write_out(t, (const char *)&h, sizeof(h));
+    if (t->failed) {
+        close(t->fd);
+        return NULL;
+    }
+
+    if (pthread_create(&t->writer, NULL, writer_thread, t) != 0) {
+        fprintf(stderr, "ERROR: can't start the trace writer thread.\n");
+        close(t->fd);
+        return NULL;
+    }
+    return t;
+}
+
+bool trace_hashes(const struct trace *t) {
+    return t->hashes;
+}
+
+uint64_t trace_now(const struct trace *t) {
+    return mono_ns() - t->start_ns;
+}
+
+void trace_add(struct trace *t, const struct trace_record *r) {
+    memcpy(t->buf[t->cur] + t->fill, r, sizeof(*r));
+    t->fill += sizeof(*r);
+    if (t->fill + sizeof(*r) > TRACE_BUFFER) {
+        hand_off(t);
+    }
+}
+
+void trace_close(struct trace *t) {
+    if (t->fill > 0) {
+        hand_off(t);
+    }
+    pthread_mutex_lock(&t->lock);
+    t->closing = true;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+    if (close(t->fd) != 0) {
+        perror("trace");
+    }
+    free(t->buf[0]);
+    free(t->buf[1]);
+    free(t);
+}
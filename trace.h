@@ -0,0 +1,56 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary request traces, written by buse_main() (see buse_trace()) and read
+ * by buse-replay.
+ *
+ * A trace is a trace_header followed by one fixed-size trace_record per
+ * request, in the order the requests were served, in host byte order. Records
+ * are appended to one of two large buffers; a background thread writes a
+ * full buffer out while the other fills, so the request loop only copies 32
+ * bytes per request.
+ */
+
+#define TRACE_MAGIC "BUSETRC1"
+#define TRACE_HASHES 1           // trace_header.flags: records carry payload CRCs
+#define TRACE_BUFFER (1 << 20)   // bytes per buffer
+
+struct trace_header {
+    char magic[8];
+    uint32_t flags;
+    uint32_t record_size;        // sizeof(struct trace_record), for later extensions
+    uint64_t start_unix_ns;      // wall clock time of the first record's time_ns 0
+};
+
+struct trace_record {
+    uint64_t time_ns;            // request received, since the trace was opened
+    uint64_t offset;
+    uint32_t len;
+    uint8_t op;                  // enum buse_op
+    uint8_t error;               // the request failed
+    uint16_t cmd_flags;          // NBD command flags (NBD_CMD_FLAG_FUA, ...) shifted down 16 bits
+    uint32_t latency_us;         // until the reply was sent
+    uint32_t hash;               // CRC32C of the data written or read, with TRACE_HASHES
+};
+
+struct trace;
+
+/* Create (truncate) the trace file at path. Returns NULL on error (reported). */
+struct trace *trace_open(const char *path, bool hashes);
+
+/* Whether records should carry payload hashes. */
+bool trace_hashes(const struct trace *t);
+
+/* The time_ns of an event now. */
+uint64_t trace_now(const struct trace *t);
+
+void trace_add(struct trace *t, const struct trace_record *r);
+
+/* Write out what is buffered and close the file. */
+void trace_close(struct trace *t);
+
+#endif /* TRACE_H_INCLUDED */
@@ -0,0 +1,751 @@
+/*
+ * wbcache - write-back cache tier on a fast device for the backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "wbcache.h"
+
+#define WBC_MAGIC "BUSEWBC1"
+#define WBC_RECORD_MAGIC 0x52434257 // "WBCR"
+#define WBC_TRIM 1 // record flag: drops blocks [block[0], block[1]) and carries no data
+#define WBC_LOG_START (2 * WBC_BLOCK_SIZE) // the log follows the two superblock copies
+
+struct wbc_super {
+    char magic[8];
+    uint64_t gen;      // of the two copies, the valid one with the higher generation counts
+    uint64_t dev_size; // size of the device the log belongs to
+    uint64_t log_size; // bytes of log after WBC_LOG_START
+    uint64_t tail;     // log position of the oldest record that isn't destaged yet
+    uint64_t tail_seq; // sequence number of that record
+    uint32_t crc;      // CRC32C of the fields above
+};
+
+struct wbc_record {
+    uint32_t magic;
+    uint32_t nblocks;
+    uint64_t seq;      // one more than the record before it
+    uint32_t flags;
+    uint32_t crc;      // CRC32C of the header block (with crc 0) and the data
+    uint64_t block[WBC_RECORD_BLOCKS];
+};
+
+union wbc_header {
+    struct wbc_record r;
+    char pad[WBC_BLOCK_SIZE];
+};
+
+struct wbc_entry {
+    uint64_t block;
+    uint64_t pos;      // log position of the block's newest data
+    int32_t hnext;     // hash chain or free list, -1 at the end
+    bool used;
+};
+
+struct wbcache {
+    struct buse_operations inner;
+    void *inner_userdata;
+    int fd;
+    const char *path;
+    uint64_t size;     // bytes of the device that are cached, whole blocks only; grows, see wbcache_resize()
+    uint64_t stripe;   // backend full-stripe size in blocks, 0 if none
+    struct wbc_super super; // as last written, owned by the destage thread
+
+    pthread_mutex_t lock;         // everything below
+    pthread_cond_t wake;          // the destage thread has work
+    pthread_cond_t space;         // the tail moved
+    pthread_mutex_t write_lock;   // one append at a time, so the log holds writes in the order they completed
+    pthread_mutex_t backend_lock; // one call into the backend at a time
+    pthread_mutex_t destage_lock; // held through a destage pass, so a trim can't land in the middle of one
+    pthread_rwlock_t reclaim_lock; // held for reading while dirty data is read from the log, for writing while the tail moves
+
+    struct wbc_entry *entries;
+    int32_t *buckets;  // hash table of entry indices, -1 if empty
+    uint32_t nbuckets; // a power of two
+    int32_t free;      // unused entries
+    uint32_t dirty;    // entries in use
+    uint64_t head, tail; // log positions: next record, oldest record
+    uint64_t seq;      // sequence number of the next record
+    uint64_t last_write_us;
+    int waiting;       // writers waiting for log space
+    bool draining;     // destage everything, the device is disconnecting
+    bool failed;       // the last destage pass failed
+    bool bypassed;     // a write or trim went to the backend directly since the last flush
+
+    uint64_t records, logged, destaged, destage_writes, full_stripes, stalls;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t phys(struct wbcache *c, uint64_t pos) {
+    return WBC_LOG_START + pos % c->super.log_size;
+}
+
+static uint32_t bucket_of(struct wbcache *c, uint64_t block) {
+    return (block * 0x9e3779b97f4a7c15ULL >> 32) & (c->nbuckets - 1);
+}
+
+static int32_t lookup(struct wbcache *c, uint64_t block) {
+    for (int32_t i = c->buckets[bucket_of(c, block)]; i != -1; i = c->entries[i].hnext) {
+        if (c->entries[i].block == block) return i;
+    }
+    return -1;
+}
+
+static void map_set(struct wbcache *c, uint64_t block, uint64_t pos) {
+    int32_t i = lookup(c, block);
+    if (i == -1) {
+        i = c->free; // never runs out: every entry holds a different block of the log
+        c->free = c->entries[i].hnext;
+        uint32_t h = bucket_of(c, block);
+        c->entries[i] = (struct wbc_entry){ .block = block, .hnext = c->buckets[h], .used = true };
+        c->buckets[h] = i;
+        c->dirty++;
+    }
+    c->entries[i].pos = pos;
+}
+
+static void map_remove(struct wbcache *c, int32_t i) {
+    int32_t *p = &c->buckets[bucket_of(c, c->entries[i].block)];
+    while (*p != i) {
+        p = &c->entries[*p].hnext;
+    }
+    *p = c->entries[i].hnext;
+    c->entries[i].used = false;
+    c->entries[i].hnext = c->free;
+    c->free = i;
+    c->dirty--;
+}
+
+/* Log position of block's dirty data, or false if the backend has it. */
+static bool dirty_pos(struct wbcache *c, uint64_t block, uint64_t *pos) {
+    pthread_mutex_lock(&c->lock);
+    int32_t i = lookup(c, block);
+    if (i != -1) *pos = c->entries[i].pos;
+    pthread_mutex_unlock(&c->lock);
+    return i != -1;
+}
+
+static int log_read(struct wbcache *c, void *buf, size_t len, uint64_t pos) {
+    if (pread(c->fd, buf, len, phys(c, pos)) != (ssize_t)len) {
+        perror(c->path);
+        return -1;
+    }
+    return 0;
+}
+
+static int backend_read(struct wbcache *c, void *buf, size_t len, uint64_t offset) {
+    pthread_mutex_lock(&c->backend_lock);
+    int r = c->inner.read(buf, len, offset, c->inner_userdata);
+    pthread_mutex_unlock(&c->backend_lock);
+    return r;
+}
+
+static int backend_write(struct wbcache *c, const void *buf, size_t len, uint64_t offset) {
+    pthread_mutex_lock(&c->backend_lock);
+    int r = c->inner.write(buf, len, offset, c->inner_userdata);
+    pthread_mutex_unlock(&c->backend_lock);
+    return r;
+}
+
+/* Apply record r, found at log position pos, to the map. */
+static void apply(struct wbcache *c, const struct wbc_record *r, uint64_t pos) {
+    if (r->flags & WBC_TRIM) {
+        uint64_t from = r->block[0], to = r->block[1];
+        if (to - from <= c->super.log_size / WBC_BLOCK_SIZE) {
+            for (uint64_t b = from; b < to; b++) {
+                int32_t i = lookup(c, b);
+                if (i != -1) map_remove(c, i);
+            }
+        } else {
+            for (uint32_t i=0; i < c->super.log_size / WBC_BLOCK_SIZE; i++) {
+                if (c->entries[i].used && c->entries[i].block >= from && c->entries[i].block < to) map_remove(c, i);
+            }
+        }
+        return;
+    }
+    for (uint32_t k=0; k < r->nblocks; k++) {
+        map_set(c, r->block[k], pos + (1 + (uint64_t)k) * WBC_BLOCK_SIZE);
+    }
+}
+
+static uint64_t record_bytes(uint32_t flags, uint32_t nblocks) {
+    return (1 + (flags & WBC_TRIM ? 0 : (uint64_t)nblocks)) * WBC_BLOCK_SIZE;
+}
+
+/* Append a record for blocks[0..n) with their data (or a trim of the range
+ * blocks[0], blocks[1]) to the log, waiting for space if needed, and apply it.
+ * The caller holds write_lock. */
+static int log_append(struct wbcache *c, uint32_t flags, const uint64_t *blocks, uint32_t n, const char *data) {
+    uint64_t bytes = record_bytes(flags, n);
+    uint64_t log_size = c->super.log_size;
+
+    pthread_mutex_lock(&c->lock);
+    uint64_t at = c->head;
+    if (at % log_size + bytes > log_size) {
+        at += log_size - at % log_size; // doesn't fit before the end, start over at the beginning
+    }
+    if (c->head == c->tail) {
+        c->tail = at; // empty, so the skipped space is free too
+    }
+    if (at + bytes - c->tail > log_size) {
+        c->stalls++;
+        c->waiting++;
+        pthread_cond_signal(&c->wake);
+        while (at + bytes - c->tail > log_size) {
+            pthread_cond_wait(&c->space, &c->lock);
+        }
+        c->waiting--;
+    }
+    uint64_t seq = c->seq;
+    pthread_mutex_unlock(&c->lock);
+
+    union wbc_header h;
+    memset(&h, 0, sizeof(h));
+    h.r.magic = WBC_RECORD_MAGIC;
+    h.r.nblocks = n;
+    h.r.seq = seq;
+    h.r.flags = flags;
+    memcpy(h.r.block, blocks, n * sizeof(uint64_t));
+    h.r.crc = crc32c(crc32c(0, &h, sizeof(h)), data, bytes - sizeof(h));
+    struct iovec iov[2] = { { &h, sizeof(h) }, { (void *)data, bytes - sizeof(h) } };
+    if (pwritev(c->fd, iov, 2, phys(c, at)) != (ssize_t)bytes) {
+        perror(c->path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    apply(c, &h.r, at);
+    c->head = at + bytes;
+    c->seq = seq + 1;
+    c->records++;
+    c->logged += bytes;
+    c->last_write_us = now_us();
+    if ((c->head - c->tail) * 100 >= log_size * WBC_DESTAGE_PCT) {
+        pthread_cond_signal(&c->wake);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Current contents of block, from the log if it is dirty. */
+static int fetch(struct wbcache *c, uint64_t block, char *out) {
+    uint64_t pos;
+    pthread_rwlock_rdlock(&c->reclaim_lock);
+    int r = dirty_pos(c, block, &pos) ? log_read(c, out, WBC_BLOCK_SIZE, pos)
+                                      : backend_read(c, out, WBC_BLOCK_SIZE, block * WBC_BLOCK_SIZE);
+    pthread_rwlock_unlock(&c->reclaim_lock);
+    return r;
+}
+
+static int wbc_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct wbcache *c = userdata;
+    uint64_t size = __atomic_load_n(&c->size, __ATOMIC_RELAXED); // may grow meanwhile, see wbcache_resize()
+    uint64_t from = offset, end = offset + len;
+    int r = 0;
+
+    pthread_rwlock_rdlock(&c->reclaim_lock);
+    while (r == 0 && from < end) {
+        // a run of blocks that are all clean, or all dirty and next to each other in the log
+        uint64_t b = from / WBC_BLOCK_SIZE, pos = 0, next = 0;
+        bool dirty = from < size && dirty_pos(c, b, &pos);
+        uint64_t to = (b + 1) * WBC_BLOCK_SIZE < end ? (b + 1) * WBC_BLOCK_SIZE : end;
+        while (to < end) {
+            uint64_t nb = to / WBC_BLOCK_SIZE;
+            if ((to < size && dirty_pos(c, nb, &next)) != dirty || (dirty && next != pos + (nb - b) * WBC_BLOCK_SIZE)) break;
+            to = to + WBC_BLOCK_SIZE < end ? to + WBC_BLOCK_SIZE : end;
+        }
+        if (dirty) {
+            r = log_read(c, (char *)buf + (from - offset), to - from, pos + from % WBC_BLOCK_SIZE);
+        } else {
+            r = backend_read(c, (char *)buf + (from - offset), to - from, from);
+        }
+        from = to;
+    }
+    pthread_rwlock_unlock(&c->reclaim_lock);
+    return r;
+}
+
+static int wbc_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    struct wbcache *c = userdata;
+    uint64_t size = __atomic_load_n(&c->size, __ATOMIC_RELAXED);
+    if (offset + len > size) {
+        // past what is cached (the device may have grown), straight to the backend
+        uint64_t from = offset > size ? offset : size;
+        if (backend_write(c, (const char *)buf + (from - offset), offset + len - from, from) != 0) {
+            return -1;
+        }
+        __atomic_store_n(&c->bypassed, true, __ATOMIC_RELEASE);
+        len = from - offset;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    uint64_t first = offset / WBC_BLOCK_SIZE, last = (offset + len - 1) / WBC_BLOCK_SIZE;
+    uint64_t blocks[WBC_RECORD_BLOCKS];
+    size_t max = last - first + 1 < WBC_RECORD_BLOCKS ? last - first + 1 : WBC_RECORD_BLOCKS;
+    char *data = malloc(max * WBC_BLOCK_SIZE);
+    if (data == NULL) {
+        perror("wbcache");
+        return -1;
+    }
+    int r = 0;
+    pthread_mutex_lock(&c->write_lock);
+    for (uint64_t b = first; r == 0 && b <= last; b += max) {
+        uint32_t n = last - b + 1 < max ? last - b + 1 : max;
+        uint64_t lo = b * WBC_BLOCK_SIZE, hi = (b + n) * WBC_BLOCK_SIZE;
+        for (uint32_t k=0; k < n; k++) {
+            blocks[k] = b + k;
+        }
+        // blocks the write covers only in part start from their current contents
+        if (offset > lo) {
+            r = fetch(c, b, data);
+        }
+        if (r == 0 && offset + len < hi && (n > 1 || offset <= lo)) {
+            r = fetch(c, b + n - 1, data + (n - 1) * WBC_BLOCK_SIZE);
+        }
+        if (r == 0) {
+            uint64_t from = offset > lo ? offset : lo, to = offset + len < hi ? offset + len : hi;
+            memcpy(data + (from - lo), (const char *)buf + (from - offset), to - from);
+            r = log_append(c, 0, blocks, n, data);
+        }
+    }
+    pthread_mutex_unlock(&c->write_lock);
+    free(data);
+    return r;
+}
+
+static int wbc_trim(u_int64_t from, u_int32_t len, void *userdata) {
+    struct wbcache *c = userdata;
+    uint64_t size = __atomic_load_n(&c->size, __ATOMIC_RELAXED);
+    uint64_t end = from + len < size ? from + len : size;
+    uint64_t range[2] = { (from + WBC_BLOCK_SIZE - 1) / WBC_BLOCK_SIZE, end / WBC_BLOCK_SIZE };
+    int r = 0;
+    pthread_mutex_lock(&c->write_lock);
+    if (range[0] < range[1]) {
+        // drop dirty data for the blocks trimmed as a whole, so it isn't destaged on top of the trim
+        r = log_append(c, WBC_TRIM, range, 2, NULL);
+    }
+    if (r == 0) {
+        // and wait out a destage pass that may have picked it up already
+        pthread_mutex_lock(&c->destage_lock);
+        pthread_mutex_lock(&c->backend_lock);
+        r = c->inner.trim(from, len, c->inner_userdata);
+        pthread_mutex_unlock(&c->backend_lock);
+        __atomic_store_n(&c->bypassed, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&c->destage_lock);
+    }
+    pthread_mutex_unlock(&c->write_lock);
+    return r;
+}
+
+static int wbc_flush(void *userdata) {
+    struct wbcache *c = userdata;
+    // everything acknowledged is in the log, except what went to the backend directly
+    if (fdatasync(c->fd) != 0) {
+        perror(c->path);
+        return -1;
+    }
+    if (c->inner.flush && __atomic_exchange_n(&c->bypassed, false, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&c->backend_lock);
+        int r = c->inner.flush(c->inner_userdata);
+        pthread_mutex_unlock(&c->backend_lock);
+        if (r != 0) {
+            __atomic_store_n(&c->bypassed, true, __ATOMIC_RELEASE); // the next flush tries again
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int super_write(struct wbcache *c, struct wbc_super *s) {
+    char block[WBC_BLOCK_SIZE];
+    s->gen++;
+    s->crc = crc32c(0, s, offsetof(struct wbc_super, crc));
+    memset(block, 0, sizeof(block));
+    memcpy(block, s, sizeof(*s));
+    if (pwrite(c->fd, block, sizeof(block), (s->gen % 2) * WBC_BLOCK_SIZE) != (ssize_t)sizeof(block) || fdatasync(c->fd) != 0) {
+        perror(c->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load the newer valid superblock copy. Returns 0, or 1 if neither is valid. */
+static int super_load(struct wbcache *c) {
+    int missing = 1;
+    for (int k=0; k < 2; k++) {
+        struct wbc_super s;
+        if (pread(c->fd, &s, sizeof(s), k * WBC_BLOCK_SIZE) == (ssize_t)sizeof(s) && memcmp(s.magic, WBC_MAGIC, 8) == 0
+                && s.crc == crc32c(0, &s, offsetof(struct wbc_super, crc)) && (missing || s.gen > c->super.gen)) {
+            c->super = s;
+            missing = 0;
+        }
+    }
+    return missing;
+}
+
+static int by_block(const void *a, const void *b) {
+    const struct wbc_entry *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* Read the data of the n dirty blocks e[0..n) from the log into out, one
+ * read per run that is contiguous in the log. */
+static int read_entries(struct wbcache *c, const struct wbc_entry *e, size_t n, char *out) {
+    for (size_t i=0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && e[j].pos == e[j-1].pos + WBC_BLOCK_SIZE) j++;
+        if (log_read(c, out + i * WBC_BLOCK_SIZE, (j - i) * WBC_BLOCK_SIZE, e[i].pos) != 0) {
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+/* Write every block that is dirty now to the backend, then move the tail
+ * past the records they came from. Blocks are sorted and coalesced into
+ * writes of up to WBC_BATCH_BYTES. */
+static int destage(struct wbcache *c) {
+    pthread_mutex_lock(&c->lock);
+    uint64_t head = c->head, seq = c->seq;
+    size_t n = 0;
+    struct wbc_entry *e = malloc((c->dirty + 1) * sizeof(*e));
+    for (uint32_t i=0; e != NULL && i < c->super.log_size / WBC_BLOCK_SIZE; i++) {
+        if (c->entries[i].used) e[n++] = c->entries[i];
+    }
+    pthread_mutex_unlock(&c->lock);
+    char *buf = malloc(WBC_BATCH_BYTES);
+    if (e == NULL || buf == NULL) {
+        perror("wbcache");
+        free(e);
+        free(buf);
+        return -1;
+    }
+    qsort(e, n, sizeof(*e), by_block);
+
+    uint64_t ext = 0, ext_n = 0; // the write being built: ext_n blocks from block ext
+    uint64_t batch = WBC_BATCH_BYTES / WBC_BLOCK_SIZE;
+    uint64_t stripe = __atomic_load_n(&c->stripe, __ATOMIC_RELAXED), size = __atomic_load_n(&c->size, __ATOMIC_RELAXED);
+    uint64_t stripes = 0, writes = 0;
+    int r = 0;
+    for (size_t i=0; r == 0 && i < n; ) {
+        uint64_t from = e[i].block, count;
+        size_t j = i + 1;
+        uint64_t group_end = stripe > 0 ? (from / stripe + 1) * stripe : UINT64_MAX;
+        while (j < n && e[j].block < group_end) j++;
+        bool full = stripe > 0 && stripe <= batch && (j - i) * 2 >= stripe && group_end * WBC_BLOCK_SIZE <= size;
+        if (full) {
+            // most of the stripe is dirty: read the rest in and write all of it
+            from = group_end - stripe;
+            count = stripe;
+        } else {
+            // a run of consecutive dirty blocks within the stripe
+            j = i + 1;
+            while (j < n && e[j].block == e[j-1].block + 1 && e[j].block < group_end && j - i < batch) j++;
+            count = j - i;
+        }
+        if (ext_n > 0 && (from != ext + ext_n || ext_n + count > batch)) {
+            r = backend_write(c, buf, ext_n * WBC_BLOCK_SIZE, ext * WBC_BLOCK_SIZE);
+            writes++;
+            ext_n = 0;
+        }
+        if (ext_n == 0) {
+            ext = from;
+        }
+        char *out = buf + ext_n * WBC_BLOCK_SIZE;
+        if (r == 0 && full) {
+            r = backend_read(c, out, count * WBC_BLOCK_SIZE, from * WBC_BLOCK_SIZE);
+            for (size_t k = i; r == 0 && k < j; ) {
+                size_t m = k + 1;
+                while (m < j && e[m].block == e[m-1].block + 1) m++;
+                r = read_entries(c, e + k, m - k, out + (e[k].block - from) * WBC_BLOCK_SIZE);
+                k = m;
+            }
+            stripes++;
+        } else if (r == 0) {
+            r = read_entries(c, e + i, j - i, out);
+        }
+        ext_n += count;
+        i = j;
+    }
+    if (r == 0 && ext_n > 0) {
+        r = backend_write(c, buf, ext_n * WBC_BLOCK_SIZE, ext * WBC_BLOCK_SIZE);
+        writes++;
+    }
+    free(buf);
+    if (r == 0 && n > 0 && c->inner.flush) {
+        pthread_mutex_lock(&c->backend_lock);
+        r = c->inner.flush(c->inner_userdata);
+        pthread_mutex_unlock(&c->backend_lock);
+    }
+    if (r != 0) {
+        fprintf(stderr, "wbcache: destaging to the array failed, %lu dirty blocks stay in %s\n", (uint64_t)n, c->path);
+        free(e);
+        return -1;
+    }
+
+    // the destaged blocks are clean unless they were written again meanwhile
+    pthread_mutex_lock(&c->lock);
+    for (size_t i=0; i < n; i++) {
+        int32_t k = lookup(c, e[i].block);
+        if (k != -1 && c->entries[k].pos == e[i].pos) map_remove(c, k);
+    }
+    c->destaged += n;
+    c->destage_writes += writes;
+    c->full_stripes += stripes;
+    pthread_mutex_unlock(&c->lock);
+    free(e);
+
+    // make the new tail durable before its space can be reused
+    struct wbc_super s = c->super;
+    s.tail = head;
+    s.tail_seq = seq;
+    if (super_write(c, &s) != 0) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&c->reclaim_lock);
+    pthread_mutex_lock(&c->lock);
+    c->super = s;
+    if (c->tail < head) {
+        c->tail = head;
+    }
+    pthread_cond_broadcast(&c->space);
+    pthread_mutex_unlock(&c->lock);
+    pthread_rwlock_unlock(&c->reclaim_lock);
+    return 0;
+}
+
+static bool destage_wanted(struct wbcache *c) {
+    if (c->head == c->tail) {
+        return false;
+    }
+    return c->draining || c->waiting > 0 || (c->head - c->tail) * 100 >= c->super.log_size * WBC_DESTAGE_PCT
+        || now_us() - c->last_write_us >= WBC_IDLE_MS * 1000;
+}
+
+static void *destage_thread(void *arg) {
+    struct wbcache *c = arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (!destage_wanted(c)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += WBC_IDLE_MS % 1000 * 1000000;
+            ts.tv_sec += WBC_IDLE_MS / 1000 + ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&c->wake, &c->lock, &ts);
+        }
+        pthread_mutex_unlock(&c->lock);
+        pthread_mutex_lock(&c->destage_lock);
+        int r = destage(c);
+        pthread_mutex_unlock(&c->destage_lock);
+        pthread_mutex_lock(&c->lock);
+        c->failed = r != 0;
+        if (r != 0) {
+            pthread_cond_broadcast(&c->space); // lets a draining disconnect give up
+            pthread_mutex_unlock(&c->lock);
+            sleep(1);
+            pthread_mutex_lock(&c->lock);
+        }
+    }
+    return NULL;
+}
+
+static void wbc_disc(void *userdata) {
+    struct wbcache *c = userdata;
+    // leave the array complete on its own
+    pthread_mutex_lock(&c->lock);
+    c->draining = true;
+    c->failed = false;
+    pthread_cond_signal(&c->wake);
+    while (c->head != c->tail && !c->failed) {
+        pthread_cond_wait(&c->space, &c->lock);
+    }
+    c->draining = false;
+    pthread_mutex_unlock(&c->lock);
+    if (c->inner.disc) {
+        c->inner.disc(c->inner_userdata);
+    }
+    wbcache_report(c, stderr);
+}
+
+void wbcache_report(struct wbcache *c, FILE *out) {
+    pthread_mutex_lock(&c->lock);
+    fprintf(out, "wbcache: %u dirty blocks (%.1f MiB), log %.1f%% full, %lu records (%.1f MiB) logged, "
+            "%lu blocks destaged in %lu writes (%lu full stripes), %lu stalls for log space\n",
+            c->dirty, c->dirty * (double)WBC_BLOCK_SIZE / 1048576.0, 100.0 * (c->head - c->tail) / c->super.log_size,
+            c->records, c->logged / 1048576.0, c->destaged, c->destage_writes, c->full_stripes, c->stalls);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Validate the record with sequence number seq at log position pos, reading
+ * its header into h and its data into data. */
+static int read_record(struct wbcache *c, uint64_t pos, uint64_t seq, union wbc_header *h, char *data) {
+    if (pread(c->fd, h, sizeof(*h), phys(c, pos)) != (ssize_t)sizeof(*h) || h->r.magic != WBC_RECORD_MAGIC
+            || h->r.seq != seq || h->r.nblocks > WBC_RECORD_BLOCKS || ((h->r.flags & WBC_TRIM) && h->r.nblocks != 2)) {
+        return -1;
+    }
+    uint64_t bytes = record_bytes(h->r.flags, h->r.nblocks);
+    if (pos % c->super.log_size + bytes > c->super.log_size
+            || (bytes > sizeof(*h) && pread(c->fd, data, bytes - sizeof(*h), phys(c, pos) + sizeof(*h)) != (ssize_t)(bytes - sizeof(*h)))) {
+        return -1;
+    }
+    uint32_t crc = h->r.crc;
+    h->r.crc = 0;
+    return crc == crc32c(crc32c(0, h, sizeof(*h)), data, bytes - sizeof(*h)) ? 0 : -1;
+}
+
+/* Rebuild the map from the records between the tail and the first one that
+ * is missing or torn. */
+static int replay(struct wbcache *c) {
+    union wbc_header h;
+    char *data = malloc(WBC_RECORD_BLOCKS * WBC_BLOCK_SIZE);
+    if (data == NULL) {
+        perror("wbcache");
+        return -1;
+    }
+    uint64_t pos = c->super.tail, seq = c->super.tail_seq, records = 0;
+    for (;;) {
+        uint64_t at = pos;
+        if (read_record(c, at, seq, &h, data) != 0) {
+            // the writer starts over at the beginning when a record doesn't fit before the end
+            if (at % c->super.log_size == 0) break;
+            at += c->super.log_size - at % c->super.log_size;
+            if (read_record(c, at, seq, &h, data) != 0) break;
+        }
+        apply(c, &h.r, at);
+        pos = at + record_bytes(h.r.flags, h.r.nblocks);
+        seq++;
+        records++;
+    }
+    free(data);
+    c->tail = c->super.tail;
+    c->head = pos;
+    c->seq = seq;
+    if (records > 0) {
+        fprintf(stderr, "wbcache: recovered %u dirty blocks from %lu log records in %s\n", c->dirty, records, c->path);
+    }
+    return 0;
+}
+
+void wbcache_resize(struct wbcache *c, uint64_t size, uint64_t stripe_bytes) {
+    // blocks past the old size can't be dirty yet, so the cache simply takes them on
+    __atomic_store_n(&c->stripe, stripe_bytes % WBC_BLOCK_SIZE == 0 ? stripe_bytes / WBC_BLOCK_SIZE : 0, __ATOMIC_RELAXED);
+    if (size / WBC_BLOCK_SIZE * WBC_BLOCK_SIZE > c->size) {
+        __atomic_store_n(&c->size, size / WBC_BLOCK_SIZE * WBC_BLOCK_SIZE, __ATOMIC_RELAXED);
+    }
+}
+
+struct wbcache *wbcache_wrap(struct buse_operations *bop, void **userdata, const char *path, uint64_t stripe_bytes) {
+    struct wbcache *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        perror("wbcache");
+        return NULL;
+    }
+    c->inner = *bop;
+    c->inner_userdata = *userdata;
+    c->path = path;
+    uint64_t size = bop->size ? bop->size : bop->size_blocks * bop->blksize;
+    c->size = size / WBC_BLOCK_SIZE * WBC_BLOCK_SIZE;
+    c->stripe = stripe_bytes % WBC_BLOCK_SIZE == 0 ? stripe_bytes / WBC_BLOCK_SIZE : 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    pthread_cond_init(&c->space, NULL);
+    pthread_mutex_init(&c->write_lock, NULL);
+    pthread_mutex_init(&c->backend_lock, NULL);
+    pthread_mutex_init(&c->destage_lock, NULL);
+    pthread_rwlock_init(&c->reclaim_lock, NULL);
+
+    c->fd = open(path, O_RDWR);
+    if (c->fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    uint64_t dev_size = lseek(c->fd, 0, SEEK_END);
+    uint64_t log_size = dev_size > WBC_LOG_START ? (dev_size - WBC_LOG_START) / WBC_BLOCK_SIZE * WBC_BLOCK_SIZE : 0;
+    uint64_t min_size = 4 * (WBC_RECORD_BLOCKS + 1) * WBC_BLOCK_SIZE;
+    if (super_load(c) != 0) {
+        if (log_size < min_size) {
+            fprintf(stderr, "ERROR: cache device %s is too small, it needs at least %lu bytes.\n", path, WBC_LOG_START + min_size);
+            return NULL;
+        }
+        fprintf(stderr, "wbcache: initializing %s with a %lu-byte log\n", path, log_size);
+        c->super = (struct wbc_super){ .dev_size = c->size, .log_size = log_size, .tail = 0, .tail_seq = 1 };
+        memcpy(c->super.magic, WBC_MAGIC, 8);
+        if (super_write(c, &c->super) != 0) {
+            return NULL;
+        }
+    } else if (c->super.dev_size > c->size || c->super.log_size > log_size) {
+        // a device that grew online is fine, the log only holds blocks below its old size
+        fprintf(stderr, "ERROR: cache device %s belongs to a device of %lu bytes with a %lu-byte log.\n", path,
+                c->super.dev_size, c->super.log_size);
+        return NULL;
+    }
+
+    if (c->super.log_size / WBC_BLOCK_SIZE > INT32_MAX) {
+        fprintf(stderr, "ERROR: the log on cache device %s is too large.\n", path);
+        return NULL;
+    }
+    uint32_t capacity = c->super.log_size / WBC_BLOCK_SIZE;
+    for (c->nbuckets = 1; c->nbuckets < capacity; c->nbuckets *= 2);
+    c->entries = malloc(capacity * sizeof(*c->entries));
+    c->buckets = malloc(c->nbuckets * sizeof(*c->buckets));
+    if (c->entries == NULL || c->buckets == NULL) {
+        perror("wbcache");
+        return NULL;
+    }
+    memset(c->buckets, 0xff, c->nbuckets * sizeof(*c->buckets)); // all -1
+    for (uint32_t i=0; i < capacity; i++) {
+        c->entries[i] = (struct wbc_entry){ .hnext = i + 1 < capacity ? (int32_t)i + 1 : -1 };
+    }
+    if (replay(c) != 0) {
+        return NULL;
+    }
+    if (c->super.dev_size != c->size) {
+        fprintf(stderr, "wbcache: the device grew from %lu to %lu bytes, %s caches all of it now\n", c->super.dev_size, c->size, path);
+        c->super.dev_size = c->size;
+        if (super_write(c, &c->super) != 0) {
+            return NULL;
+        }
+    }
+    c->last_write_us = now_us();
+
+    pthread_t destager;
+    if (pthread_create(&destager, NULL, destage_thread, c) != 0) {
+        fprintf(stderr, "ERROR: can't start the destage thread.\n");
+        return NULL;
+    }
+    pthread_detach(destager);
+
+    bop->read = wbc_read;
+    bop->write = wbc_write;
+    bop->disc = wbc_disc;
+    bop->flush = wbc_flush;
+    if (bop->trim) bop->trim = wbc_trim;
+    *userdata = c;
+    return c;
+}
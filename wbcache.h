@@ -0,0 +1,47 @@
+#ifndef WBCACHE_H_INCLUDED
+#define WBCACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buse.h"
+
+/*
+ * Write-back cache on a fast device (an SSD or a file on one) in front of any
+ * backend.
+ *
+ * Writes are appended to a circular log on the cache device and acknowledged
+ * from there; a flush only has to sync the cache device, and the backend if
+ * a trim or a write past the cached size went to it directly. Each log record is a
+ * header block listing the WBC_BLOCK_SIZE blocks it holds, followed by their
+ * data, and is checked with a CRC32C. Reads of dirty blocks are served from
+ * the log. A background thread destages the dirty blocks to the backend,
+ * sorted by address and coalesced into large writes; where at least half of
+ * a stripe is dirty the rest is read in, so the backend sees a full-stripe
+ * write. Once the destaged data is flushed on the backend, the log tail moves
+ * up in a superblock that is kept in two copies. On start the log is
+ * replayed from the tail, so acknowledged writes survive a crash.
+ */
+
+#define WBC_BLOCK_SIZE 4096
+#define WBC_RECORD_BLOCKS 508     // data blocks per log record, as many as its header block can list
+#define WBC_DESTAGE_PCT 50        // destage once the log is this full...
+#define WBC_IDLE_MS 1000          // ...or has seen no writes for this long
+#define WBC_BATCH_BYTES (4 << 20) // largest write sent to the backend
+
+struct wbcache;
+
+/* Put the write-back cache on the device or file at path in front of *bop,
+ * which serves *userdata, as cache_wrap() does. stripe_bytes is the backend's
+ * full-stripe size, or 0 if it has none. Dirty blocks left in the log by an
+ * earlier run are recovered. Returns NULL on error (reported). */
+struct wbcache *wbcache_wrap(struct buse_operations *bop, void **userdata, const char *path, uint64_t stripe_bytes);
+
+/* Tell the cache that the backend grew to size bytes, with full stripes of
+ * stripe_bytes now. Called by the grow path once the new space is usable. */
+void wbcache_resize(struct wbcache *c, uint64_t size, uint64_t stripe_bytes);
+
+/* Print dirty data, log use and destage statistics. */
+void wbcache_report(struct wbcache *c, FILE *out);
+
+#endif /* WBCACHE_H_INCLUDED */
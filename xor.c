@@ -0,0 +1,137 @@
+/*
+ * xor - vectorized parity kernels
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_X86 1
+#endif
+
+typedef void (*xor_fn)(void *dst, void *const *srcs, int nsrc, size_t n);
+
+/* Bytes left over after the vector loop (and unaligned buffers in general)
+ * go through the word-at-a-time version. memcpy keeps the loads legal for any
+ * alignment and compiles to plain moves. */
+static void xor_generic(void *dst, void *const *srcs, int nsrc, size_t n) {
+    char *d = dst;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t acc, w;
+        memcpy(&acc, (char *)srcs[0] + i, 8);
+        for (int s = 1; s < nsrc; s++) {
+            memcpy(&w, (char *)srcs[s] + i, 8);
+            acc ^= w;
+        }
+        memcpy(d + i, &acc, 8);
+    }
+    for (; i < n; i++) {
+        char acc = ((char *)srcs[0])[i];
+        for (int s = 1; s < nsrc; s++) {
+            acc ^= ((char *)srcs[s])[i];
+        }
+        d[i] = acc;
+    }
+}
+
+#ifdef XOR_X86
+__attribute__((target("sse2")))
+static void xor_sse2(void *dst, void *const *srcs, int nsrc, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        // four registers in flight per source to hide load latency
+        const char *p = (const char *)srcs[0] + i;
+        __m128i a0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(p + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(p + 48));
+        for (int s = 1; s < nsrc; s++) {
+            p = (const char *)srcs[s] + i;
+            a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)p));
+            a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(p + 16)));
+            a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(p + 32)));
+            a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(p + 48)));
+        }
+        char *d = (char *)dst + i;
+        _mm_storeu_si128((__m128i *)d, a0);
+        _mm_storeu_si128((__m128i *)(d + 16), a1);
+        _mm_storeu_si128((__m128i *)(d + 32), a2);
+        _mm_storeu_si128((__m128i *)(d + 48), a3);
+    }
+    if (i < n) {
+        void *tail[nsrc];
+        for (int s = 0; s < nsrc; s++) tail[s] = (char *)srcs[s] + i;
+        xor_generic((char *)dst + i, tail, nsrc, n - i);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(void *dst, void *const *srcs, int nsrc, size_t n) {
+    size_t i = 0;
+    for (; i + 128 <= n; i += 128) {
+        const char *p = (const char *)srcs[0] + i;
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(p + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(p + 96));
+        for (int s = 1; s < nsrc; s++) {
+            p = (const char *)srcs[s] + i;
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)p));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+            a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(p + 64)));
+            a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(p + 96)));
+        }
+        char *d = (char *)dst + i;
+        _mm256_storeu_si256((__m256i *)d, a0);
+        _mm256_storeu_si256((__m256i *)(d + 32), a1);
+        _mm256_storeu_si256((__m256i *)(d + 64), a2);
+        _mm256_storeu_si256((__m256i *)(d + 96), a3);
+    }
+    if (i < n) {
+        void *tail[nsrc];
+        for (int s = 0; s < nsrc; s++) tail[s] = (char *)srcs[s] + i;
+        xor_sse2((char *)dst + i, tail, nsrc, n - i);
+    }
+}
+#endif
+
+static xor_fn xor_impl;
+
+static xor_fn xor_select(void) {
+    xor_fn fn = xor_generic;
+#ifdef XOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = xor_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        fn = xor_sse2;
+#endif
+    // every candidate gives the same result, so racing threads may both store theirs
+    __atomic_store_n(&xor_impl, fn, __ATOMIC_RELAXED);
+    return fn;
+}
+
+void xor_blocks(void *dst, void *const *srcs, int nsrc, size_t n) {
+    if (nsrc <= 0) {
+        memset(dst, 0, n);
+        return;
+    }
+    xor_fn fn = __atomic_load_n(&xor_impl, __ATOMIC_RELAXED);
+    if (fn == NULL)
+        fn = xor_select();
+    fn(dst, srcs, nsrc, n);
+}
+
+void xor_into(void *dst, const void *src, size_t n) {
+    void *srcs[2] = { dst, (void *)src };
+    xor_blocks(dst, srcs, 2, n);
+}
@@ -0,0 +1,18 @@
+#ifndef XOR_H_INCLUDED
+#define XOR_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * XOR kernels for parity. The widest implementation the CPU supports (AVX2,
+ * SSE2, or plain 64-bit words) is picked on first use.
+ */
+
+/* dst ^= src over n bytes. */
+void xor_into(void *dst, const void *src, size_t n);
+
+/* dst = srcs[0] ^ srcs[1] ^ ... ^ srcs[nsrc-1] over n bytes, in one pass over
+ * dst. dst may be one of the sources. */
+void xor_blocks(void *dst, void *const *srcs, int nsrc, size_t n);
+
+#endif /* XOR_H_INCLUDED */